@@ -48,14 +48,14 @@ function jsregexp.compile_safe(re, flags) end
 function jsregexp.escape(str) end
 
 ---
----Convert a lua utf8 lua string to a utf16 js string. For internal use.
+---Convert a lua utf8 string to a validated js string. For internal use.
 ---
 ---@param str string
 ---@return JSRegExp.JSString
 function jsregexp.to_jsstring(str) end
 
 ---
----UTF-16 representation of a string. For internal use.
+---Validated UTF-8 string, with its UTF-16 conversion if needed. For internal use.
 ---
 ---@class JSRegExp.JSString
 
@@ -70,10 +70,14 @@ function jsregexp.to_jsstring(str) end
 ---@field global boolean is the global flag set?
 ---@field has_indices boolean is the indices flag set?
 ---@field ignore_case boolean is the ignore_case flag set?
+---@field linear boolean is the linear flag set?
 ---@field multiline boolean is the multiline flag set?
 ---@field sticky boolean is the sticky flag set?
 ---@field unicode boolean is the unicode flag set?
 ---@field unicode_sets boolean is the unicode_sets flag set?
+---@field max_steps integer maximum number of steps of each execution, 0 if unlimited (checked every 10000 steps)
+---@field timeout integer maximum duration in microseconds of each execution, 0 if unlimited
+---@field max_stack integer maximum size in bytes of the backtracking stack, 0 if unlimited
 local re = {}
 
 ---
@@ -241,12 +245,23 @@ function re:replace(string, replacement) end
 ---@return string
 function re:replace_all(string, replacement) end
 
----@class JSRegExp.Match : table
+---
+---Match object, the fields are built when they are accessed.
+---
+---@class JSRegExp.Match : userdata
+---@field [integer] string The full match (0) and the match groups
 ---@field input string The input string
 ---@field capture_count integer The number of capture groups
 ---@field index integer The start of the capture (1-based)
 ---@field groups table<string,string> Table of the named groups and their content
 ---@field indices JSRegExp.MatchIndices Array of begin/end indices of numbered match groups (if `"d"` flag is set)
+local match = {}
+
+---
+---Convert the match object to a table with all the fields.
+---
+---@return table
+function match:totable() end
 
 ---@class JSRegExp.MatchIndices : table
 ---@field groups table Table of named groups and their begin/end indices (if `"d"` flag is set)
@@ -0,0 +1,43 @@
+-- Times regexp:exec() on a small corpus and regexp:search() on a large input,
+-- run with `make bench`.
+-- `make bench` builds without the JIT so that the interpreter is timed, run
+-- `make bench BENCH_CFLAGS=-DLRE_NO_DIRECT_DISPATCH` to compare the dispatch.
+local jsregexp = require("jsregexp")
+
+local corpus = {
+	{ "(a|b|c)*d", "", string.rep("abc", 16) .. "d" },
+	{ "(\\w+)@(\\w+)\\.com", "", "hello world foo bar baz qux me@example.com" },
+	{ "(x+x+)+y", "", string.rep("x", 12) },
+	{ "<([a-z]+)[^>]*>(.*?)</\\1>", "", '<div class="a">hello <b>world</b></div>' },
+	{ "\\b(\\w+)\\s+\\1\\b", "", "the quick brown fox fox jumps" },
+	{ "(?:[01]?\\d|2[0-3]):[0-5]\\d(?::[0-5]\\d)?", "", "meeting at 23:59:01 today" },
+	{ "(a+)+b", "", string.rep("a", 18) .. "b" },
+	{ "(?=.*\\d)(?=.*[a-z])\\w{8,}", "", "password123abc" },
+	{ "(\\w+)\\s(\\w+)", "i", "αβγ Hello World δ" },
+	{ "[α-ω]+(ab|cd)*e", "", "ξξ αβγababcde" },
+	{ "[0-9]+-[0-9]+", "", "abc12-34 " .. string.rep("x", 1e6), "search" },
+}
+
+local min_time = tonumber(arg and arg[1]) or 0.5
+local total = 0
+
+for _, case in ipairs(corpus) do
+	local regex, flags, str = case[1], case[2], case[3]
+	local r = jsregexp.compile(regex, flags)
+	local method = r[case[4] or "exec"]
+	local input = jsregexp.to_jsstring(str)
+	local iters = 0
+	local start = os.clock()
+	local elapsed
+	repeat
+		for _ = 1, 1000 do
+			method(r, input)
+		end
+		iters = iters + 1000
+		elapsed = os.clock() - start
+	until elapsed >= min_time
+	local ns = elapsed / iters * 1e9
+	total = total + ns
+	print(string.format("%-45s %10.1f ns", (case[4] or "exec") .. " " .. regex, ns))
+end
+print(string.format("%-45s %10.1f ns", "total", total))
@@ -6,23 +6,38 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 #include "libregexp/cutils.h"
 #include "libregexp/libregexp.h"
 
 #define CAPTURE_COUNT_MAX 255 /* from libregexp.c */
+#define INTERRUPT_COUNTER_INIT 10000 /* from libregexp.c */
 #define JSREGEXP_MT "jsregexp_meta"
 #define JSREGEXP_MATCH_MT "jsregexp_match_meta"
+#define JSREGEXP_MATCH_TABLE_MT "jsregexp_match_table_meta"
 #define JSSTRING_MT "jsstring_meta"
+// number of exec() calls on 8 bit strings before compiling to native code
+#define JIT_EXEC_THRESHOLD 8
+// largest backtracking stack (in bytes) kept by a regexp between exec() calls
+#define EXEC_STACK_SIZE_MAX (64 * 1024)
 
 #if LUA_VERSION_NUM >= 502
 #define new_lib(L, l) (luaL_newlib(L, l))
 #define lua_tbl_len(L, arg) (lua_rawlen(L, arg))
 #define lua_set_functions(L, fs) luaL_setfuncs(L, fs, 0)
+#define lua_set_env(L, arg) lua_setuservalue(L, arg)
+#define lua_get_env(L, arg) lua_getuservalue(L, arg)
 #else
 #define new_lib(L, l) (lua_newtable(L), luaL_register(L, NULL, l))
 #define lua_tbl_len(L, arg) (lua_objlen(L, arg))
 #define lua_set_functions(L, fs) luaL_register(L, NULL, fs);
+#define lua_set_env(L, arg) lua_setfenv(L, arg)
+#define lua_get_env(L, arg) lua_getfenv(L, arg)
 #endif
 
 #if LUA_VERSION_NUM < 503
@@ -31,37 +46,138 @@
 
 #define streq(X, Y) ((*(X) == *(Y)) && strcmp(X, Y) == 0)
 
+struct jsstring {
+  bool is_utf8;        // contains non-ascii chars, matched as utf8
+  bool has_non_bmp;    // contains chars above U+FFFF
+  bool has_surrogates; // contains utf8 encoded utf16 surrogates
+  uint32_t len;        // length in bytes
+  const char *bstr;    // base string passed in, owned by lua
+  int ref;             // registry reference to the lua string of bstr, or
+                       // LUA_NOREF if it is only kept on the stack
+  // utf16 conversion, only built for the regexps which cannot run on utf8
+  uint16_t *str16;
+  uint32_t len16;
+  uint32_t *indices;
+  uint32_t *rev_indices;
+};
+
+struct regexp {
+  char *expr;
+  uint8_t *bc;
+  uint32_t last_index;
+  LREJit *jit;          // native code, NULL if not (yet) compiled
+  uint32_t exec_count;
+  LREStack *stack;      // backtracking stack reused by the exec calls
+  // execution limits, 0 if unlimited
+  uint64_t max_steps;   // checked every INTERRUPT_COUNTER_INIT steps
+  uint64_t timeout;     // in microseconds
+  uint64_t max_stack;   // size in bytes of the backtracking stack
+  // the last lua string validated by exec(), test() or search(), which is kept
+  // in the environment of the regexp so that it is only scanned once
+  struct jsstring last_input;
+};
+
+enum exec_limit {
+  EXEC_LIMIT_NONE,
+  EXEC_LIMIT_STEPS,
+  EXEC_LIMIT_TIMEOUT,
+  EXEC_LIMIT_STACK,
+};
+
+// passed as opaque to the lre_exec functions of a regexp with limits
+struct exec_state {
+  const struct regexp *r;
+  uint64_t steps;
+  uint64_t deadline;
+  enum exec_limit exceeded; // the limit which stopped the execution
+};
+
+// monotonic time in microseconds
+static uint64_t time_us(void) {
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return count.QuadPart / freq.QuadPart * 1000000 +
+         count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 // these two functions need to be defined for libregexp
 void *lre_realloc(void *opaque, void *ptr, size_t size) {
   return realloc(ptr, size);
 }
 
 BOOL lre_check_stack_overflow(void *opaque, size_t alloca_size) {
+  struct exec_state *st = opaque;
+  if (st && st->r->max_stack && alloca_size > st->r->max_stack) {
+    st->exceeded = EXEC_LIMIT_STACK;
+    return TRUE;
+  }
   return FALSE;
 }
 
+// called by libregexp every INTERRUPT_COUNTER_INIT steps
 int lre_check_timeout(void *opaque) {
+  struct exec_state *st = opaque;
+  if (!st) {
+    return 0;
+  }
+  st->steps += INTERRUPT_COUNTER_INIT;
+  if (st->r->max_steps && st->steps > st->r->max_steps) {
+    st->exceeded = EXEC_LIMIT_STEPS;
+    return 1;
+  }
+  if (st->r->timeout && time_us() >= st->deadline) {
+    st->exceeded = EXEC_LIMIT_TIMEOUT;
+    return 1;
+  }
   return 0;
 }
 
-struct regexp {
-  char *expr;
-  uint8_t *bc;
-  uint32_t last_index;
-};
+// returns the opaque pointer to pass to libregexp, NULL if the regexp has no
+// limits
+static void *exec_state_init(struct exec_state *st, const struct regexp *r) {
+  if (!r->max_steps && !r->timeout && !r->max_stack) {
+    return NULL;
+  }
+  st->r = r;
+  st->steps = 0;
+  st->deadline = r->timeout ? time_us() + r->timeout : 0;
+  st->exceeded = EXEC_LIMIT_NONE;
+  return st;
+}
+
+// backtracking stack passed to the lre_exec functions. The stack kept between
+// the calls is only checked against max_stack when it grows, so the calls with
+// a stack limit start from an empty stack.
+static inline LREStack *exec_stack(const struct regexp *r) {
+  return r->max_stack ? NULL : r->stack;
+}
+
+// raises the error for a negative return value of the lre_exec functions, st
+// is the opaque pointer passed to them
+static int exec_error(lua_State *lstate, const struct exec_state *st, int ret) {
+  switch (st ? st->exceeded : EXEC_LIMIT_NONE) {
+  case EXEC_LIMIT_STEPS:
+    return luaL_error(lstate, "step limit exceeded in regexp execution");
+  case EXEC_LIMIT_TIMEOUT:
+    return luaL_error(lstate, "timeout in regexp execution");
+  case EXEC_LIMIT_STACK:
+    return luaL_error(lstate, "stack limit exceeded in regexp execution");
+  default:
+    break;
+  }
+  if (ret == LRE_RET_TIMEOUT) {
+    return luaL_error(lstate, "timeout in regexp execution");
+  }
+  return luaL_error(lstate, "out of memory in regexp execution");
+}
 
-struct jsstring {
-  bool is_wide_char;
-  uint32_t len;
-  char *bstr;        // base string passed in
-  uint32_t bstr_len; // base string length
-  uint32_t *indices;
-  uint32_t *rev_indices;
-  union {
-    uint8_t *str8; /* 8 bit strings will get an extra null terminator */
-    uint16_t *str16;
-  } u;
-};
 
 // check for bytes higher or equal to 0xf0
 static inline bool utf8_contains_non_bmp(const char *s) {
@@ -74,15 +190,42 @@ static inline bool utf8_contains_non_bmp(const char *s) {
   return false;
 }
 
-static inline bool utf8_contains_non_ascii(const char *s) {
-  while (*s) {
-    if (*s++ & 0x80) {
+// the n bytes of s are checked, lua strings can contain NULs
+static inline bool utf8_contains_non_ascii(const char *s, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (s[i] & 0x80) {
       return true;
     }
   }
   return false;
 }
 
+// returns false when malformed unicode is encountered in the n bytes of s
+// (including truncated sequences and chars above U+10FFFF), otherwise sets the
+// flags describing which chars the string contains
+static inline bool utf8_scan(const uint8_t *s, size_t n, bool *non_bmp,
+                             bool *surrogates) {
+  const uint8_t *end = s + n;
+  *non_bmp = false;
+  *surrogates = false;
+  while (s < end) {
+    if (*s < 0x80) {
+      s++;
+      continue;
+    }
+    int c = unicode_from_utf8(s, min_int64(end - s, UTF8_CHAR_LEN_MAX), &s);
+    if (c == -1 || c > 0x10ffff) {
+      return false;
+    }
+    if (c > 0xffff) {
+      *non_bmp = true;
+    } else if (c >= 0xd800 && c <= 0xdfff) {
+      *surrogates = true;
+    }
+  }
+  return true;
+}
+
 // returns NULL when malformed unicode is encountered, otherwise returns the
 // converted string. *utf16_len will contain the length of the string and
 // *indices an (allocated) array mapping each utf16 code point to the utf8 code
@@ -96,11 +239,13 @@ static inline uint16_t *utf8_to_utf16(const uint8_t *input, uint32_t n,
   uint16_t *str = malloc((n + 1) * sizeof *str);
   uint16_t *q = str;
   const uint8_t *pos = input;
-  while (*pos) {
+  const uint8_t *end = input + n;
+  while (pos < end) {
     (*indices)[q - str] = pos - input;
     (*rev_indices)[pos - input] = q - str;
-    int c = unicode_from_utf8(pos, UTF8_CHAR_LEN_MAX, &pos);
-    if (c == -1) {
+    int c = unicode_from_utf8(pos, min_int64(end - pos, UTF8_CHAR_LEN_MAX),
+                              &pos);
+    if (c == -1 || c > 0x10ffff) {
       // malformed
       free(str);
       free(*indices);
@@ -123,6 +268,50 @@ static inline uint16_t *utf8_to_utf16(const uint8_t *input, uint32_t n,
   return str;
 }
 
+// describes the string input in s without copying it, returns false when
+// malformed unicode is encountered
+static bool jsstring_init(struct jsstring *s, const char *input, size_t len) {
+  s->is_utf8 = utf8_contains_non_ascii(input, len);
+  s->has_non_bmp = false;
+  s->has_surrogates = false;
+  if (s->is_utf8 && !utf8_scan((uint8_t *)input, len, &s->has_non_bmp,
+                               &s->has_surrogates)) {
+    return false;
+  }
+  s->len = len;
+  s->bstr = input;
+  s->ref = LUA_NOREF;
+  s->str16 = NULL;
+  s->len16 = 0;
+  s->indices = NULL;
+  s->rev_indices = NULL;
+  return true;
+}
+
+// pushes a jsstring userdata for the string described by s, which is the lua
+// string at index arg. The lua string is referenced instead of copied.
+static void jsstring_push(lua_State *lstate, const struct jsstring *s,
+                          int arg) {
+  lua_pushvalue(lstate, arg);
+  const int ref = luaL_ref(lstate, LUA_REGISTRYINDEX);
+  struct jsstring *ud = lua_newuserdata(lstate, sizeof(*ud));
+  *ud = *s;
+  ud->ref = ref;
+  luaL_getmetatable(lstate, JSSTRING_MT);
+  lua_setmetatable(lstate, -2);
+}
+
+// pushes the lua string of s, arg is the index of s (or of the string if s is
+// only a view)
+static void jsstring_push_lstring(lua_State *lstate, const struct jsstring *s,
+                                  int arg) {
+  if (s->ref == LUA_NOREF) {
+    lua_pushvalue(lstate, arg);
+  } else {
+    lua_rawgeti(lstate, LUA_REGISTRYINDEX, s->ref);
+  }
+}
+
 static int jsstring_new(lua_State *lstate) {
   if (lua_isuserdata(lstate, 1)) {
     luaL_checkudata(lstate, 1, JSSTRING_MT);
@@ -131,39 +320,12 @@ static int jsstring_new(lua_State *lstate) {
   }
 
   size_t input_len;
-  const uint8_t *input = (uint8_t *)luaL_checklstring(lstate, 1, &input_len);
-  struct jsstring *ud;
-  if (utf8_contains_non_ascii((char *)input)) {
-    uint32_t *indices;
-    uint32_t *rev_indices;
-    uint32_t input_utf16_len;
-    uint16_t *input_utf16 = utf8_to_utf16(input, input_len, &input_utf16_len,
-                                          &indices, &rev_indices);
-
-    if (!input_utf16) {
-      return luaL_error(lstate, "malformed unicode");
-    }
-
-    ud = lua_newuserdata(lstate, sizeof(*ud));
-    ud->is_wide_char = true;
-    ud->len = input_utf16_len;
-    ud->u.str16 = input_utf16;
-    ud->bstr = strdup((char *)input);
-    ud->bstr_len = input_len;
-    ud->indices = indices;
-    ud->rev_indices = rev_indices;
-  } else {
-    ud = lua_newuserdata(lstate, sizeof(*ud));
-    ud->is_wide_char = false;
-    ud->len = input_len;
-    ud->bstr_len = input_len;
-    ud->u.str8 = (uint8_t *)strdup((char *)input);
-    ud->bstr = (char *)ud->u.str8;
-    ud->indices = NULL;
-    ud->rev_indices = NULL;
+  const char *input = luaL_checklstring(lstate, 1, &input_len);
+  struct jsstring s;
+  if (!jsstring_init(&s, input, input_len)) {
+    return luaL_error(lstate, "malformed unicode");
   }
-  luaL_getmetatable(lstate, JSSTRING_MT);
-  lua_setmetatable(lstate, -2);
+  jsstring_push(lstate, &s, 1);
   return 1;
 }
 
@@ -213,13 +375,10 @@ static int jsregexp_escape(lua_State *L) {
 
 static int jsstring_gc(lua_State *lstate) {
   struct jsstring *s = lua_touserdata(lstate, 1);
-  free(s->u.str8);
+  luaL_unref(lstate, LUA_REGISTRYINDEX, s->ref);
+  free(s->str16);
   free(s->indices);
-
-  if (s->is_wide_char) {
-    free(s->bstr);
-    free(s->rev_indices);
-  }
+  free(s->rev_indices);
   return 0;
 }
 
@@ -238,8 +397,100 @@ static inline struct jsstring *lua_tojsstring(lua_State *lstate, int arg) {
   }
 }
 
+// utf8 strings are matched in place, except by the regexps without the unicode
+// flags when the string has chars above U+FFFF (they are matched as two utf16
+// units) and when it has encoded surrogates (which could form pairs). In these
+// cases the string is converted to utf16 once.
+static inline bool jsstring_in_place(const struct jsstring *s,
+                                     const struct regexp *r) {
+  const int flags = lre_get_flags(r->bc);
+  return !s->is_utf8 ||
+         (!s->has_surrogates &&
+          (!s->has_non_bmp ||
+           (flags & (LRE_FLAG_UNICODE | LRE_FLAG_UNICODE_SETS))));
+}
+
+// the input of exec(), test() and search() of the regexp r at index 1: a lua
+// string which can be matched in place is only described in *view, without
+// copying it into a jsstring userdata. The view is valid as long as the
+// argument stays on the stack. The string is only validated when it differs
+// from the one of the previous call.
+static struct jsstring *lua_tojsstring_view(lua_State *lstate, int arg,
+                                            struct regexp *r,
+                                            struct jsstring *view) {
+  if (lua_type(lstate, arg) != LUA_TSTRING) {
+    return lua_tojsstring(lstate, arg);
+  }
+  size_t len;
+  const char *input = lua_tolstring(lstate, arg, &len);
+  lua_get_env(lstate, 1);
+  lua_rawgeti(lstate, -1, 1);
+  if (lua_rawequal(lstate, -1, arg)) {
+    *view = r->last_input;
+    view->bstr = input;
+    lua_pop(lstate, 2);
+  } else {
+    if (!jsstring_init(view, input, len)) {
+      luaL_error(lstate, "malformed unicode");
+    }
+    r->last_input = *view;
+    lua_pushvalue(lstate, arg);
+    lua_rawseti(lstate, -3, 1);
+    lua_pop(lstate, 2);
+  }
+  if (jsstring_in_place(view, r)) {
+    return view;
+  }
+  // the utf16 conversion is kept with the copy
+  jsstring_push(lstate, view, arg);
+  lua_replace(lstate, arg);
+  return lua_touserdata(lstate, arg);
+}
+
+// returns the cbuf_type to run the regexp with and sets *cbuf and *clen, see
+// jsstring_in_place
+static int jsstring_cbuf(lua_State *lstate, struct jsstring *s,
+                         const struct regexp *r, const uint8_t **cbuf,
+                         uint32_t *clen) {
+  if (jsstring_in_place(s, r)) {
+    *cbuf = (uint8_t *)s->bstr;
+    *clen = s->len;
+    return s->is_utf8 ? 3 : 0;
+  }
+  if (!s->str16) {
+    s->str16 = utf8_to_utf16((uint8_t *)s->bstr, s->len, &s->len16,
+                             &s->indices, &s->rev_indices);
+    if (!s->str16) {
+      luaL_error(lstate, "malformed unicode");
+    }
+  }
+  *cbuf = (uint8_t *)s->str16;
+  *clen = s->len16;
+  return 1;
+}
+
+// byte offset in the base string of the index i of cbuf
+static inline uint32_t jsstring_offset(const struct jsstring *s, int cbuf_type,
+                                       uint32_t i) {
+  if (cbuf_type == 1) {
+    return s->indices[i];
+  }
+  return i;
+}
+
+// byte offset in the base string of the position p of cbuf
+static inline uint32_t jsstring_index(const struct jsstring *s, int cbuf_type,
+                                      const uint8_t *cbuf, const uint8_t *p) {
+  if (cbuf_type == 1) {
+    return s->indices[(p - cbuf) / 2];
+  }
+  return p - cbuf;
+}
+
 static int regexp_gc(lua_State *lstate) {
   struct regexp *r = lua_touserdata(lstate, 1);
+  lre_jit_free(r->jit, NULL);
+  lre_stack_free(r->stack, NULL);
   free(r->bc);
   free(r->expr);
   return 0;
@@ -250,14 +501,16 @@ static void regexp_pushflags(lua_State *lstate, const struct regexp *r) {
   const char *indices = (flags & LRE_FLAG_INDICES) ? "d" : "";
   const char *ignorecase = (flags & LRE_FLAG_IGNORECASE) ? "i" : "";
   const char *global = (flags & LRE_FLAG_GLOBAL) ? "g" : "";
+  const char *linear = (flags & LRE_FLAG_LINEAR) ? "l" : "";
   const char *multiline = (flags & LRE_FLAG_MULTILINE) ? "m" : "";
   const char *named_groups = (flags & LRE_FLAG_NAMED_GROUPS) ? "n" : "";
   const char *dotall = (flags & LRE_FLAG_DOTALL) ? "s" : "";
   const char *utf16 = (flags & LRE_FLAG_UNICODE) ? "u" : "";
   const char *unicode_sets = (flags & LRE_FLAG_UNICODE_SETS) ? "v" : "";
   const char *sticky = (flags & LRE_FLAG_STICKY) ? "y" : "";
-  lua_pushfstring(lstate, "%s%s%s%s%s%s%s%s%s", indices, ignorecase, global,
-                  multiline, named_groups, dotall, utf16, unicode_sets, sticky);
+  lua_pushfstring(lstate, "%s%s%s%s%s%s%s%s%s%s", indices, ignorecase, global,
+                  linear, multiline, named_groups, dotall, utf16, unicode_sets,
+                  sticky);
 }
 
 static int regexp_tostring(lua_State *lstate) {
@@ -268,36 +521,262 @@ static int regexp_tostring(lua_State *lstate) {
   return 1;
 }
 
-// automatic conversion to the global match string
-static int match_tostring(lua_State *lstate) {
-  // luaL_getmetatable(lstate, JSREGEXP_MATCH);
-  // if (!lua_getmetatable(lstate, 1) || !lua_equal(lstate, -1, -2)) {
-  //   return luaL_argerror(lstate, 1, "match object expected");
-  // }
-  lua_rawgeti(lstate, 1, 0);
+// match objects returned by exec() only keep the byte offsets of the captures,
+// the strings and tables are built when they are accessed. The environment
+// (uservalue) of the userdata is a table which keeps the input string and the
+// regexp alive and caches match.groups and match.indices once they are built.
+struct match {
+  const char *input;       // the input string, at MATCH_ENV_INPUT
+  const char *group_names; // of the regexp at MATCH_ENV_REGEXP, NULL if none
+  bool has_indices;        // the regexp has the d flag
+  uint32_t capture_count;
+  uint32_t capture[]; // start and end of each capture in the input
+};
+
+// offset of the groups which did not participate in the match
+#define MATCH_UNMATCHED UINT32_MAX
+
+// slots of the environment table of a match
+#define MATCH_ENV_INPUT 1
+#define MATCH_ENV_REGEXP 2
+
+// pushes the string of capture i, empty if it did not participate
+static void match_push_capture(lua_State *lstate, const struct match *m,
+                               int i) {
+  if (m->capture[2 * i] == MATCH_UNMATCHED) {
+    lua_pushliteral(lstate, "");
+    return;
+  }
+  lua_pushlstring(lstate, m->input + m->capture[2 * i],
+                  m->capture[2 * i + 1] - m->capture[2 * i]);
+}
+
+// pushes the slot key of the environment of the match at index 1
+static void match_push_env_field(lua_State *lstate, int key) {
+  lua_get_env(lstate, 1);
+  lua_rawgeti(lstate, -1, key);
+  lua_remove(lstate, -2);
+}
+
+// pushes match.groups, nil if the regexp has no group names. A name can be
+// used by several groups in alternatives, the one which participated in the
+// match is kept.
+static void match_build_groups(lua_State *lstate, const struct match *m) {
+  const char *group_names = m->group_names;
+  if (!group_names) {
+    lua_pushnil(lstate);
+    return;
+  }
+  lua_createtable(lstate, 0, m->capture_count);
+  for (uint32_t i = 1; i < m->capture_count; i++) {
+    if (*group_names) {
+      lua_getfield(lstate, -1, group_names);
+      const bool is_set = !lua_isnil(lstate, -1);
+      lua_pop(lstate, 1);
+      if (!is_set || m->capture[2 * i] != MATCH_UNMATCHED) {
+        match_push_capture(lstate, m, i);
+        lua_setfield(lstate, -2, group_names);
+      }
+    }
+    group_names += strlen(group_names) + LRE_GROUP_NAME_TRAILER_LEN;
+  }
+}
+
+// pushes match.indices, nil without the d flag
+static void match_build_indices(lua_State *lstate, const struct match *m) {
+  if (!m->has_indices) {
+    lua_pushnil(lstate);
+    return;
+  }
+  const char *group_names = m->group_names;
+  lua_createtable(lstate, m->capture_count, 1);
+  if (group_names) {
+    lua_createtable(lstate, 0, m->capture_count); // match.indices.groups
+    lua_pushvalue(lstate, -1);
+    lua_setfield(lstate, -3, "groups");
+  }
+  // [indices, groups?]
+  const int indices = group_names ? -3 : -2;
+  for (uint32_t i = 0; i < m->capture_count; i++) {
+    // nil for the groups which did not participate
+    if (m->capture[2 * i] == MATCH_UNMATCHED) {
+      if (i > 0 && group_names) {
+        group_names += strlen(group_names) + LRE_GROUP_NAME_TRAILER_LEN;
+      }
+      continue;
+    }
+    lua_createtable(lstate, 2, 0);
+    lua_pushinteger(lstate, m->capture[2 * i] + 1);
+    lua_rawseti(lstate, -2, 1);
+    lua_pushinteger(lstate, m->capture[2 * i + 1]);
+    lua_rawseti(lstate, -2, 2);
+    // [indices, groups?, {a, b}]
+    if (i > 0 && group_names) {
+      if (*group_names) {
+        lua_pushvalue(lstate, -1);
+        lua_setfield(lstate, -3, group_names);
+      }
+      group_names += strlen(group_names) + LRE_GROUP_NAME_TRAILER_LEN;
+    }
+    lua_rawseti(lstate, indices, i);
+  }
+  if (group_names) {
+    lua_pop(lstate, 1);
+  }
+}
+
+// pushes the field key of the match at index 1, which is built on the first
+// access and then cached in its environment. nil is not cached, it is cheap to
+// build.
+static void match_push_cached(lua_State *lstate, const struct match *m,
+                              const char *key,
+                              void (*build)(lua_State *,
+                                            const struct match *)) {
+  lua_get_env(lstate, 1);
+  lua_getfield(lstate, -1, key);
+  if (lua_isnil(lstate, -1)) {
+    lua_pop(lstate, 1);
+    build(lstate, m);
+    if (!lua_isnil(lstate, -1)) {
+      lua_pushvalue(lstate, -1);
+      lua_setfield(lstate, -3, key);
+    }
+  }
+  lua_remove(lstate, -2);
+}
+
+// the match as a table with all the fields, as exec() used to return it
+static int match_totable(lua_State *lstate) {
+  struct match *m = luaL_checkudata(lstate, 1, JSREGEXP_MATCH_MT);
+
+  lua_createtable(lstate, m->capture_count, 5);
+  luaL_getmetatable(lstate, JSREGEXP_MATCH_TABLE_MT);
+  lua_setmetatable(lstate, -2);
+
+  for (uint32_t i = 0; i < m->capture_count; i++) {
+    match_push_capture(lstate, m, i);
+    lua_rawseti(lstate, -2, i);
+  }
+  match_push_env_field(lstate, MATCH_ENV_INPUT);
+  lua_setfield(lstate, -2, "input");
+  lua_pushinteger(lstate, m->capture_count);
+  lua_setfield(lstate, -2, "capture_count");
+  lua_pushnumber(lstate, m->capture[0] + 1); // 1-based
+  lua_setfield(lstate, -2, "index");
+  match_push_cached(lstate, m, "groups", match_build_groups);
+  lua_setfield(lstate, -2, "groups");
+  match_push_cached(lstate, m, "indices", match_build_indices);
+  lua_setfield(lstate, -2, "indices");
   return 1;
 }
 
-// repeatedly running regexp:match(input) is not a good idea because we would
-// convert the string (at least from last_ind) to utf16 every time (if it is
-// needed)
-static int regexp_exec(lua_State *lstate) {
-  uint8_t *capture[CAPTURE_COUNT_MAX * 2];
+static int match_index(lua_State *lstate) {
+  struct match *m = luaL_checkudata(lstate, 1, JSREGEXP_MATCH_MT);
 
-  struct regexp *r = luaL_checkudata(lstate, 1, JSREGEXP_MT);
-  const struct jsstring *input = lua_tojsstring(lstate, 2);
+  if (lua_type(lstate, 2) == LUA_TNUMBER) {
+    const lua_Number n = lua_tonumber(lstate, 2);
+    if (n >= 0 && n < m->capture_count && n == (uint32_t)n) {
+      match_push_capture(lstate, m, (uint32_t)n);
+    } else {
+      lua_pushnil(lstate);
+    }
+    return 1;
+  }
 
+  const char *key = lua_tostring(lstate, 2);
+  if (!key) {
+    lua_pushnil(lstate);
+  } else if (streq(key, "index")) {
+    lua_pushnumber(lstate, m->capture[0] + 1); // 1-based
+  } else if (streq(key, "input")) {
+    match_push_env_field(lstate, MATCH_ENV_INPUT);
+  } else if (streq(key, "capture_count")) {
+    lua_pushinteger(lstate, m->capture_count);
+  } else if (streq(key, "groups")) {
+    match_push_cached(lstate, m, "groups", match_build_groups);
+  } else if (streq(key, "indices")) {
+    match_push_cached(lstate, m, "indices", match_build_indices);
+  } else if (streq(key, "totable")) {
+    lua_pushcfunction(lstate, match_totable);
+  } else {
+    lua_pushnil(lstate);
+  }
+  return 1;
+}
+
+// number of capture groups, as the length of the table returned by totable
+static int match_len(lua_State *lstate) {
+  struct match *m = luaL_checkudata(lstate, 1, JSREGEXP_MATCH_MT);
+  lua_pushinteger(lstate, m->capture_count - 1);
+  return 1;
+}
+
+static int match_ipairs_next(lua_State *lstate) {
+  struct match *m = luaL_checkudata(lstate, 1, JSREGEXP_MATCH_MT);
+  const lua_Integer i = luaL_checkinteger(lstate, 2) + 1;
+  if (i >= m->capture_count) {
+    return 0;
+  }
+  lua_pushinteger(lstate, i);
+  match_push_capture(lstate, m, i);
+  return 2;
+}
+
+// only used by lua 5.2, later versions use __index in ipairs
+static int match_ipairs(lua_State *lstate) {
+  lua_pushcfunction(lstate, match_ipairs_next);
+  lua_pushvalue(lstate, 1);
+  lua_pushinteger(lstate, 0);
+  return 3;
+}
+
+// lua 5.2 and later, iterates over the table returned by totable
+static int match_pairs(lua_State *lstate) {
+  lua_getglobal(lstate, "next");
+  match_totable(lstate);
+  lua_pushnil(lstate);
+  return 3;
+}
+
+// automatic conversion to the global match string, for the match objects and
+// the tables returned by totable
+static int match_tostring(lua_State *lstate) {
+  if (lua_istable(lstate, 1)) {
+    lua_rawgeti(lstate, 1, 0);
+  } else {
+    struct match *m = luaL_checkudata(lstate, 1, JSREGEXP_MATCH_MT);
+    match_push_capture(lstate, m, 0);
+  }
+  return 1;
+}
+
+static struct luaL_Reg match_meta[] = {{"__index", match_index},
+                                       {"__len", match_len},
+                                       {"__tostring", match_tostring},
+                                       {"__ipairs", match_ipairs},
+                                       {"__pairs", match_pairs},
+                                       {NULL, NULL}};
+
+// index of cbuf where the match starts: last_index for global or sticky
+// regexps, 0 otherwise. Returns false (and resets last_index) if last_index is
+// past the end of the input.
+static bool exec_start_index(struct regexp *r, const struct jsstring *input,
+                             int cbuf_type, uint32_t clen,
+                             uint32_t *start_index) {
   const int global = lre_get_flags(r->bc) & LRE_FLAG_GLOBAL;
   const int sticky = lre_get_flags(r->bc) & LRE_FLAG_STICKY;
   uint32_t rlast_index = r->last_index;
-  // translate wide char to correct index
-  if (input->is_wide_char) {
-    // only translate indices if possible
-    if (rlast_index > 0 && rlast_index <= input->bstr_len) {
-      // move to the next valid index, rlast_index might be somewhere within a
-      // multibyte character
-      while (rlast_index < input->bstr_len &&
-             !input->rev_indices[rlast_index]) {
+  if (cbuf_type == 3) {
+    // move to the next valid index, rlast_index might be somewhere within a
+    // multibyte character
+    while (rlast_index < input->len &&
+           (input->bstr[rlast_index] & 0xc0) == 0x80) {
+      rlast_index++;
+    }
+  } else if (cbuf_type == 1) {
+    // translate to the utf16 index, only if possible
+    if (rlast_index > 0 && rlast_index <= input->len) {
+      while (rlast_index < input->len && !input->rev_indices[rlast_index]) {
         rlast_index++;
       }
       rlast_index = input->rev_indices[rlast_index];
@@ -307,8 +786,33 @@ static int regexp_exec(lua_State *lstate) {
   if (!global && !sticky) {
     rlast_index = 0;
     r->last_index = 0;
-  } else if (rlast_index > input->len) {
+  } else if (rlast_index > clen) {
     r->last_index = 0;
+    return false;
+  }
+  *start_index = rlast_index;
+  return true;
+}
+
+// a lua string is matched in place and only validated when it differs from the
+// input of the previous call, so exec() can be run in a loop on the same
+// string. Alternating between strings scans each of them on every call, and
+// the strings which need the utf16 conversion are converted every time: loops
+// over those should pass a to_jsstring() instead.
+static int regexp_exec(lua_State *lstate) {
+  uint8_t *capture[CAPTURE_COUNT_MAX * 2];
+
+  struct regexp *r = luaL_checkudata(lstate, 1, JSREGEXP_MT);
+  struct jsstring view;
+  struct jsstring *input = lua_tojsstring_view(lstate, 2, r, &view);
+  const uint8_t *cbuf;
+  uint32_t clen;
+  const int cbuf_type = jsstring_cbuf(lstate, input, r, &cbuf, &clen);
+
+  const int global = lre_get_flags(r->bc) & LRE_FLAG_GLOBAL;
+  const int sticky = lre_get_flags(r->bc) & LRE_FLAG_STICKY;
+  uint32_t rlast_index;
+  if (!exec_start_index(r, input, cbuf_type, clen, &rlast_index)) {
     return 0;
   }
 
@@ -316,12 +820,20 @@ static int regexp_exec(lua_State *lstate) {
   const char *group_names = lre_get_groupnames(r->bc);
   const bool has_indices = lre_get_flags(r->bc) & LRE_FLAG_INDICES;
 
-  const int ret =
-      lre_exec(capture, r->bc, (uint8_t *)input->u.str8, rlast_index,
-               input->len, input->is_wide_char ? 1 : 0, NULL);
+  // the native code only runs on 8 bit strings, compile it once the
+  // regexp is used often enough
+  if (cbuf_type == 0 && r->exec_count <= JIT_EXEC_THRESHOLD &&
+      ++r->exec_count == JIT_EXEC_THRESHOLD) {
+    r->jit = lre_jit_compile(r->bc, NULL);
+  }
+
+  struct exec_state st;
+  void *opaque = exec_state_init(&st, r);
+  const int ret = lre_exec_jit(r->jit, exec_stack(r), capture, r->bc, cbuf,
+                               rlast_index, clen, cbuf_type, opaque);
 
   if (ret < 0) {
-    return luaL_error(lstate, "out of memory in regexp execution");
+    return exec_error(lstate, opaque, ret);
   }
 
   if (ret == 0) {
@@ -332,135 +844,103 @@ static int regexp_exec(lua_State *lstate) {
     return 0;
   } else if (global || sticky) {
     // match found
-    if (input->is_wide_char) {
-      r->last_index = input->indices[(capture[1] - input->u.str8) / 2];
-    } else {
-      r->last_index = capture[1] - input->u.str8;
-    }
+    r->last_index = jsstring_index(input, cbuf_type, cbuf, capture[1]);
   }
 
-  lua_createtable(lstate, capture_count + 1, capture_count + 3);
-
+  struct match *m = lua_newuserdata(
+      lstate, sizeof(*m) + 2 * capture_count * sizeof(m->capture[0]));
+  m->group_names = group_names;
+  m->has_indices = has_indices;
+  m->capture_count = capture_count;
+  for (int i = 0; i < 2 * capture_count; i++) {
+    m->capture[i] = capture[i & ~1]
+                        ? jsstring_index(input, cbuf_type, cbuf, capture[i])
+                        : MATCH_UNMATCHED;
+  }
   luaL_getmetatable(lstate, JSREGEXP_MATCH_MT);
   lua_setmetatable(lstate, -2);
 
-  lua_pushstring(lstate, input->bstr);
-  lua_setfield(lstate, -2, "input");
+  // the input string is shared, not copied
+  lua_createtable(lstate, 2, 2);
+  jsstring_push_lstring(lstate, input, 2);
+  m->input = lua_tostring(lstate, -1);
+  lua_rawseti(lstate, -2, MATCH_ENV_INPUT);
+  if (group_names) {
+    lua_pushvalue(lstate, 1);
+    lua_rawseti(lstate, -2, MATCH_ENV_REGEXP);
+  }
+  lua_set_env(lstate, -2);
 
-  lua_pushinteger(lstate, capture_count);
-  lua_setfield(lstate, -2, "capture_count");
+  return 1;
+}
 
-  if (input->is_wide_char) {
-    lua_pushnumber(
-        lstate,
-        1 + input->indices[(capture[0] - input->u.str8) / 2]); // 1-based
-  } else {
-    lua_pushnumber(lstate, 1 + capture[0] - input->u.str8); // 1-based
+static int regexp_test(lua_State *lstate) {
+  if (lua_gettop(lstate) != 2) {
+    return luaL_error(lstate, "expecting exactly 2 arguments");
   }
-  lua_setfield(lstate, -2, "index");
-
-  if (has_indices) {
-    // [match]
-    lua_createtable(lstate, capture_count + 1, 0); // match.indices
-    // [match, indices]
-    if (group_names) {
-      // push indices.groups table, duplicate it and leave it below match
-      lua_createtable(lstate, 0, capture_count); // match.indices.groups
-      // [match, indices, groups]
-      lua_pushvalue(lstate, -1);
-      // [match, indices, groups, groups]
-      lua_insert(lstate, -4);
-      // [indices.groups, match, indices, groups]
-      lua_setfield(lstate, -2, "groups");
-      // [indices.groups, match, indices]
+  struct regexp *r = luaL_checkudata(lstate, 1, JSREGEXP_MT);
+  struct jsstring view;
+  struct jsstring *input = lua_tojsstring_view(lstate, 2, r, &view);
+  const uint8_t *cbuf;
+  uint32_t clen;
+  const int cbuf_type = jsstring_cbuf(lstate, input, r, &cbuf, &clen);
+  const int flags = lre_get_flags(r->bc);
+  struct exec_state st;
+  void *opaque = exec_state_init(&st, r);
+  if (!(flags & (LRE_FLAG_GLOBAL | LRE_FLAG_STICKY))) {
+    // last_index is not updated, only tell if there is a match
+    r->last_index = 0;
+    const int ret =
+        lre_exec_test(exec_stack(r), r->bc, cbuf, 0, clen, cbuf_type, opaque);
+    if (ret < 0) {
+      return exec_error(lstate, opaque, ret);
     }
-    lua_pushvalue(lstate, -1);
-    // [..., match, indices, indices]
-    lua_setfield(lstate, -3, "indices");
-    // [..., match, indices]
-    lua_insert(lstate, -2); // leave table below the match table
-    // [..., indices, match]
+    lua_pushboolean(lstate, ret);
+    return 1;
   }
-
-  if (group_names) {
-    // [..., match]
-    lua_newtable(lstate); // match.groups
-    // [..., match, groups]
-    lua_pushvalue(lstate, -1);
-    // [..., match, groups, groups]
-    lua_setfield(lstate, -3, "groups"); // immediately insert into match
-    // [..., match, groups]
-    lua_insert(lstate, -2); // leave table below the match table
-    // [..., groups, match]
+  // only the bounds of the match are needed to update last_index, the
+  // captures are not saved and no match table is built
+  uint32_t start_index;
+  if (!exec_start_index(r, input, cbuf_type, clen, &start_index)) {
+    lua_pushboolean(lstate, false);
+    return 1;
   }
-
-  // [groups.indices?, indices?, groups?, match]
-
-  for (int i = 0; i < capture_count; i++) {
-    uint32_t a, b;
-    if (input->is_wide_char) {
-      a = input->indices[(capture[2 * i] - input->u.str8) / 2];
-      b = input->indices[(capture[2 * i + 1] - input->u.str8) / 2];
-      lua_pushlstring(lstate, input->bstr + a, b - a);
-    } else {
-      a = capture[2 * i] - input->u.str8;
-      b = capture[2 * i + 1] - input->u.str8;
-      lua_pushlstring(lstate, (char *)capture[2 * i],
-                      capture[2 * i + 1] - capture[2 * i]);
-    }
-
-    if (has_indices) {
-      lua_createtable(lstate, 2, 0);
-      lua_pushinteger(lstate, a + 1);
-      lua_rawseti(lstate, -2, 1);
-      lua_pushinteger(lstate, b);
-      lua_rawseti(lstate, -2, 2);
-      // [..., match, string, {a, b}]
-      if (group_names) {
-        // [indices.groups, indices, groups, match, string, {a, b}]
-        if (i > 0 && *group_names) {
-          // if the current group is named, duplicate and insert into the
-          // correct table
-          lua_pushvalue(lstate, -1);
-          // [indices.groups, indices, groups, match, string, {a, b}, {a,b}]
-          lua_setfield(lstate, -7, group_names);
-        }
-        // [indices.groups, indices, groups, match, string, {a, b}]
-        lua_rawseti(lstate, -5, i);
-      } else {
-        // [indices, match, string, {a, b}]
-        lua_rawseti(lstate, -4, i);
-      }
-    }
-
-    if (i > 0 && group_names) {
-      // [..., groups, match, string]
-      // if the current group is named, duplicate and insert into the correct
-      // table
-      if (*group_names) {
-        lua_pushvalue(lstate, -1);
-        // [..., groups, match, string, string]
-        lua_setfield(lstate, -4, group_names);
-        group_names += strlen(group_names);
-      }
-      group_names++;
-    }
-
-    // [..., match, string]
-    lua_rawseti(lstate, -2, i);
+  int index, end;
+  const int ret = lre_exec_index(exec_stack(r), &index, &end, r->bc, cbuf,
+                                 start_index, clen, cbuf_type, opaque);
+  if (ret < 0) {
+    return exec_error(lstate, opaque, ret);
   }
-
+  r->last_index = ret ? jsstring_offset(input, cbuf_type, end) : 0;
+  lua_pushboolean(lstate, ret);
   return 1;
 }
 
-static int regexp_test(lua_State *lstate) {
-  if (lua_gettop(lstate) != 2) {
-    return luaL_error(lstate, "expecting exactly 2 arguments");
+// the match is searched from the start of the input and last_index is not
+// modified, as in String.prototype.search
+static int regexp_search(lua_State *lstate) {
+  struct regexp *r = luaL_checkudata(lstate, 1, JSREGEXP_MT);
+  struct jsstring view;
+  struct jsstring *input = lua_tojsstring_view(lstate, 2, r, &view);
+  const uint8_t *cbuf;
+  uint32_t clen;
+  const int cbuf_type = jsstring_cbuf(lstate, input, r, &cbuf, &clen);
+
+  int index;
+  struct exec_state st;
+  void *opaque = exec_state_init(&st, r);
+  const int ret =
+      lre_exec_index(exec_stack(r), &index, NULL, r->bc, cbuf, 0, clen,
+                     cbuf_type, opaque);
+  if (ret < 0) {
+    return exec_error(lstate, opaque, ret);
+  }
+  if (ret == 0) {
+    lua_pushinteger(lstate, -1);
+  } else {
+    lua_pushinteger(lstate,
+                    1 + jsstring_offset(input, cbuf_type, index)); // 1-based
   }
-  lua_pushcfunction(lstate, regexp_exec);
-  lua_insert(lstate, 1);
-  lua_call(lstate, 2, 1);
-  lua_pushboolean(lstate, !lua_isnil(lstate, -1));
   return 1;
 }
 
@@ -480,6 +960,8 @@ static int regexp_index(lua_State *lstate) {
       lua_pushboolean(lstate, lre_get_flags(r->bc) & LRE_FLAG_DOTALL);
     } else if (streq(key, "global")) {
       lua_pushboolean(lstate, lre_get_flags(r->bc) & LRE_FLAG_GLOBAL);
+    } else if (streq(key, "linear")) {
+      lua_pushboolean(lstate, lre_get_flags(r->bc) & LRE_FLAG_LINEAR);
     } else if (streq(key, "ignore_case")) {
       lua_pushboolean(lstate, lre_get_flags(r->bc) & LRE_FLAG_IGNORECASE);
     } else if (streq(key, "multiline")) {
@@ -492,6 +974,12 @@ static int regexp_index(lua_State *lstate) {
       lua_pushboolean(lstate, lre_get_flags(r->bc) & LRE_FLAG_UNICODE_SETS);
     } else if (streq(key, "has_indices")) {
       lua_pushboolean(lstate, lre_get_flags(r->bc) & LRE_FLAG_INDICES);
+    } else if (streq(key, "max_steps")) {
+      lua_pushnumber(lstate, r->max_steps);
+    } else if (streq(key, "timeout")) {
+      lua_pushnumber(lstate, r->timeout);
+    } else if (streq(key, "max_stack")) {
+      lua_pushnumber(lstate, r->max_stack);
     } else if (streq(key, "source")) {
       lua_pushstring(lstate, r->expr);
     } else if (streq(key, "flags")) {
@@ -503,7 +991,7 @@ static int regexp_index(lua_State *lstate) {
   return 1;
 }
 
-// only last_index should be settable
+// only last_index and the execution limits should be settable
 static int regexp_newindex(lua_State *lstate) {
   struct regexp *r = luaL_checkudata(lstate, 1, JSREGEXP_MT);
 
@@ -512,6 +1000,17 @@ static int regexp_newindex(lua_State *lstate) {
     const int ind = luaL_checknumber(lstate, 3);
     luaL_argcheck(lstate, ind >= 1, 3, "last_index must be positive");
     r->last_index = ind - 1;
+  } else if (streq(key, "max_steps") || streq(key, "timeout") ||
+             streq(key, "max_stack")) {
+    const lua_Number val = luaL_checknumber(lstate, 3);
+    luaL_argcheck(lstate, val >= 0, 3, "limit must not be negative");
+    if (streq(key, "max_steps")) {
+      r->max_steps = val;
+    } else if (streq(key, "timeout")) {
+      r->timeout = val;
+    } else {
+      r->max_stack = val;
+    }
   } else {
     return luaL_argerror(lstate, 2, "unrecognized key");
   }
@@ -521,6 +1020,7 @@ static int regexp_newindex(lua_State *lstate) {
 
 static struct luaL_Reg jsregexp_meta[] = {{"exec", regexp_exec},
                                           {"test", regexp_test},
+                                          {"search", regexp_search},
                                           {"__gc", regexp_gc},
                                           {"__tostring", regexp_tostring},
                                           {"__index", regexp_index},
@@ -557,6 +1057,9 @@ static int jsregexp_compile(lua_State *lstate) {
       case 'g':
         re_flags |= LRE_FLAG_GLOBAL;
         break;
+      case 'l':
+        re_flags |= LRE_FLAG_LINEAR;
+        break;
       case 'm':
         re_flags |= LRE_FLAG_MULTILINE;
         break;
@@ -591,9 +1094,19 @@ static int jsregexp_compile(lua_State *lstate) {
   ud->bc = bc;
   ud->expr = strdup(regexp);
   ud->last_index = 0;
+  ud->jit = NULL;
+  ud->exec_count = 0;
+  // on allocation failure, each exec call uses its own stack
+  ud->stack = lre_stack_new(EXEC_STACK_SIZE_MAX, NULL);
+  ud->max_steps = 0;
+  ud->timeout = 0;
+  ud->max_stack = 0;
 
   luaL_getmetatable(lstate, JSREGEXP_MT);
   lua_setmetatable(lstate, -2);
+  // the last input, see lua_tojsstring_view
+  lua_createtable(lstate, 1, 0);
+  lua_set_env(lstate, -2);
 
   return 1;
 }
@@ -623,6 +1136,9 @@ static const struct luaL_Reg jsregexp_lib[] = {
 
 int luaopen_jsregexp_core(lua_State *lstate) {
   luaL_newmetatable(lstate, JSREGEXP_MATCH_MT);
+  lua_set_functions(lstate, match_meta);
+
+  luaL_newmetatable(lstate, JSREGEXP_MATCH_TABLE_MT);
   lua_pushcfunction(lstate, match_tostring);
   lua_setfield(lstate, -2, "__tostring");
 
@@ -61,18 +61,6 @@ function jsregexp.mt.match_all_list(re, str)
 	return matches
 end
 
-function jsregexp.mt.search(re, str)
-	-- spec says to start at 1 and restore last_index
-	local prev_last_index = re.last_index
-	re.last_index = 1
-	local match = re:exec(str)
-	re.last_index = prev_last_index
-	if match == nil then
-		return -1
-	end
-	return match.index
-end
-
 function jsregexp.mt.split(re, str, limit)
 	if limit == nil then
 		limit = math.huge
@@ -99,9 +87,9 @@ function jsregexp.mt.split(re, str, limit)
 			if #sub > 0 or #match[0] > 0 then
 				table.insert(split, sub)
 			end
-			for _, group in ipairs(match) do
+			for i = 1, #match do
 				if count < limit then
-					table.insert(split, group)
+					table.insert(split, match[i])
 				else
 					break
 				end
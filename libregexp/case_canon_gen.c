@@ -0,0 +1,152 @@
+/*
+ * Generator of the lre_canonicalize() BMP tables
+ *
+ * Usage: case_canon_gen libunicode-table.h
+ *
+ * Must be linked with a libunicode.c built with LRE_NO_CASE_CANON_TABLE
+ * so that lre_canonicalize() uses the case conversion tables. The
+ * CONFIG_CASE_CANON_TABLE section of the file is replaced in place.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cutils.h"
+#include "libunicode.h"
+
+#ifdef CONFIG_CASE_CANON_TABLE
+#error "case_canon_gen must be built with LRE_NO_CASE_CANON_TABLE"
+#endif
+
+#define BLOCK_BITS  5
+#define BLOCK_LEN   (1 << BLOCK_BITS)
+#define BLOCK_COUNT (0x10000 >> BLOCK_BITS)
+/* the block numbers are stored on 8 bits */
+#define BLOCK_MAX   256
+
+#define SECTION_START "#ifdef CONFIG_CASE_CANON_TABLE\n"
+#define SECTION_END   "#endif /* CONFIG_CASE_CANON_TABLE */\n"
+
+static uint16_t blocks[BLOCK_MAX][BLOCK_LEN];
+static int block_count;
+/* index 0 is the legacy mode, index 1 the unicode mode */
+static uint8_t block_index[2][BLOCK_COUNT];
+
+static void build_tables(void)
+{
+    uint16_t delta[BLOCK_LEN];
+    int is_unicode, b, i, k;
+    uint32_t c, r;
+
+    for(is_unicode = 0; is_unicode < 2; is_unicode++) {
+        for(b = 0; b < BLOCK_COUNT; b++) {
+            for(i = 0; i < BLOCK_LEN; i++) {
+                c = (b << BLOCK_BITS) | i;
+                r = lre_canonicalize(c, is_unicode);
+                if (r > 0xffff) {
+                    fprintf(stderr, "U+%04X canonicalizes outside the BMP\n", c);
+                    exit(1);
+                }
+                delta[i] = (r - c) & 0xffff;
+            }
+            for(k = 0; k < block_count; k++) {
+                if (!memcmp(blocks[k], delta, sizeof(delta)))
+                    break;
+            }
+            if (k == block_count) {
+                if (block_count >= BLOCK_MAX) {
+                    fprintf(stderr, "too many blocks\n");
+                    exit(1);
+                }
+                memcpy(blocks[block_count++], delta, sizeof(delta));
+            }
+            block_index[is_unicode][b] = k;
+        }
+    }
+}
+
+static void dump_tables(FILE *f)
+{
+    int is_unicode, b, k, i;
+
+    fprintf(f, SECTION_START "\n");
+    fprintf(f, "static const uint8_t case_canon_index[%d] = {\n",
+            2 * BLOCK_COUNT);
+    for(is_unicode = 0; is_unicode < 2; is_unicode++) {
+        for(b = 0; b < BLOCK_COUNT; b++) {
+            fprintf(f, "%s0x%02x,%s", (b % 16) ? " " : "    ",
+                    block_index[is_unicode][b], (b % 16 == 15) ? "\n" : "");
+        }
+    }
+    fprintf(f, "};\n\n");
+    fprintf(f, "static const uint16_t case_canon_table[%d] = {\n",
+            block_count * BLOCK_LEN);
+    for(k = 0; k < block_count; k++) {
+        for(i = 0; i < BLOCK_LEN; i++) {
+            fprintf(f, "%s0x%04x,%s", (i % 8) ? " " : "    ",
+                    blocks[k][i], (i % 8 == 7) ? "\n" : "");
+        }
+    }
+    fprintf(f, "};\n\n" SECTION_END);
+}
+
+static char *load_file(const char *filename, size_t *plen)
+{
+    FILE *f;
+    char *buf;
+    long len;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(len + 1);
+    if (!buf || fread(buf, 1, len, f) != len) {
+        fprintf(stderr, "%s: read error\n", filename);
+        exit(1);
+    }
+    buf[len] = '\0';
+    fclose(f);
+    *plen = len;
+    return buf;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filename;
+    char *buf, *start, *end;
+    size_t len;
+    FILE *f;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: case_canon_gen libunicode-table.h\n");
+        exit(1);
+    }
+    filename = argv[1];
+    buf = load_file(filename, &len);
+    start = strstr(buf, SECTION_START);
+    end = start ? strstr(start, SECTION_END) : NULL;
+    if (!end) {
+        fprintf(stderr, "%s: no CONFIG_CASE_CANON_TABLE section\n", filename);
+        exit(1);
+    }
+    end += strlen(SECTION_END);
+
+    build_tables();
+
+    f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    fwrite(buf, 1, start - buf, f);
+    dump_tables(f);
+    fwrite(end, 1, buf + len - end, f);
+    fclose(f);
+    free(buf);
+    return 0;
+}
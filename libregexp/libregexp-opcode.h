@@ -26,9 +26,9 @@
 
 DEF(invalid, 1) /* never used */
 DEF(char, 3)
-DEF(char_i, 3)
+DEF(char_i, 5) /* one of two chars (case variants) */
 DEF(char32, 5)
-DEF(char32_i, 5)
+DEF(char32_i, 9) /* one of two chars (case variants) */
 DEF(dot, 1)
 DEF(any, 1) /* same as dot but match any character including line terminator */
 DEF(space, 1)
@@ -60,14 +60,18 @@ DEF(back_reference, 2) /* variable length */
 DEF(back_reference_i, 2) /* must come after */
 DEF(backward_back_reference, 2) /* must come after */
 DEF(backward_back_reference_i, 2) /* must come after */
-DEF(range, 3) /* variable length */
-DEF(range_i, 3) /* variable length */
-DEF(range32, 3) /* variable length */
-DEF(range32_i, 3) /* variable length */
+DEF(range, 3) /* variable length, followed by a 256 bit Latin-1 set */
+DEF(range32, 3) /* variable length, followed by a 256 bit Latin-1 set */
 DEF(lookahead, 5)
 DEF(negative_lookahead, 5) /* must come after */
 DEF(set_char_pos, 2) /* store the character position to a register */
 DEF(check_advance, 2) /* check that the register is different from the character position */
 DEF(prev, 1) /* go to the previous char */
+DEF(string, 5) /* variable length, followed by the same REOP_char ops */
+DEF(string_i, 5) /* variable length, followed by the same REOP_char_i ops */
+DEF(switch, 5) /* variable length, trie of the literal alternatives which follow */
+DEF(possessive_loop, 5) /* variable length, possessive form of the single char loop which follows */
+DEF(greedy_loop, 5) /* variable length, same layout */
+DEF(lazy_loop, 5) /* variable length, same layout */
 
 #endif /* DEF */
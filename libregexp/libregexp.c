@@ -32,9 +32,16 @@
 #include "libregexp.h"
 #include "libunicode.h"
 
+#if defined(__x86_64__) && !defined(LRE_NO_JIT) &&                      \
+    (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__) || \
+     defined(__NetBSD__) || defined(__OpenBSD__))
+#define CONFIG_JIT
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
 /*
   TODO:
-  - remove REOP_char_i and REOP_range_i by precomputing the case folding.
   - add specific opcodes for simple unicode property tests so that the
     generated bytecode is smaller.
   - Add a lock step execution mode (=linear time execution guaranteed)
@@ -85,6 +92,10 @@ typedef struct {
     int has_named_captures; /* -1 = don't know, 0 = no, 1 = yes */
     void *opaque;
     DynBuf group_names;
+    /* case variants of the Latin-1 chars (see lre_case_variants_latin1()),
+       0 = not computed yet, 1 = computed, -1 = not usable */
+    int case_variants_state;
+    uint32_t case_variants[256 * 2];
     union {
         char error_msg[TMP_BUF_SIZE];
         char tmp_buf[TMP_BUF_SIZE];
@@ -112,13 +123,81 @@ static const REOpCode reopcode_info[REOP_COUNT] = {
 #define RE_HEADER_CAPTURE_COUNT  2
 #define RE_HEADER_REGISTER_COUNT 3
 #define RE_HEADER_BYTECODE_LEN   4
-
-#define RE_HEADER_LEN 8
+#define RE_HEADER_SEARCH_MODE    8
+#define RE_HEADER_PREFIX_LEN     9
+#define RE_HEADER_REQUIRED_LEN   10
+#define RE_HEADER_DFA_MODE       11
+#define RE_HEADER_ONEPASS_LEN    12 /* 0 or number of one-pass entries + 1 */
+#define RE_HEADER_GLUSHKOV_LEN   13 /* 0 or number of Glushkov positions + 1 */
+#define RE_HEADER_FIRST_CHARS    14 /* bit set of the code units < 256 */
+#define RE_HEADER_FIRST_PAGES    46 /* bit set of (code unit >> 8) */
+#define RE_HEADER_MEMO           78 /* use the memoized backtracking */
+#define RE_HEADER_BACK_REFS      79 /* the code contains back references */
+
+#define RE_HEADER_LEN 80
+
+/* how lre_exec looks for the start of a match in non sticky regexps */
+#define RE_SEARCH_LOOP        0 /* run the implicit search loop */
+#define RE_SEARCH_PREFIX      1 /* skip to the literal prefix */
+#define RE_SEARCH_FIRST_CHARS 2 /* skip the chars which cannot start a match */
+#define RE_SEARCH_ANCHORED    3 /* only try the start of the input */
+#define RE_SEARCH_LINE_START  4 /* only try the start of the lines */
+
+/* how the lazy DFA can be used by lre_exec_test() */
+#define RE_DFA_NONE   0 /* unsupported opcodes */
+#define RE_DFA_APPROX 1 /* counted loops: the DFA accepts more strings */
+#define RE_DFA_EXACT  2
+
+/* one-pass entry of a split: u16 position, u8 flags, the code units
+   < 256 which can be consumed first by the branch tried first and by
+   the other branch */
+#define RE_ONEPASS_ENTRY_LEN (2 + 1 + 32 + 32)
+#define RE_ONEPASS_ENTRY_MAX 254
+#define RE_ONEPASS_NULL_A    (1 << 0) /* can match without consuming a char */
+#define RE_ONEPASS_NULL_B    (1 << 1)
+#define RE_ONEPASS_WIDE_A    (1 << 2) /* can consume a code unit >= 256 */
+#define RE_ONEPASS_WIDE_B    (1 << 3)
+
+/* Glushkov automaton of the regexps with at most 64 char tests
+   ("positions"): u8 flags, u16 class count, the u64 masks 'first_any',
+   'first_bol', 'last_any' and 'last_end', then the follow table (for
+   each 4 bit chunk of a position mask, the union of the follow masks
+   of its 16 values), the u16 bytecode position of each position, the
+   class of each code unit < 256 and the mask of the positions
+   accepting each class. */
+#define RE_GLUSHKOV_POS_MAX     64
+#define RE_GLUSHKOV_FLAGS       0
+#define RE_GLUSHKOV_CLASS_COUNT 1
+#define RE_GLUSHKOV_FIRST_ANY   3 /* positions which can start a match */
+#define RE_GLUSHKOV_FIRST_BOL   11 /* same but only at the start of the input */
+#define RE_GLUSHKOV_LAST_ANY    19 /* positions which can end a match */
+#define RE_GLUSHKOV_LAST_END    27 /* same but only at the end of the input */
+#define RE_GLUSHKOV_FOLLOW      35
+/* empty match flags: (bit 1 << (bol * 2 + eol)) where bol (resp. eol)
+   tells if the match is only possible at the start (resp. end) */
+#define RE_GLUSHKOV_EMPTY_ANY     (1 << 0)
+#define RE_GLUSHKOV_EMPTY_EOL     (1 << 1)
+#define RE_GLUSHKOV_EMPTY_BOL     (1 << 2)
+#define RE_GLUSHKOV_EMPTY_BOL_EOL (1 << 3)
+
+/* length of the implicit '.*?' loop emitted before non sticky regexps */
+#define RE_SEARCH_LOOP_LEN (5 + 1 + 5)
+/* maximum number of UTF-16 code units in the literal prefix and in
+   the required literal */
+#define RE_PREFIX_LEN_MAX 64
+/* the range opcodes are followed by a bit set of the accepted code
+   units < 256 */
+#define RE_RANGE_BITMAP_LEN 32
 
 static inline int is_digit(int c) {
     return c >= '0' && c <= '9';
 }
 
+static BOOL is_line_terminator(uint32_t c)
+{
+    return (c == '\n' || c == '\r' || c == CP_LS || c == CP_PS);
+}
+
 /* insert 'len' bytes at position 'pos'. Return < 0 if error. */
 static int dbuf_insert(DynBuf *s, int pos, int len)
 {
@@ -463,7 +542,7 @@ static int cr_init_char_range(REParseState *s, REStringList *cr, uint32_t c)
 static __maybe_unused void lre_dump_bytecode(const uint8_t *buf,
                                                      int buf_len)
 {
-    int pos, len, opcode, bc_len, re_flags, i;
+    int pos, len, opcode, bc_len, re_flags, prefix_len, required_len, i;
     uint32_t val, val2;
 
     assert(buf_len >= RE_HEADER_LEN);
@@ -473,9 +552,48 @@ static __maybe_unused void lre_dump_bytecode(const uint8_t *buf,
     assert(bc_len + RE_HEADER_LEN <= buf_len);
     printf("flags: 0x%x capture_count=%d reg_count=%d\n",
            re_flags, buf[RE_HEADER_CAPTURE_COUNT], buf[RE_HEADER_REGISTER_COUNT]);
+    prefix_len = buf[RE_HEADER_PREFIX_LEN];
+    if (prefix_len != 0) {
+        printf("prefix: '");
+        for(i = 0; i < prefix_len; i++)
+            lre_print_char(get_u16(buf + RE_HEADER_LEN + bc_len + i * 2), FALSE);
+        printf("'\n");
+    }
+    required_len = buf[RE_HEADER_REQUIRED_LEN];
+    if (required_len != 0) {
+        printf("required: '");
+        for(i = 0; i < required_len; i++)
+            lre_print_char(get_u16(buf + RE_HEADER_LEN + bc_len + (prefix_len + i) * 2), FALSE);
+        printf("'\n");
+    }
+    if (buf[RE_HEADER_SEARCH_MODE] == RE_SEARCH_FIRST_CHARS) {
+        printf("first chars: ");
+        for(i = 0; i < 256; i++) {
+            if (buf[RE_HEADER_FIRST_CHARS + (i >> 3)] & (1 << (i & 7)))
+                lre_print_char(i, FALSE);
+        }
+        printf(" pages:");
+        for(i = 1; i < 256; i++) {
+            if (buf[RE_HEADER_FIRST_PAGES + (i >> 3)] & (1 << (i & 7)))
+                printf(" %02x", i);
+        }
+        printf("\n");
+    }
+    if (buf[RE_HEADER_SEARCH_MODE] == RE_SEARCH_ANCHORED)
+        printf("anchored\n");
+    else if (buf[RE_HEADER_SEARCH_MODE] == RE_SEARCH_LINE_START)
+        printf("anchored at line starts\n");
+    if (buf[RE_HEADER_ONEPASS_LEN] != 0)
+        printf("one-pass: %d splits\n", buf[RE_HEADER_ONEPASS_LEN] - 1);
+    if (buf[RE_HEADER_GLUSHKOV_LEN] != 0)
+        printf("glushkov: %d positions\n", buf[RE_HEADER_GLUSHKOV_LEN] - 1);
+    if (buf[RE_HEADER_MEMO] != 0)
+        printf("memoized backtracking\n");
+    if (buf[RE_HEADER_BACK_REFS] != 0)
+        printf("back references\n");
     if (re_flags & LRE_FLAG_NAMED_GROUPS) {
         const char *p;
-        p = (char *)buf + RE_HEADER_LEN + bc_len;
+        p = (const char *)lre_get_groupnames(buf);
         printf("named groups: ");
         for(i = 1; i < buf[RE_HEADER_CAPTURE_COUNT]; i++) {
             if (i != 1)
@@ -506,19 +624,23 @@ static __maybe_unused void lre_dump_bytecode(const uint8_t *buf,
         switch(opcode) {
         case REOP_char:
         case REOP_char_i:
-            val = get_u16(buf + pos + 1);
-            if (val >= ' ' && val <= 126)
-                printf(" '%c'", val);
-            else
-                printf(" 0x%04x", val);
+            for(i = 1; i < len; i += 2) {
+                val = get_u16(buf + pos + i);
+                if (val >= ' ' && val <= 126)
+                    printf(" '%c'", val);
+                else
+                    printf(" 0x%04x", val);
+            }
             break;
         case REOP_char32:
         case REOP_char32_i:
-            val = get_u32(buf + pos + 1);
-            if (val >= ' ' && val <= 126)
-                printf(" '%c'", val);
-            else
-                printf(" 0x%08x", val);
+            for(i = 1; i < len; i += 4) {
+                val = get_u32(buf + pos + i);
+                if (val >= ' ' && val <= 126)
+                    printf(" '%c'", val);
+                else
+                    printf(" 0x%08x", val);
+            }
             break;
         case REOP_goto:
         case REOP_split_goto_first:
@@ -570,6 +692,52 @@ static __maybe_unused void lre_dump_bytecode(const uint8_t *buf,
         case REOP_save_reset:
             printf(" %u %u", buf[pos + 1], buf[pos + 2]);
             break;
+        case REOP_string:
+        case REOP_string_i:
+            {
+                int n, i;
+                n = get_u32(buf + pos + 1);
+                len += n;
+                for(i = 0; i < n; i++) {
+                    /* REOP_string_i: the two case variants */
+                    if (i == 0 || (opcode == REOP_string_i && i == n / 2))
+                        printf(" \"");
+                    val = buf[pos + 5 + i];
+                    if (val >= ' ' && val <= 126)
+                        printf("%c", val);
+                    else
+                        printf("\\x%02x", val);
+                    if (i == n - 1 || (opcode == REOP_string_i && i == n / 2 - 1))
+                        printf("\"");
+                }
+            }
+            break;
+        case REOP_switch:
+            {
+                uint32_t n, tail;
+                n = get_u32(buf + pos + 1);
+                len += n;
+                val = get_u32(buf + pos + 5) + pos + len;
+                tail = get_u32(buf + pos + 9);
+                printf(" end=%u", val);
+                if (tail != 0)
+                    printf(" tail=%u", tail + pos + len);
+                printf(" trie=%u bytes", n - 8);
+            }
+            break;
+        case REOP_possessive_loop:
+        case REOP_greedy_loop:
+        case REOP_lazy_loop:
+            len += get_u32(buf + pos + 1);
+            printf(" %u", get_u32(buf + pos + 5));
+            val = get_u32(buf + pos + 9);
+            if (val == INT32_MAX)
+                printf(",inf");
+            else
+                printf(",%u", val);
+            printf(" atom=%u end=%u", get_u32(buf + pos + 13) + pos + len,
+                   get_u32(buf + pos + 17) + pos + len);
+            break;
         case REOP_set_i32:
             val = buf[pos + 1];
             val2 = get_u32(buf + pos + 2);
@@ -581,11 +749,10 @@ static __maybe_unused void lre_dump_bytecode(const uint8_t *buf,
             printf(" r%u", val);
             break;
         case REOP_range:
-        case REOP_range_i:
             {
                 int n, i;
                 n = get_u16(buf + pos + 1);
-                len += n * 4;
+                len += n * 4 + RE_RANGE_BITMAP_LEN;
                 for(i = 0; i < n * 2; i++) {
                     val = get_u16(buf + pos + 3 + i * 2);
                     printf(" 0x%04x", val);
@@ -593,11 +760,10 @@ static __maybe_unused void lre_dump_bytecode(const uint8_t *buf,
             }
             break;
         case REOP_range32:
-        case REOP_range32_i:
             {
                 int n, i;
                 n = get_u16(buf + pos + 1);
-                len += n * 8;
+                len += n * 8 + RE_RANGE_BITMAP_LEN;
                 for(i = 0; i < n * 2; i++) {
                     val = get_u32(buf + pos + 3 + i * 4);
                     printf(" 0x%08x", val);
@@ -1222,7 +1388,23 @@ static int get_class_atom(REParseState *s, REStringList *cr,
     return c;
 }
 
-static int re_emit_range(REParseState *s, const CharRange *cr)
+/* emit the bit set of the code units < 256 accepted by the range 'cr' */
+static void re_emit_range_bitmap(REParseState *s, const CharRange *cr)
+{
+    uint8_t bits[RE_RANGE_BITMAP_LEN];
+    uint32_t c, c2;
+    int i;
+
+    memset(bits, 0, sizeof(bits));
+    for(i = 0; i < cr->len && cr->points[i] < 256; i += 2) {
+        c2 = min_uint32(cr->points[i + 1], 256);
+        for(c = cr->points[i]; c < c2; c++)
+            bits[c >> 3] |= 1 << (c & 7);
+    }
+    dbuf_put(&s->byte_code, bits, sizeof(bits));
+}
+
+static int re_emit_range1(REParseState *s, const CharRange *cr)
 {
     int len, i;
     uint32_t high;
@@ -1239,7 +1421,7 @@ static int re_emit_range(REParseState *s, const CharRange *cr)
         if (high <= 0xffff) {
             /* can use 16 bit ranges with the conversion that 0xffff =
                infinity */
-            re_emit_op_u16(s, s->ignore_case ? REOP_range_i : REOP_range, len);
+            re_emit_op_u16(s, REOP_range, len);
             for(i = 0; i < cr->len; i += 2) {
                 dbuf_put_u16(&s->byte_code, cr->points[i]);
                 high = cr->points[i + 1] - 1;
@@ -1247,17 +1429,39 @@ static int re_emit_range(REParseState *s, const CharRange *cr)
                     high = 0xffff;
                 dbuf_put_u16(&s->byte_code, high);
             }
+            re_emit_range_bitmap(s, cr);
         } else {
-            re_emit_op_u16(s, s->ignore_case ? REOP_range32_i : REOP_range32, len);
+            re_emit_op_u16(s, REOP_range32, len);
             for(i = 0; i < cr->len; i += 2) {
                 dbuf_put_u32(&s->byte_code, cr->points[i]);
                 dbuf_put_u32(&s->byte_code, cr->points[i + 1] - 1);
             }
+            re_emit_range_bitmap(s, cr);
         }
     }
     return 0;
 }
 
+/* With ignore_case, 'cr' contains canonicalized chars. The emitted
+   range accepts all the chars whose canonical form is in 'cr' so that
+   the input is never canonicalized. */
+static int re_emit_range(REParseState *s, const CharRange *cr)
+{
+    CharRange cr1;
+    int ret;
+
+    if (!s->ignore_case)
+        return re_emit_range1(s, cr);
+    cr_init(&cr1, s->opaque, lre_realloc);
+    if (cr_copy(&cr1, cr) || cr_regexp_case_closure(&cr1, s->is_unicode)) {
+        cr_free(&cr1);
+        return re_parse_out_of_memory(s);
+    }
+    ret = re_emit_range1(s, &cr1);
+    cr_free(&cr1);
+    return ret;
+}
+
 static int re_string_cmp_len(const void *a, const void *b, void *arg)
 {
     REString *p1 = *(REString **)a;
@@ -1265,12 +1469,69 @@ static int re_string_cmp_len(const void *a, const void *b, void *arg)
     return (p1->len < p2->len) - (p1->len > p2->len);
 }
 
-static void re_emit_char(REParseState *s, int c)
+/* With ignore_case, 'c' is canonicalized. It is emitted as a plain
+   char if it is its only case variant, as REOP_char_i if there are
+   two of them and as a range otherwise. */
+static int re_emit_char(REParseState *s, int c)
 {
+    CharRange cr;
+    uint32_t c1, c2;
+    int ret, i, n;
+
+    /* no char folds to an ASCII char which is not a letter */
+    if (s->ignore_case && (c >= 128 || (unsigned)((c | 0x20) - 'a') < 26)) {
+        if (c < 256 && s->case_variants_state == 0) {
+            if (lre_case_variants_latin1(s->case_variants, s->is_unicode))
+                s->case_variants_state = -1;
+            else
+                s->case_variants_state = 1;
+        }
+        cr_init(&cr, s->opaque, lre_realloc);
+        if (cr_add_interval(&cr, c, c + 1))
+            goto fail;
+        if (c < 256 && s->case_variants_state > 0) {
+            for(i = 0; i < 2; i++) {
+                c1 = s->case_variants[2 * c + i];
+                if (c1 != 0 && cr_union_interval(&cr, c1, c1))
+                    goto fail;
+            }
+        } else {
+            if (cr_regexp_case_closure(&cr, s->is_unicode))
+                goto fail;
+        }
+        n = 0;
+        c1 = c2 = c;
+        for(i = 0; i < cr.len && n <= 2; i += 2) {
+            n += cr.points[i + 1] - cr.points[i];
+            if (i == 0)
+                c1 = cr.points[0];
+            c2 = cr.points[i + 1] - 1;
+        }
+        if (n > 2) {
+            ret = re_emit_range1(s, &cr);
+            cr_free(&cr);
+            return ret;
+        }
+        cr_free(&cr);
+        if (n == 2) {
+            if (c2 <= 0xffff) {
+                re_emit_op_u16(s, REOP_char_i, c1);
+                dbuf_put_u16(&s->byte_code, c2);
+            } else {
+                re_emit_op_u32(s, REOP_char32_i, c1);
+                dbuf_put_u32(&s->byte_code, c2);
+            }
+            return 0;
+        }
+    }
     if (c <= 0xffff)
-        re_emit_op_u16(s, s->ignore_case ? REOP_char_i : REOP_char, c);
+        re_emit_op_u16(s, REOP_char, c);
     else
-        re_emit_op_u32(s, s->ignore_case ? REOP_char32_i : REOP_char32, c);
+        re_emit_op_u32(s, REOP_char32, c);
+    return 0;
+ fail:
+    cr_free(&cr);
+    return re_parse_out_of_memory(s);
 }
 
 static int re_emit_string_list(REParseState *s, const REStringList *sl)
@@ -1316,7 +1577,10 @@ static int re_emit_string_list(REParseState *s, const REStringList *sl)
             else
                 split_pos = 0;
             for(j = 0; j < p->len; j++) {
-                re_emit_char(s, p->buf[j]);
+                if (re_emit_char(s, p->buf[j])) {
+                    lre_realloc(s->opaque, tab, 0);
+                    return -1;
+                }
             }
             if (!is_last) {
                 last_match_pos = re_emit_op_u32(s, REOP_goto, last_match_pos);
@@ -1569,15 +1833,13 @@ static BOOL re_need_check_adv_and_capture_init(BOOL *pneed_capture_init,
         len = reopcode_info[opcode].size;
         switch(opcode) {
         case REOP_range:
-        case REOP_range_i:
             val = get_u16(bc_buf + pos + 1);
-            len += val * 4;
+            len += val * 4 + RE_RANGE_BITMAP_LEN;
             need_check_adv = FALSE;
             break;
         case REOP_range32:
-        case REOP_range32_i:
             val = get_u16(bc_buf + pos + 1);
-            len += val * 8;
+            len += val * 8 + RE_RANGE_BITMAP_LEN;
             need_check_adv = FALSE;
             break;
         case REOP_char:
@@ -2186,7 +2448,8 @@ static int re_parse_term(REParseState *s, BOOL is_backward_dir)
         } else {
             if (s->ignore_case)
                 c = lre_canonicalize(c, s->is_unicode);
-            re_emit_char(s, c);
+            if (re_emit_char(s, c))
+                return -1;
         }
         if (is_backward_dir)
             re_emit_op(s, REOP_prev);
@@ -2482,14 +2745,12 @@ static int compute_register_count(uint8_t *bc_buf, int bc_buf_len)
             bc_buf[pos + 1] = stack_size;
             break;
         case REOP_range:
-        case REOP_range_i:
             val = get_u16(bc_buf + pos + 1);
-            len += val * 4;
+            len += val * 4 + RE_RANGE_BITMAP_LEN;
             break;
         case REOP_range32:
-        case REOP_range32_i:
             val = get_u16(bc_buf + pos + 1);
-            len += val * 8;
+            len += val * 8 + RE_RANGE_BITMAP_LEN;
             break;
         case REOP_back_reference:
         case REOP_back_reference_i:
@@ -2504,574 +2765,5091 @@ static int compute_register_count(uint8_t *bc_buf, int bc_buf_len)
     return stack_size_max;
 }
 
-static void *lre_bytecode_realloc(void *opaque, void *ptr, size_t size)
+/* Compute the literal string which must be present at the start of
+   every match. Only the straight line code before the first branch is
+   analysed. 'bc_buf' points to the code after the implicit search
+   loop. Return the number of UTF-16 code units stored in 'prefix'. */
+static int compute_prefix(uint16_t *prefix, const uint8_t *bc_buf,
+                          int bc_buf_len)
 {
-    if (size > (INT32_MAX / 2)) {
-        /* the bytecode cannot be larger than 2G. Leave some slack to 
-           avoid some overflows. */
-        return NULL;
-    } else {
-        return lre_realloc(opaque, ptr, size);
+    int pos, opcode, len, n;
+    uint32_t c;
+
+    n = 0;
+    pos = 0;
+    while (pos < bc_buf_len) {
+        opcode = bc_buf[pos];
+        len = reopcode_info[opcode].size;
+        switch(opcode) {
+        case REOP_char:
+            c = get_u16(bc_buf + pos + 1);
+            goto add_char;
+        case REOP_char32:
+            c = get_u32(bc_buf + pos + 1);
+        add_char:
+            if (c > 0xffff) {
+                if (n + 2 > RE_PREFIX_LEN_MAX)
+                    goto done;
+                prefix[n++] = get_hi_surrogate(c);
+                prefix[n++] = get_lo_surrogate(c);
+            } else {
+                /* the search must only stop on character boundaries */
+                if ((n == 0 && is_lo_surrogate(c)) || n + 1 > RE_PREFIX_LEN_MAX)
+                    goto done;
+                prefix[n++] = c;
+            }
+            break;
+        case REOP_save_start:
+        case REOP_save_end:
+        case REOP_save_reset:
+        case REOP_line_start:
+        case REOP_line_start_m:
+            /* no effect on the position */
+            break;
+        default:
+            goto done;
+        }
+        pos += len;
     }
+ done:
+    return n;
 }
 
-/* 'buf' must be a zero terminated UTF-8 string of length buf_len.
-   Return NULL if error and allocate an error message in *perror_msg,
-   otherwise the compiled bytecode and its length in plen.
-*/
-uint8_t *lre_compile(int *plen, char *error_msg, int error_msg_size,
-                     const char *buf, size_t buf_len, int re_flags,
-                     void *opaque)
+/* return TRUE if the char matching opcode at 'pc' accepts the char
+   'c' */
+static BOOL re_first_op_accepts(const uint8_t *pc, uint32_t c)
 {
-    REParseState s_s, *s = &s_s;
-    int register_count;
-    BOOL is_sticky;
-
-    memset(s, 0, sizeof(*s));
-    s->opaque = opaque;
-    s->buf_ptr = (const uint8_t *)buf;
-    s->buf_end = s->buf_ptr + buf_len;
-    s->buf_start = s->buf_ptr;
-    s->re_flags = re_flags;
-    s->is_unicode = ((re_flags & (LRE_FLAG_UNICODE | LRE_FLAG_UNICODE_SETS)) != 0);
-    is_sticky = ((re_flags & LRE_FLAG_STICKY) != 0);
-    s->ignore_case = ((re_flags & LRE_FLAG_IGNORECASE) != 0);
-    s->multi_line = ((re_flags & LRE_FLAG_MULTILINE) != 0);
-    s->dotall = ((re_flags & LRE_FLAG_DOTALL) != 0);
-    s->unicode_sets = ((re_flags & LRE_FLAG_UNICODE_SETS) != 0);
-    s->capture_count = 1;
-    s->total_capture_count = -1;
-    s->has_named_captures = -1;
-
-    dbuf_init2(&s->byte_code, opaque, lre_bytecode_realloc);
-    dbuf_init2(&s->group_names, opaque, lre_realloc);
-
-    dbuf_put_u16(&s->byte_code, re_flags); /* first element is the flags */
-    dbuf_putc(&s->byte_code, 0); /* second element is the number of captures */
-    dbuf_putc(&s->byte_code, 0); /* stack size */
-    dbuf_put_u32(&s->byte_code, 0); /* bytecode length */
-
-    if (!is_sticky) {
-        /* iterate thru all positions (about the same as .*?( ... ) )
-           .  We do it without an explicit loop so that lock step
-           thread execution will be possible in an optimized
-           implementation */
-        re_emit_op_u32(s, REOP_split_goto_first, 1 + 5);
-        re_emit_op(s, REOP_any);
-        re_emit_op_u32(s, REOP_goto, -(5 + 1 + 5));
-    }
-    re_emit_op_u8(s, REOP_save_start, 0);
-
-    if (re_parse_disjunction(s, FALSE)) {
-    error:
-        dbuf_free(&s->byte_code);
-        dbuf_free(&s->group_names);
-        pstrcpy(error_msg, error_msg_size, s->u.error_msg);
-        *plen = 0;
-        return NULL;
-    }
-
-    re_emit_op_u8(s, REOP_save_end, 0);
-
-    re_emit_op(s, REOP_match);
-
-    if (*s->buf_ptr != '\0') {
-        re_parse_error(s, "extraneous characters at the end");
-        goto error;
-    }
-
-    if (dbuf_error(&s->byte_code)) {
-        re_parse_out_of_memory(s);
-        goto error;
-    }
-
-    register_count = compute_register_count(s->byte_code.buf, s->byte_code.size);
-    if (register_count < 0) {
-        re_parse_error(s, "too many imbricated quantifiers");
-        goto error;
+    int opcode, n, i;
+
+    opcode = pc[0];
+    switch(opcode) {
+    case REOP_char:
+        return c == get_u16(pc + 1);
+    case REOP_char_i:
+        return c == get_u16(pc + 1) || c == get_u16(pc + 3);
+    case REOP_char32:
+        return c == get_u32(pc + 1);
+    case REOP_char32_i:
+        return c == get_u32(pc + 1) || c == get_u32(pc + 5);
+    case REOP_dot:
+        return !is_line_terminator(c);
+    case REOP_any:
+        return TRUE;
+    case REOP_space:
+        return lre_is_space(c) != 0;
+    case REOP_not_space:
+        return !lre_is_space(c);
+    case REOP_range:
+        n = get_u16(pc + 1);
+        if (c < 256)
+            return (pc[3 + n * 4 + (c >> 3)] >> (c & 7)) & 1;
+        /* 0xffff for the last value means +infinity */
+        if (c >= 0xffff && get_u16(pc + 3 + (n - 1) * 4 + 2) == 0xffff)
+            return TRUE;
+        for(i = 0; i < n; i++) {
+            if (c >= get_u16(pc + 3 + i * 4) && c <= get_u16(pc + 3 + i * 4 + 2))
+                return TRUE;
+        }
+        return FALSE;
+    case REOP_range32:
+        n = get_u16(pc + 1);
+        if (c < 256)
+            return (pc[3 + n * 8 + (c >> 3)] >> (c & 7)) & 1;
+        for(i = 0; i < n; i++) {
+            if (c >= get_u32(pc + 3 + i * 8) && c <= get_u32(pc + 3 + i * 8 + 4))
+                return TRUE;
+        }
+        return FALSE;
+    default:
+        abort();
     }
+}
 
-    s->byte_code.buf[RE_HEADER_CAPTURE_COUNT] = s->capture_count;
-    s->byte_code.buf[RE_HEADER_REGISTER_COUNT] = register_count;
-    put_u32(s->byte_code.buf + RE_HEADER_BYTECODE_LEN,
-            s->byte_code.size - RE_HEADER_LEN);
-
-    /* add the named groups if needed */
-    if (s->group_names.size > (s->capture_count - 1) * LRE_GROUP_NAME_TRAILER_LEN) {
-        dbuf_put(&s->byte_code, s->group_names.buf, s->group_names.size);
-        put_u16(s->byte_code.buf + RE_HEADER_FLAGS,
-                lre_get_flags(s->byte_code.buf) | LRE_FLAG_NAMED_GROUPS);
+/* store in 'c' the chars matched by the REOP_char op at 'pc' and
+   return their number, 0 if it is not a REOP_char op */
+static int re_get_op_chars(uint32_t *c, const uint8_t *pc)
+{
+    switch(pc[0]) {
+    case REOP_char:
+        c[0] = get_u16(pc + 1);
+        return 1;
+    case REOP_char_i:
+        c[0] = get_u16(pc + 1);
+        c[1] = get_u16(pc + 3);
+        return 2;
+    case REOP_char32:
+        c[0] = get_u32(pc + 1);
+        return 1;
+    case REOP_char32_i:
+        c[0] = get_u32(pc + 1);
+        c[1] = get_u32(pc + 5);
+        return 2;
+    default:
+        return 0;
     }
-    dbuf_free(&s->group_names);
-
-#ifdef DUMP_REOP
-    lre_dump_bytecode(s->byte_code.buf, s->byte_code.size);
-#endif
-
-    error_msg[0] = '\0';
-    *plen = s->byte_code.size;
-    return s->byte_code.buf;
 }
 
-static BOOL is_line_terminator(uint32_t c)
+static void re_set_bits(uint8_t *bits, uint32_t c1, uint32_t c2)
 {
-    return (c == '\n' || c == '\r' || c == CP_LS || c == CP_PS);
+    uint32_t c;
+    for(c = c1; c <= c2; c++)
+        bits[c >> 3] |= 1 << (c & 7);
 }
 
-#define GET_CHAR(c, cptr, cbuf_end, cbuf_type)                          \
-    do {                                                                \
-        if (cbuf_type == 0) {                                           \
-            c = *cptr++;                                                \
-        } else {                                                        \
-            const uint16_t *_p = (const uint16_t *)cptr;                \
-            const uint16_t *_end = (const uint16_t *)cbuf_end;          \
-            c = *_p++;                                                  \
-            if (is_hi_surrogate(c) && cbuf_type == 2) {                 \
-                if (_p < _end && is_lo_surrogate(*_p)) {                \
-                    c = from_surrogate(c, *_p++);                       \
-                }                                                       \
-            }                                                           \
-            cptr = (const void *)_p;                                    \
-        }                                                               \
-    } while (0)
+/* add the pages (code unit >> 8) of the code units >= 256 accepted by
+   the char matching opcode at 'pc'. The result may be larger than
+   needed. */
+static void re_first_op_pages(uint8_t *pages, const uint8_t *pc)
+{
+    int opcode, n, i;
+    uint32_t low, high;
+
+    opcode = pc[0];
+    switch(opcode) {
+    case REOP_char:
+    case REOP_char_i:
+        for(i = 0; i <= (opcode == REOP_char_i); i++) {
+            low = get_u16(pc + 1 + i * 2);
+            if (low >= 256)
+                re_set_bits(pages, low >> 8, low >> 8);
+        }
+        break;
+    case REOP_char32:
+    case REOP_char32_i:
+        for(i = 0; i <= (opcode == REOP_char32_i); i++) {
+            low = get_u32(pc + 1 + i * 4);
+            if (low > 0x10ffff)
+                continue; /* empty class */
+            if (low > 0xffff)
+                low = get_hi_surrogate(low);
+            if (low >= 256)
+                re_set_bits(pages, low >> 8, low >> 8);
+        }
+        break;
+    case REOP_space:
+        for(i = 0; i < char_range_s[0]; i++) {
+            low = char_range_s[1 + 2 * i];
+            high = char_range_s[2 + 2 * i] - 1;
+            if (high >= 256)
+                re_set_bits(pages, max_int(low, 256) >> 8, high >> 8);
+        }
+        break;
+    case REOP_range:
+    case REOP_range32:
+        n = get_u16(pc + 1);
+        for(i = 0; i < n; i++) {
+            if (opcode == REOP_range) {
+                low = get_u16(pc + 3 + i * 4);
+                high = get_u16(pc + 3 + i * 4 + 2);
+                /* 0xffff for the last value means +infinity */
+                if (high == 0xffff)
+                    high = 0x10ffff;
+            } else {
+                low = get_u32(pc + 3 + i * 8);
+                /* UINT32_MAX - 1 means +infinity */
+                high = min_uint32(get_u32(pc + 3 + i * 8 + 4), 0x10ffff);
+            }
+            if (low > 0x10ffff)
+                break;
+            if (high >= 256 && low <= 0xffff)
+                re_set_bits(pages, max_int(low, 256) >> 8, min_int(high, 0xffff) >> 8);
+            if (high > 0xffff) {
+                /* the first code unit is a high surrogate */
+                re_set_bits(pages, get_hi_surrogate(max_int(low, 0x10000)) >> 8,
+                            get_hi_surrogate(high) >> 8);
+            }
+        }
+        break;
+    default:
+        /* dot, any, not_space: a conservative result is enough */
+        re_set_bits(pages, 1, 255);
+        break;
+    }
+}
 
-#define PEEK_CHAR(c, cptr, cbuf_end, cbuf_type)                         \
-    do {                                                                \
-        if (cbuf_type == 0) {                                           \
-            c = cptr[0];                                                \
-        } else {                                                        \
-            const uint16_t *_p = (const uint16_t *)cptr;                \
-            const uint16_t *_end = (const uint16_t *)cbuf_end;          \
-            c = *_p++;                                                  \
-            if (is_hi_surrogate(c) && cbuf_type == 2) {                 \
-                if (_p < _end && is_lo_surrogate(*_p)) {                \
-                    c = from_surrogate(c, *_p);                         \
-                }                                                       \
-            }                                                           \
-        }                                                               \
-    } while (0)
+/* Compute the set of the code units which can start a match: 'bits'
+   contains the code units < 256 and 'pages' the upper byte of the
+   other code units. 'bc_buf' points to the code after the implicit
+   search loop. Return FALSE if the set cannot be computed (e.g. if
+   the regexp can match the empty string). */
+static BOOL compute_first_chars(uint8_t *bits, uint8_t *pages,
+                                const uint8_t *bc_buf, int bc_buf_len,
+                                void *opaque)
+{
+    int pos, opcode, len, stack_len, stack_size, n, i;
+    uint32_t c, cc[2];
+    int *stack;
+    uint8_t *visited;
+    BOOL ret;
+
+    ret = FALSE;
+    visited = lre_realloc(opaque, NULL, bc_buf_len);
+    if (!visited)
+        return FALSE;
+    memset(visited, 0, bc_buf_len);
+    stack_size = 16;
+    stack = lre_realloc(opaque, NULL, sizeof(stack[0]) * stack_size);
+    if (!stack)
+        goto done;
+    stack[0] = 0;
+    stack_len = 1;
+    while (stack_len > 0) {
+        pos = stack[--stack_len];
+        if (visited[pos])
+            continue;
+        visited[pos] = 1;
+        opcode = bc_buf[pos];
+        len = reopcode_info[opcode].size;
+        switch(opcode) {
+        case REOP_char:
+        case REOP_char_i:
+        case REOP_char32:
+        case REOP_char32_i:
+            /* the path ends on a test of one or two chars, such as
+               the thousands of alternatives of \p{RGI_Emoji} */
+            n = re_get_op_chars(cc, bc_buf + pos);
+            for(i = 0; i < n; i++) {
+                if (cc[i] < 256)
+                    re_set_bits(bits, cc[i], cc[i]);
+            }
+            re_first_op_pages(pages, bc_buf + pos);
+            continue;
+        case REOP_dot:
+        case REOP_any:
+        case REOP_space:
+        case REOP_not_space:
+        case REOP_range:
+        case REOP_range32:
+            /* the path ends on a char test */
+            for(c = 0; c < 256; c++) {
+                if (re_first_op_accepts(bc_buf + pos, c))
+                    re_set_bits(bits, c, c);
+            }
+            re_first_op_pages(pages, bc_buf + pos);
+            continue;
+        case REOP_save_start:
+        case REOP_save_end:
+        case REOP_save_reset:
+        case REOP_set_i32:
+        case REOP_set_char_pos:
+        case REOP_check_advance:
+        case REOP_line_start:
+        case REOP_line_start_m:
+        case REOP_line_end:
+        case REOP_line_end_m:
+        case REOP_word_boundary:
+        case REOP_word_boundary_i:
+        case REOP_not_word_boundary:
+        case REOP_not_word_boundary_i:
+            /* assertions can only remove chars from the set */
+            pos += len;
+            break;
+        case REOP_goto:
+            pos += len + (int)get_u32(bc_buf + pos + 1);
+            break;
+        case REOP_split_goto_first:
+        case REOP_split_next_first:
+        case REOP_lookahead:
+        case REOP_negative_lookahead:
+        case REOP_loop:
+        case REOP_loop_split_goto_first:
+        case REOP_loop_split_next_first:
+        case REOP_loop_check_adv_split_goto_first:
+        case REOP_loop_check_adv_split_next_first:
+            if (stack_len + 2 > stack_size) {
+                int *new_stack;
+                stack_size = stack_size * 3 / 2 + 2;
+                new_stack = lre_realloc(opaque, stack, sizeof(stack[0]) * stack_size);
+                if (!new_stack)
+                    goto done;
+                stack = new_stack;
+            }
+            c = get_u32(bc_buf + pos + len - 4);
+            stack[stack_len++] = pos + len + (int)c;
+            /* the body of the lookaheads is not followed: it cannot
+               add chars to the set */
+            if (opcode != REOP_lookahead && opcode != REOP_negative_lookahead)
+                stack[stack_len++] = pos + len;
+            continue;
+        default:
+            /* match reached without consuming a char or unsupported
+               opcode */
+            goto done;
+        }
+        stack[stack_len++] = pos;
+    }
+    ret = TRUE;
+ done:
+    lre_realloc(opaque, stack, 0);
+    lre_realloc(opaque, visited, 0);
+    return ret;
+}
 
-#define PEEK_PREV_CHAR(c, cptr, cbuf_start, cbuf_type)                  \
-    do {                                                                \
-        if (cbuf_type == 0) {                                           \
-            c = cptr[-1];                                               \
-        } else {                                                        \
-            const uint16_t *_p = (const uint16_t *)cptr - 1;            \
-            const uint16_t *_start = (const uint16_t *)cbuf_start;      \
-            c = *_p;                                                    \
-            if (is_lo_surrogate(c) && cbuf_type == 2) {                 \
-                if (_p > _start && is_hi_surrogate(_p[-1])) {           \
-                    c = from_surrogate(*--_p, c);                       \
-                }                                                       \
-            }                                                           \
-        }                                                               \
-    } while (0)
+/* return the length of the opcode at 'pc' including its variable
+   length part */
+static int re_get_op_len(const uint8_t *pc)
+{
+    int len = reopcode_info[pc[0]].size;
+    switch(pc[0]) {
+    case REOP_range:
+        len += get_u16(pc + 1) * 4 + RE_RANGE_BITMAP_LEN;
+        break;
+    case REOP_range32:
+        len += get_u16(pc + 1) * 8 + RE_RANGE_BITMAP_LEN;
+        break;
+    case REOP_back_reference:
+    case REOP_back_reference_i:
+    case REOP_backward_back_reference:
+    case REOP_backward_back_reference_i:
+        len += pc[1];
+        break;
+    case REOP_string:
+    case REOP_string_i:
+    case REOP_switch:
+    case REOP_possessive_loop:
+    case REOP_greedy_loop:
+    case REOP_lazy_loop:
+        len += get_u32(pc + 1);
+        break;
+    }
+    return len;
+}
 
-#define GET_PREV_CHAR(c, cptr, cbuf_start, cbuf_type)                   \
-    do {                                                                \
-        if (cbuf_type == 0) {                                           \
-            cptr--;                                                     \
-            c = cptr[0];                                                \
-        } else {                                                        \
-            const uint16_t *_p = (const uint16_t *)cptr - 1;            \
-            const uint16_t *_start = (const uint16_t *)cbuf_start;      \
-            c = *_p;                                                    \
-            if (is_lo_surrogate(c) && cbuf_type == 2) {                 \
-                if (_p > _start && is_hi_surrogate(_p[-1])) {           \
-                    c = from_surrogate(*--_p, c);                       \
-                }                                                       \
-            }                                                           \
-            cptr = (const void *)_p;                                    \
-        }                                                               \
-    } while (0)
+/* Find the longest literal string which is matched by every match of
+   the regexp. Only the code executed on every path is analysed: the
+   optional atoms, the alternatives and the lookaheads are skipped.
+   'bc_buf' points to the code after the implicit search loop. If
+   'ignore_prefix' is TRUE, the literal at the start of the regexp is
+   not considered. Return the number of UTF-16 code units stored in
+   'buf'. */
+static int compute_required(uint16_t *buf, const uint8_t *bc_buf,
+                            int bc_buf_len, BOOL ignore_prefix)
+{
+    int pos, pos1, last_pos, opcode, len, target, n, best_len;
+    uint16_t run[RE_PREFIX_LEN_MAX];
+    BOOL is_start, run_is_start;
+    uint32_t c;
 
-#define PREV_CHAR(cptr, cbuf_start, cbuf_type)                          \
-    do {                                                                \
-        if (cbuf_type == 0) {                                           \
-            cptr--;                                                     \
-        } else {                                                        \
-            const uint16_t *_p = (const uint16_t *)cptr - 1;            \
-            const uint16_t *_start = (const uint16_t *)cbuf_start;      \
-            if (is_lo_surrogate(*_p) && cbuf_type == 2) {               \
-                if (_p > _start && is_hi_surrogate(_p[-1])) {           \
-                    --_p;                                               \
-                }                                                       \
-            }                                                           \
-            cptr = (const void *)_p;                                    \
-        }                                                               \
-    } while (0)
+    best_len = 0;
+    n = 0;
+    is_start = TRUE;
+    run_is_start = FALSE;
+    pos = 0;
+    while (pos < bc_buf_len) {
+        opcode = bc_buf[pos];
+        len = re_get_op_len(bc_buf + pos);
+        switch(opcode) {
+        case REOP_char:
+        case REOP_char32:
+            if (opcode == REOP_char)
+                c = get_u16(bc_buf + pos + 1);
+            else
+                c = get_u32(bc_buf + pos + 1);
+            if (n + 2 > RE_PREFIX_LEN_MAX) {
+                /* too long: start a new string */
+                goto flush;
+            }
+            if (n == 0)
+                run_is_start = is_start;
+            if (c > 0xffff) {
+                run[n++] = get_hi_surrogate(c);
+                run[n++] = get_lo_surrogate(c);
+            } else {
+                run[n++] = c;
+            }
+            break;
+        case REOP_save_start:
+        case REOP_save_end:
+        case REOP_save_reset:
+        case REOP_set_i32:
+        case REOP_set_char_pos:
+        case REOP_check_advance:
+        case REOP_line_start:
+        case REOP_line_start_m:
+        case REOP_line_end:
+        case REOP_line_end_m:
+        case REOP_word_boundary:
+        case REOP_word_boundary_i:
+        case REOP_not_word_boundary:
+        case REOP_not_word_boundary_i:
+            /* no effect on the position */
+            break;
+        case REOP_match:
+        case REOP_goto:
+            /* end of the regexp (a forward 'goto' is not expected
+               because the alternatives are skipped) */
+            goto flush;
+        default:
+        flush:
+            if (n > best_len && !(run_is_start && ignore_prefix)) {
+                memcpy(buf, run, n * sizeof(run[0]));
+                best_len = n;
+            }
+            n = 0;
+            is_start = FALSE;
+            switch(opcode) {
+            case REOP_char:
+            case REOP_char32:
+                /* restart the string with the current char */
+                continue;
+            case REOP_match:
+            case REOP_goto:
+                return best_len;
+            case REOP_split_goto_first:
+            case REOP_split_next_first:
+            case REOP_lookahead:
+            case REOP_negative_lookahead:
+                target = pos + len + (int)get_u32(bc_buf + pos + 1);
+                if (target <= pos) {
+                    /* end of a loop: the body was executed at least once */
+                    break;
+                }
+                if (opcode == REOP_split_goto_first ||
+                    opcode == REOP_split_next_first) {
+                    /* skip all the alternatives if the last opcode
+                       before the target is a forward 'goto' */
+                    last_pos = -1;
+                    for(pos1 = pos + len; pos1 < target; pos1 += re_get_op_len(bc_buf + pos1))
+                        last_pos = pos1;
+                    if (pos1 != target)
+                        return best_len;
+                    if (last_pos >= 0 && bc_buf[last_pos] == REOP_goto) {
+                        pos1 = last_pos + 5 + (int)get_u32(bc_buf + last_pos + 1);
+                        if (pos1 > target)
+                            target = pos1;
+                    }
+                }
+                pos = target;
+                continue;
+            default:
+                /* other char tests, back references and loops */
+                break;
+            }
+            break;
+        }
+        pos += len;
+    }
+    return best_len;
+}
 
-typedef enum {
-    RE_EXEC_STATE_SPLIT,
-    RE_EXEC_STATE_LOOKAHEAD,
-    RE_EXEC_STATE_NEGATIVE_LOOKAHEAD,
-} REExecStateEnum;
+/* Tell if the lazy DFA can simulate the bytecode. The registers are
+   not represented in the DFA states, so the counted loops are
+   simulated as unbounded loops. */
+static int compute_dfa_mode(const uint8_t *bc_buf, int bc_buf_len)
+{
+    int pos, mode;
 
-#if INTPTR_MAX >= INT64_MAX
-#define BP_TYPE_BITS 3
-#else
-#define BP_TYPE_BITS 2
-#endif
+    mode = RE_DFA_EXACT;
+    for(pos = 0; pos < bc_buf_len; pos += re_get_op_len(bc_buf + pos)) {
+        switch(bc_buf[pos]) {
+        case REOP_back_reference:
+        case REOP_back_reference_i:
+        case REOP_backward_back_reference:
+        case REOP_backward_back_reference_i:
+        case REOP_lookahead:
+        case REOP_negative_lookahead:
+        case REOP_lookahead_match:
+        case REOP_negative_lookahead_match:
+        case REOP_prev:
+            return RE_DFA_NONE;
+        case REOP_set_i32:
+        case REOP_loop:
+        case REOP_loop_split_goto_first:
+        case REOP_loop_split_next_first:
+        case REOP_loop_check_adv_split_goto_first:
+        case REOP_loop_check_adv_split_next_first:
+            mode = RE_DFA_APPROX;
+            break;
+        default:
+            break;
+        }
+    }
+    return mode;
+}
 
-typedef union {
-    uint8_t *ptr;
-    intptr_t val; /* for bp, the low BP_SHIFT bits store REExecStateEnum */
-    struct {
-        uintptr_t val : sizeof(uintptr_t) * 8 - BP_TYPE_BITS;
-        uintptr_t type : BP_TYPE_BITS;
-    } bp;
-} StackElem;
+/* Tell if the backtracking should be memoized: a loop contains another
+   loop so that the time can be exponential, and the code after a split
+   only depends on the char position (no back references, lookarounds
+   or registers) so that the (split, position) pairs which were already
+   tried can be skipped. */
+static BOOL re_need_memo(const uint8_t *bc_buf, int bc_buf_len,
+                         int dfa_mode, int register_count)
+{
+    int pos, len, last_loop, target;
+
+    if (dfa_mode != RE_DFA_EXACT || register_count != 0)
+        return FALSE;
+    last_loop = -1;
+    for(pos = 0; pos < bc_buf_len; pos += len) {
+        len = re_get_op_len(bc_buf + pos);
+        switch(bc_buf[pos]) {
+        case REOP_goto:
+        case REOP_split_goto_first:
+        case REOP_split_next_first:
+            target = pos + len + (int)get_u32(bc_buf + pos + 1);
+            if (target <= pos) {
+                /* the previous loop ends inside this one */
+                if (last_loop >= target)
+                    return TRUE;
+                last_loop = pos;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return FALSE;
+}
 
-typedef struct {
-    const uint8_t *cbuf;
-    const uint8_t *cbuf_end;
-    /* 0 = 8 bit chars, 1 = 16 bit chars, 2 = 16 bit chars, UTF-16 */
-    int cbuf_type;
-    int capture_count;
-    BOOL is_unicode;
-    int interrupt_counter;
-    void *opaque; /* used for stack overflow check */
+/* Return TRUE if the code reads the captures with back references.
+   Otherwise only the capture 0 needs to be saved when the other
+   captures are not returned. */
+static BOOL re_has_back_reference(const uint8_t *bc_buf, int bc_buf_len)
+{
+    int pos;
 
-    StackElem *stack_buf;
-    size_t stack_size;
-    StackElem static_stack_buf[32]; /* static stack to avoid allocation in most cases */
-} REExecContext;
+    for(pos = 0; pos < bc_buf_len; pos += re_get_op_len(bc_buf + pos)) {
+        switch(bc_buf[pos]) {
+        case REOP_back_reference:
+        case REOP_back_reference_i:
+        case REOP_backward_back_reference:
+        case REOP_backward_back_reference_i:
+            return TRUE;
+        default:
+            break;
+        }
+    }
+    return FALSE;
+}
 
-static int lre_poll_timeout(REExecContext *s)
+/* Return TRUE if every match starts with the assertion 'opcode':
+   REOP_line_start if the matches can only start at the beginning of
+   the input ('^' without the multiline flag) or REOP_line_start_m if
+   they can only start at the beginning of a line. 'bc_buf' points to
+   the code after the implicit search loop. */
+static BOOL re_is_anchored(const uint8_t *bc_buf, int bc_buf_len, int opcode)
 {
-    if (unlikely(--s->interrupt_counter <= 0)) {
-        s->interrupt_counter = INTERRUPT_COUNTER_INIT;
-        if (lre_check_timeout(s->opaque))
-            return LRE_RET_TIMEOUT;
+    int pos;
+
+    for(pos = 0; pos < bc_buf_len; pos += reopcode_info[bc_buf[pos]].size) {
+        switch(bc_buf[pos]) {
+        case REOP_save_start:
+        case REOP_save_reset:
+            break;
+        default:
+            return bc_buf[pos] == opcode;
+        }
     }
-    return 0;
+    return FALSE;
 }
 
-static no_inline int stack_realloc(REExecContext *s, size_t n)
+/* Compute the code units < 256 which can be consumed first when
+   running the code from 'start'. The assertions are ignored. Return
+   in '*pflags' if a code unit >= 256 can be consumed ('wide_flag') or
+   if the match can be reached without consuming a char ('null_flag').
+   If 'pages' is not NULL, the pages of the code units >= 256 are added
+   to it as in re_first_op_pages(). Return -1 if unsupported opcode. */
+static int re_compute_branch_first(uint8_t *bits, uint8_t *pages, int *pflags,
+                                   int wide_flag, int null_flag,
+                                   const uint8_t *bc_buf, int start,
+                                   uint8_t *visited, int *stack)
 {
-    StackElem *new_stack;
-    size_t new_size;
-    new_size = s->stack_size * 3 / 2;
-    if (new_size < n)
-        new_size = n;
-    if (s->stack_buf == s->static_stack_buf) {
-        new_stack = lre_realloc(s->opaque, NULL, new_size * sizeof(StackElem));
-        if (!new_stack)
-            return -1;
-        /* XXX: could use correct size */
-        memcpy(new_stack, s->stack_buf, s->stack_size * sizeof(StackElem));
-    } else {
-        new_stack = lre_realloc(s->opaque, s->stack_buf, new_size * sizeof(StackElem));
-        if (!new_stack)
-            return -1;
+    int pos, opcode, len, stack_len, i;
+    uint32_t c;
+    uint8_t pages1[32];
+
+    if (!pages) {
+        pages = pages1;
+        memset(pages, 0, sizeof(pages1));
+    }
+    stack[0] = start;
+    visited[start] = 1;
+    stack_len = 1;
+    while (stack_len > 0) {
+        pos = stack[--stack_len];
+        for(;;) {
+            opcode = bc_buf[pos];
+            len = reopcode_info[opcode].size;
+            switch(opcode) {
+            case REOP_char:
+            case REOP_char_i:
+            case REOP_char32:
+            case REOP_char32_i:
+            case REOP_dot:
+            case REOP_any:
+            case REOP_space:
+            case REOP_not_space:
+            case REOP_range:
+            case REOP_range32:
+                for(c = 0; c < 256; c++) {
+                    if (re_first_op_accepts(bc_buf + pos, c))
+                        re_set_bits(bits, c, c);
+                }
+                re_first_op_pages(pages, bc_buf + pos);
+                goto next;
+            case REOP_match:
+                *pflags |= null_flag;
+                goto next;
+            case REOP_save_start:
+            case REOP_save_end:
+            case REOP_save_reset:
+            case REOP_set_i32:
+            case REOP_set_char_pos:
+            case REOP_check_advance:
+            case REOP_line_start:
+            case REOP_line_start_m:
+            case REOP_line_end:
+            case REOP_line_end_m:
+            case REOP_word_boundary:
+            case REOP_word_boundary_i:
+            case REOP_not_word_boundary:
+            case REOP_not_word_boundary_i:
+                pos += len;
+                break;
+            case REOP_goto:
+                pos += len + (int)get_u32(bc_buf + pos + 1);
+                break;
+            case REOP_split_goto_first:
+            case REOP_split_next_first:
+            case REOP_loop:
+            case REOP_loop_split_goto_first:
+            case REOP_loop_split_next_first:
+            case REOP_loop_check_adv_split_goto_first:
+            case REOP_loop_check_adv_split_next_first:
+                c = get_u32(bc_buf + pos + len - 4);
+                if (!visited[pos + len + (int)c]) {
+                    visited[pos + len + (int)c] = 1;
+                    stack[stack_len++] = pos + len + (int)c;
+                }
+                pos += len;
+                break;
+            default:
+                return -1;
+            }
+            if (visited[pos])
+                break;
+            visited[pos] = 1;
+        }
+    next: ;
+    }
+    for(i = 0; i < 32; i++) {
+        if (pages[i] != 0)
+            *pflags |= wide_flag;
     }
-    s->stack_size = new_size;
-    s->stack_buf = new_stack;
     return 0;
 }
 
-/* return 1 if match, 0 if not match or < 0 if error. */
-static intptr_t lre_exec_backtrack(REExecContext *s, uint8_t **capture,
-                                   const uint8_t *pc, const uint8_t *cptr)
+/* Tell if the regexp is one-pass: at each split, the next char tells
+   which branch must be tried and at most one branch can reach the
+   match without consuming a char. Then an entry is added to
+   'entries' for each split. The splits of the code before 'body_start'
+   are not checked. Return the number of entries or -1 if the regexp is
+   not one-pass. */
+static int compute_onepass(DynBuf *entries, const uint8_t *bc_buf,
+                           int bc_buf_len, int body_start, void *opaque)
 {
-    int opcode;
-    int cbuf_type;
-    uint32_t val, c, idx;
-    const uint8_t *cbuf_end;
-    StackElem *sp, *bp, *stack_end;
-#ifdef DUMP_EXEC
-    const uint8_t *pc_start = pc; /* TEST */
-#endif
-    cbuf_type = s->cbuf_type;
-    cbuf_end = s->cbuf_end;
+    int pos, opcode, len, count, pos_a, pos_b, flags, i;
+    uint8_t entry[RE_ONEPASS_ENTRY_LEN];
+    uint8_t *visited;
+    int *stack;
 
-    sp = s->stack_buf;
-    bp = s->stack_buf;
-    stack_end = s->stack_buf + s->stack_size;
-    
-#define CHECK_STACK_SPACE(n)                            \
-    if (unlikely((stack_end - sp) < (n))) {             \
-        size_t saved_sp = sp - s->stack_buf;            \
-        size_t saved_bp = bp - s->stack_buf;            \
-        if (stack_realloc(s, sp - s->stack_buf + (n)))  \
-            return LRE_RET_MEMORY_ERROR;                \
-        stack_end = s->stack_buf + s->stack_size;       \
-        sp = s->stack_buf + saved_sp;                   \
-        bp = s->stack_buf + saved_bp;                   \
+    if (bc_buf_len > 0xffff)
+        return -1;
+    count = -1;
+    visited = lre_realloc(opaque, NULL, bc_buf_len);
+    stack = lre_realloc(opaque, NULL, sizeof(stack[0]) * bc_buf_len);
+    if (!visited || !stack)
+        goto done;
+    count = 0;
+    for(pos = body_start; pos < bc_buf_len; pos += re_get_op_len(bc_buf + pos)) {
+        opcode = bc_buf[pos];
+        len = reopcode_info[opcode].size;
+        switch(opcode) {
+        case REOP_split_goto_first:
+        case REOP_split_next_first:
+        case REOP_loop_split_goto_first:
+        case REOP_loop_split_next_first:
+        case REOP_loop_check_adv_split_goto_first:
+        case REOP_loop_check_adv_split_next_first:
+            break;
+        default:
+            continue;
+        }
+        if (count >= RE_ONEPASS_ENTRY_MAX)
+            goto fail;
+        /* 'a' is the branch tried first */
+        pos_a = pos + len;
+        pos_b = pos + len + (int)get_u32(bc_buf + pos + len - 4);
+        if (opcode == REOP_split_goto_first ||
+            opcode == REOP_loop_split_goto_first ||
+            opcode == REOP_loop_check_adv_split_goto_first) {
+            pos_a = pos_b;
+            pos_b = pos + len;
+        }
+        memset(entry, 0, sizeof(entry));
+        flags = 0;
+        memset(visited, 0, bc_buf_len);
+        if (re_compute_branch_first(entry + 3, NULL, &flags, RE_ONEPASS_WIDE_A,
+                                    RE_ONEPASS_NULL_A, bc_buf, pos_a,
+                                    visited, stack))
+            goto fail;
+        memset(visited, 0, bc_buf_len);
+        if (re_compute_branch_first(entry + 35, NULL, &flags, RE_ONEPASS_WIDE_B,
+                                    RE_ONEPASS_NULL_B, bc_buf, pos_b,
+                                    visited, stack))
+            goto fail;
+        if ((flags & RE_ONEPASS_NULL_A) && (flags & RE_ONEPASS_NULL_B))
+            goto fail;
+        for(i = 0; i < 32; i++) {
+            if (entry[3 + i] & entry[35 + i])
+                goto fail;
+        }
+        put_u16(entry, pos);
+        entry[2] = flags;
+        dbuf_put(entries, entry, sizeof(entry));
+        count++;
     }
+    goto done;
+ fail:
+    count = -1;
+ done:
+    lre_realloc(opaque, stack, 0);
+    lre_realloc(opaque, visited, 0);
+    return count;
+}
 
-    /* XXX: could test if the value was saved to reduce the stack size
-       but slower */
-#define SAVE_CAPTURE(idx, value)                        \
-    {                                                   \
-        CHECK_STACK_SPACE(2);                           \
-        sp[0].val = idx;                                \
-        sp[1].ptr = capture[idx];                       \
-        sp += 2;                                        \
-        capture[idx] = (value);                         \
+/* Follow the code from 'start' without consuming a char. The char
+   tests reached are added to masks[bol] where bol tells if a '^' was
+   crossed: it is only possible if 'from_start' is TRUE. The matches
+   reached set the bit (bol * 2 + eol) of '*pmatch_flags' where eol
+   tells if a '$' was crossed. Return -1 if unsupported opcode. */
+static int re_glushkov_closure(uint64_t *masks, int *pmatch_flags,
+                               const uint8_t *bc_buf, int bc_buf_len,
+                               int start, BOOL from_start,
+                               const int *pos_index, uint8_t *visited,
+                               int *stack)
+{
+    int pos, st, opcode, len, stack_len;
+
+    memset(visited, 0, bc_buf_len);
+    stack[0] = start * 4;
+    stack_len = 1;
+    while (stack_len > 0) {
+        pos = stack[--stack_len];
+        st = pos & 3; /* bit 0 = eol, bit 1 = bol */
+        pos >>= 2;
+        for(;;) {
+            if (visited[pos] & (1 << st))
+                break;
+            visited[pos] |= 1 << st;
+            opcode = bc_buf[pos];
+            len = reopcode_info[opcode].size;
+            switch(opcode) {
+            case REOP_char:
+            case REOP_char_i:
+            case REOP_char32:
+            case REOP_char32_i:
+            case REOP_dot:
+            case REOP_any:
+            case REOP_space:
+            case REOP_not_space:
+            case REOP_range:
+            case REOP_range32:
+                /* no char can follow '$' */
+                if (!(st & 1))
+                    masks[st >> 1] |= (uint64_t)1 << pos_index[pos];
+                goto next;
+            case REOP_match:
+                *pmatch_flags |= 1 << st;
+                goto next;
+            case REOP_line_start:
+                if (!from_start)
+                    goto next;
+                st |= 2;
+                pos += len;
+                break;
+            case REOP_line_end:
+                st |= 1;
+                pos += len;
+                break;
+            case REOP_save_start:
+            case REOP_save_end:
+            case REOP_save_reset:
+            case REOP_set_char_pos:
+            case REOP_check_advance:
+                pos += len;
+                break;
+            case REOP_goto:
+                pos += len + (int)get_u32(bc_buf + pos + 1);
+                break;
+            case REOP_split_goto_first:
+            case REOP_split_next_first:
+                stack[stack_len++] = (pos + len + (int)get_u32(bc_buf + pos + 1)) * 4 + st;
+                pos += len;
+                break;
+            default:
+                return -1;
+            }
+        }
+    next: ;
     }
+    return 0;
+}
 
-    /* avoid saving the previous value if already saved */
-#define SAVE_CAPTURE_CHECK(idx, value)          \
-    {                                           \
-        StackElem *sp1;                         \
-        sp1 = sp;                               \
-        for(;;) {                               \
-            if (sp1 > bp) {                             \
-                if (sp1[-2].val == idx)                 \
-                    break;                              \
-                sp1 -= 2;                               \
-            } else {                                    \
-                CHECK_STACK_SPACE(2);                   \
-                sp[0].val = idx;                        \
-                sp[1].ptr = capture[idx];               \
-                sp += 2;                                \
-                break;                                  \
-            }                                           \
-        }                                               \
-        capture[idx] = (value);                         \
+/* build the table of the unions of 'masks' indexed by the 4 bit chunks
+   of a position mask */
+static void glushkov_build_tab(uint64_t (*tab)[16], const uint64_t *masks,
+                               int npos)
+{
+    int k, v;
+
+    for(k = 0; k < (npos + 3) / 4; k++) {
+        tab[k][0] = 0;
+        for(v = 1; v < 16; v++) {
+            tab[k][v] = tab[k][v & (v - 1)];
+            if (4 * k + ctz32(v) < npos)
+                tab[k][v] |= masks[4 * k + ctz32(v)];
+        }
     }
+}
 
-
-#ifdef DUMP_EXEC
-    printf("%5s %5s %5s %5s %s\n", "PC", "CP", "BP", "SP", "OPCODE");
-#endif    
-    for(;;) {
-        opcode = *pc++;
-#ifdef DUMP_EXEC
-        printf("%5ld %5ld %5ld %5ld %s\n",
-               pc - 1 - pc_start,
-               cbuf_type == 0 ? cptr - s->cbuf : (cptr - s->cbuf) / 2,
-               bp - s->stack_buf,
-               sp - s->stack_buf,
-               reopcode_info[opcode].name);
-#endif        
+/* Build the Glushkov automaton of the code after 'body_start' and
+   append it to 'dbuf'. Only the regexps without counted loops, back
+   references, lookarounds and with at most RE_GLUSHKOV_POS_MAX char
+   tests are supported. '^' and '$' are only supported without the
+   multiline flag. Return the number of positions or -1 if not
+   supported. */
+static int compute_glushkov(DynBuf *dbuf, const uint8_t *bc_buf,
+                            int bc_buf_len, int body_start, void *opaque)
+{
+    int pos, opcode, npos, i, c, class_count, match_flags, ret;
+    int pos_pc[RE_GLUSHKOV_POS_MAX];
+    uint64_t first[2], last_any, last_end, masks[2], mask;
+    uint64_t follow[RE_GLUSHKOV_POS_MAX], class_masks[256];
+    uint64_t follow_tab[RE_GLUSHKOV_POS_MAX / 4][16];
+    uint8_t class_map[256];
+    int *pos_index, *stack;
+    uint8_t *visited;
+
+    if (bc_buf_len > 0xffff)
+        return -1;
+    ret = -1;
+    pos_index = lre_realloc(opaque, NULL, sizeof(pos_index[0]) * bc_buf_len);
+    /* at most 2 entries are pushed for each split */
+    stack = lre_realloc(opaque, NULL, sizeof(stack[0]) * bc_buf_len * 4);
+    visited = lre_realloc(opaque, NULL, bc_buf_len);
+    if (!pos_index || !stack || !visited)
+        goto done;
+
+    npos = 0;
+    for(pos = body_start; pos < bc_buf_len; pos += re_get_op_len(bc_buf + pos)) {
+        opcode = bc_buf[pos];
         switch(opcode) {
-        case REOP_match:
-            return 1;
-        no_match:
-            for(;;) {
-                REExecStateEnum type;
-                if (bp == s->stack_buf)
-                    return 0;
-                /* undo the modifications to capture[] */
-                while (sp > bp) {
-                    capture[sp[-2].val] = sp[-1].ptr;
-                    sp -= 2;
-                }
-                
-                pc = sp[-3].ptr;
-                cptr = sp[-2].ptr;
-                type = sp[-1].bp.type;
-                bp = s->stack_buf + sp[-1].bp.val;
-                sp -= 3;
-                if (type != RE_EXEC_STATE_LOOKAHEAD)
-                    break;
-            }
-            if (lre_poll_timeout(s))
-                return LRE_RET_TIMEOUT;
-            break;
-        case REOP_lookahead_match:
-            /* pop all the saved states until reaching the start of
-               the lookahead and keep the updated captures and
-               variables and the corresponding undo info. */
-            {
-                StackElem *sp1, *sp_top, *next_sp;
-                REExecStateEnum type;
-
-                sp_top = sp;
-                for(;;) {
-                    sp1 = sp;
-                    sp = bp;
-                    pc = sp[-3].ptr;
-                    cptr = sp[-2].ptr;
-                    type = sp[-1].bp.type;
-                    bp = s->stack_buf + sp[-1].bp.val;
-                    sp[-1].ptr = (void *)sp1; /* save the next value for the copy step */
-                    sp -= 3;
-                    if (type == RE_EXEC_STATE_LOOKAHEAD)
-                        break;
-                }
-                if (sp != s->stack_buf) {
-                    /* keep the undo info if there is a saved state */
-                    sp1 = sp;
-                    while (sp1 < sp_top) {
-                        next_sp = (void *)sp1[2].ptr;
-                        sp1 += 3;
-                        while (sp1 < next_sp)
-                            *sp++ = *sp1++;
-                    }
-                }
-            }
-            break;
-        case REOP_negative_lookahead_match:
-            /* pop all the saved states until reaching start of the negative lookahead */
-            for(;;) {
-                REExecStateEnum type;
-                type = bp[-1].bp.type;
-                /* undo the modifications to capture[] */
-                while (sp > bp) {
-                    capture[sp[-2].val] = sp[-1].ptr;
-                    sp -= 2;
-                }
-                pc = sp[-3].ptr;
-                cptr = sp[-2].ptr;
-                type = sp[-1].bp.type;
-                bp = s->stack_buf + sp[-1].bp.val;
-                sp -= 3;
-                if (type == RE_EXEC_STATE_NEGATIVE_LOOKAHEAD)
-                    break;
-            }
-            goto no_match;
-        case REOP_char32:
-        case REOP_char32_i:
-            val = get_u32(pc);
-            pc += 4;
-            goto test_char;
         case REOP_char:
         case REOP_char_i:
-            val = get_u16(pc);
-            pc += 2;
-        test_char:
-            if (cptr >= cbuf_end)
-                goto no_match;
-            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
-            if (opcode == REOP_char_i || opcode == REOP_char32_i) {
-                c = lre_canonicalize(c, s->is_unicode);
-            }
-            if (val != c)
-                goto no_match;
+        case REOP_char32:
+        case REOP_char32_i:
+        case REOP_dot:
+        case REOP_any:
+        case REOP_space:
+        case REOP_not_space:
+        case REOP_range:
+        case REOP_range32:
+            if (npos >= RE_GLUSHKOV_POS_MAX)
+                goto done;
+            pos_pc[npos] = pos;
+            pos_index[pos] = npos++;
             break;
-        case REOP_split_goto_first:
-        case REOP_split_next_first:
-            {
-                const uint8_t *pc1;
-
-                val = get_u32(pc);
-                pc += 4;
-                if (opcode == REOP_split_next_first) {
-                    pc1 = pc + (int)val;
-                } else {
-                    pc1 = pc;
-                    pc = pc + (int)val;
-                }
-                CHECK_STACK_SPACE(3);
-                sp[0].ptr = (uint8_t *)pc1;
-                sp[1].ptr = (uint8_t *)cptr;
-                sp[2].bp.val = bp - s->stack_buf;
-                sp[2].bp.type = RE_EXEC_STATE_SPLIT;
-                sp += 3;
-                bp = sp;
-            }
-            break;
-        case REOP_lookahead:
-        case REOP_negative_lookahead:
-            val = get_u32(pc);
-            pc += 4;
-            CHECK_STACK_SPACE(3);
-            sp[0].ptr = (uint8_t *)(pc + (int)val);
-            sp[1].ptr = (uint8_t *)cptr;
-            sp[2].bp.val = bp - s->stack_buf;
-            sp[2].bp.type = RE_EXEC_STATE_LOOKAHEAD + opcode - REOP_lookahead;
-            sp += 3;
-            bp = sp;
+        default:
             break;
+        }
+    }
+
+    first[0] = first[1] = 0;
+    match_flags = 0;
+    if (re_glushkov_closure(first, &match_flags, bc_buf, bc_buf_len,
+                            body_start, TRUE, pos_index, visited, stack))
+        goto done;
+    last_any = last_end = 0;
+    for(i = 0; i < npos; i++) {
+        int flags = 0;
+        masks[0] = masks[1] = 0;
+        if (re_glushkov_closure(masks, &flags, bc_buf, bc_buf_len,
+                                pos_pc[i] + re_get_op_len(bc_buf + pos_pc[i]),
+                                FALSE, pos_index, visited, stack))
+            goto done;
+        follow[i] = masks[0];
+        if (flags & RE_GLUSHKOV_EMPTY_ANY)
+            last_any |= (uint64_t)1 << i;
+        if (flags & RE_GLUSHKOV_EMPTY_EOL)
+            last_end |= (uint64_t)1 << i;
+    }
+
+    /* the code units < 256 accepted by the same positions share a
+       class */
+    class_count = 0;
+    for(c = 0; c < 256; c++) {
+        mask = 0;
+        for(i = 0; i < npos; i++) {
+            if (re_first_op_accepts(bc_buf + pos_pc[i], c))
+                mask |= (uint64_t)1 << i;
+        }
+        for(i = 0; i < class_count; i++) {
+            if (class_masks[i] == mask)
+                break;
+        }
+        if (i == class_count)
+            class_masks[class_count++] = mask;
+        class_map[c] = i;
+    }
+
+    dbuf_putc(dbuf, match_flags);
+    dbuf_put_u16(dbuf, class_count);
+    dbuf_put_u64(dbuf, first[0]);
+    dbuf_put_u64(dbuf, first[1]);
+    dbuf_put_u64(dbuf, last_any);
+    dbuf_put_u64(dbuf, last_end);
+    glushkov_build_tab(follow_tab, follow, npos);
+    for(i = 0; i < (npos + 3) / 4; i++) {
+        for(c = 0; c < 16; c++)
+            dbuf_put_u64(dbuf, follow_tab[i][c]);
+    }
+    for(i = 0; i < npos; i++)
+        dbuf_put_u16(dbuf, pos_pc[i]);
+    dbuf_put(dbuf, class_map, sizeof(class_map));
+    for(i = 0; i < class_count; i++)
+        dbuf_put_u64(dbuf, class_masks[i]);
+    ret = npos;
+ done:
+    lre_realloc(opaque, visited, 0);
+    lre_realloc(opaque, stack, 0);
+    lre_realloc(opaque, pos_index, 0);
+    return ret;
+}
+
+static void *lre_bytecode_realloc(void *opaque, void *ptr, size_t size)
+{
+    if (size > (INT32_MAX / 2)) {
+        /* the bytecode cannot be larger than 2G. Leave some slack to 
+           avoid some overflows. */
+        return NULL;
+    } else {
+        return lre_realloc(opaque, ptr, size);
+    }
+}
+
+/* Replace the byte code with 'out', which holds its opcodes at the
+   new positions 'pos_map[]' (resp. 'jump_map[]' for the jump targets)
+   with some inserted opcodes. The jumps and the positions in the
+   one-pass table and in the Glushkov automaton are updated. */
+static void re_relocate(REParseState *s, DynBuf *out,
+                        const int *pos_map, const int *jump_map,
+                        DynBuf *onepass, int onepass_count,
+                        DynBuf *glushkov, int glushkov_count)
+{
+    const uint8_t *bc_buf;
+    uint8_t *tab;
+    int bc_len, pos, len, off, target, pos1, i;
+    uint32_t val;
+
+    bc_buf = s->byte_code.buf + RE_HEADER_LEN;
+    bc_len = s->byte_code.size - RE_HEADER_LEN;
+    for(pos = 0; pos < bc_len; pos += len) {
+        len = re_get_op_len(bc_buf + pos);
+        switch(bc_buf[pos]) {
         case REOP_goto:
-            val = get_u32(pc);
-            pc += 4 + (int)val;
-            if (lre_poll_timeout(s))
-                return LRE_RET_TIMEOUT;
+        case REOP_split_goto_first:
+        case REOP_split_next_first:
+        case REOP_lookahead:
+        case REOP_negative_lookahead:
+            off = 1;
             break;
-        case REOP_line_start:
-        case REOP_line_start_m:
-            if (cptr == s->cbuf)
-                break;
-            if (opcode == REOP_line_start)
-                goto no_match;
-            PEEK_PREV_CHAR(c, cptr, s->cbuf, cbuf_type);
-            if (!is_line_terminator(c))
-                goto no_match;
+        case REOP_loop:
+            off = 2;
             break;
-        case REOP_line_end:
-        case REOP_line_end_m:
-            if (cptr == cbuf_end)
-                break;
-            if (opcode == REOP_line_end)
-                goto no_match;
-            PEEK_CHAR(c, cptr, cbuf_end, cbuf_type);
-            if (!is_line_terminator(c))
-                goto no_match;
+        case REOP_loop_split_goto_first:
+        case REOP_loop_split_next_first:
+        case REOP_loop_check_adv_split_goto_first:
+        case REOP_loop_check_adv_split_next_first:
+            off = 6;
             break;
-        case REOP_dot:
-            if (cptr == cbuf_end)
-                goto no_match;
-            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
-            if (is_line_terminator(c))
-                goto no_match;
+        case REOP_switch:
+            /* end and tail of the chain (no tail if 0) */
+            pos1 = pos_map[pos];
+            for(off = 5; off <= 9; off += 4) {
+                val = get_u32(bc_buf + pos + off);
+                if (off == 9 && val == 0)
+                    continue;
+                target = pos + len + (int)val;
+                put_u32(out->buf + RE_HEADER_LEN + pos1 + off,
+                        jump_map[target] - (pos1 + len));
+            }
+            continue;
+        case REOP_possessive_loop:
+        case REOP_greedy_loop:
+        case REOP_lazy_loop:
+            /* atom and end of the loop */
+            pos1 = pos_map[pos];
+            target = pos + len + (int)get_u32(bc_buf + pos + 13);
+            put_u32(out->buf + RE_HEADER_LEN + pos1 + 13,
+                    pos_map[target] - (pos1 + len));
+            target = pos + len + (int)get_u32(bc_buf + pos + 17);
+            put_u32(out->buf + RE_HEADER_LEN + pos1 + 17,
+                    jump_map[target] - (pos1 + len));
+            continue;
+        default:
+            continue;
+        }
+        target = pos + len + (int)get_u32(bc_buf + pos + off);
+        pos1 = pos_map[pos];
+        put_u32(out->buf + RE_HEADER_LEN + pos1 + off,
+                jump_map[target] - (pos1 + len));
+    }
+
+    if (onepass_count >= 0 && !dbuf_error(onepass)) {
+        for(i = 0; i < onepass_count; i++) {
+            tab = onepass->buf + i * RE_ONEPASS_ENTRY_LEN;
+            put_u16(tab, pos_map[get_u16(tab)]);
+        }
+    }
+    if (glushkov_count >= 0 && !dbuf_error(glushkov)) {
+        tab = glushkov->buf + RE_GLUSHKOV_FOLLOW +
+            (glushkov_count + 3) / 4 * 16 * 8;
+        for(i = 0; i < glushkov_count; i++)
+            put_u16(tab + i * 2, pos_map[get_u16(tab + i * 2)]);
+    }
+
+    dbuf_free(&s->byte_code);
+    s->byte_code = *out;
+    put_u32(s->byte_code.buf + RE_HEADER_BYTECODE_LEN,
+            s->byte_code.size - RE_HEADER_LEN);
+}
+
+/* minimum number of REOP_char ops replaced by a REOP_string */
+#define RE_STRING_LEN_MIN 3
+
+/* return the number of REOP_char (or REOP_char_i) ops of chars < 256
+   starting at 'pos' */
+static int re_char_run_len(const uint8_t *bc_buf, int bc_buf_len, int pos)
+{
+    int opcode, n;
+
+    opcode = bc_buf[pos];
+    if (opcode != REOP_char && opcode != REOP_char_i)
+        return 0;
+    n = 0;
+    while (pos < bc_buf_len && bc_buf[pos] == opcode &&
+           get_u16(bc_buf + pos + 1) < 256 &&
+           (opcode == REOP_char || get_u16(bc_buf + pos + 3) < 256)) {
+        n++;
+        pos += reopcode_info[opcode].size;
+    }
+    return n;
+}
+
+/* Peephole pass: insert a REOP_string (resp. REOP_string_i) before
+   the runs of at least RE_STRING_LEN_MIN REOP_char (resp. REOP_char_i)
+   of chars < 256. It holds the chars of the run (for REOP_string_i,
+   the first variant of each char then the second one) so that
+   lre_exec_backtrack() tests them with a single dispatch. The other
+   engines take it as a goto to the REOP_char ops. The positions in
+   the one-pass table and in the Glushkov automaton are updated.
+   Return -1 if memory error. */
+static int re_add_strings(REParseState *s, DynBuf *onepass, int onepass_count,
+                          DynBuf *glushkov, int glushkov_count)
+{
+    DynBuf out;
+    const uint8_t *bc_buf;
+    int bc_len, new_len, pos, len, n, i, j, size, nvar;
+    int *pos_map, *jump_map;
+
+    bc_buf = s->byte_code.buf + RE_HEADER_LEN;
+    bc_len = s->byte_code.size - RE_HEADER_LEN;
+    new_len = bc_len;
+    for(pos = 0; pos < bc_len; pos += len) {
+        n = re_char_run_len(bc_buf, bc_len, pos);
+        if (n >= RE_STRING_LEN_MIN) {
+            size = reopcode_info[bc_buf[pos]].size;
+            new_len += 5 + n * (size / 2);
+            len = size * n;
+        } else {
+            len = re_get_op_len(bc_buf + pos);
+        }
+    }
+    if (new_len == bc_len)
+        return 0;
+    /* the positions in the tables are 16 bit */
+    if (new_len > 0xffff && (onepass_count >= 0 || glushkov_count >= 0))
+        return 0;
+
+    /* new position of each opcode and of each jump target */
+    pos_map = lre_realloc(s->opaque, NULL, sizeof(pos_map[0]) * (bc_len + 1) * 2);
+    if (!pos_map)
+        return -1;
+    jump_map = pos_map + bc_len + 1;
+    dbuf_init2(&out, s->opaque, lre_bytecode_realloc);
+    dbuf_put(&out, s->byte_code.buf, RE_HEADER_LEN);
+    for(pos = 0; pos < bc_len; pos += len) {
+        n = re_char_run_len(bc_buf, bc_len, pos);
+        if (n >= RE_STRING_LEN_MIN) {
+            size = reopcode_info[bc_buf[pos]].size;
+            nvar = size / 2; /* number of chars per op */
+            jump_map[pos] = out.size - RE_HEADER_LEN;
+            dbuf_putc(&out, bc_buf[pos] == REOP_char ? REOP_string : REOP_string_i);
+            dbuf_put_u32(&out, n * nvar);
+            for(j = 0; j < nvar; j++) {
+                for(i = 0; i < n; i++)
+                    dbuf_putc(&out, get_u16(bc_buf + pos + size * i + 1 + 2 * j));
+            }
+            for(i = 0; i < n; i++) {
+                pos_map[pos + size * i] = out.size - RE_HEADER_LEN + size * i;
+                if (i != 0)
+                    jump_map[pos + size * i] = pos_map[pos + size * i];
+            }
+            len = size * n;
+        } else {
+            pos_map[pos] = jump_map[pos] = out.size - RE_HEADER_LEN;
+            len = re_get_op_len(bc_buf + pos);
+        }
+        dbuf_put(&out, bc_buf + pos, len);
+    }
+    pos_map[bc_len] = jump_map[bc_len] = out.size - RE_HEADER_LEN;
+    if (dbuf_error(&out)) {
+        dbuf_free(&out);
+        lre_realloc(s->opaque, pos_map, 0);
+        return -1;
+    }
+
+    re_relocate(s, &out, pos_map, jump_map, onepass, onepass_count,
+                glushkov, glushkov_count);
+    lre_realloc(s->opaque, pos_map, 0);
+    return 0;
+}
+
+/* minimum number of literal alternatives replaced by a REOP_switch */
+#define RE_SWITCH_ALT_MIN 3
+
+typedef struct {
+    uint32_t c;
+    int node;
+    int child;
+    int nvar; /* number of case variants of the char */
+    int next; /* next edge of the same node or -1 */
+    int hash_next; /* next edge of the same hash bucket or -1 */
+} RETrieEdge;
+
+typedef struct {
+    int edges; /* first edge or -1 */
+    int edge_count;
+    BOOL is_final;
+} RETrieNode;
+
+typedef struct {
+    DynBuf nodes; /* the first one is the root */
+    DynBuf edges;
+    /* the edges indexed by their node and char, so that the large
+       nodes such as the root of \p{RGI_Emoji} are not scanned */
+    int hash_bits;
+    int *hash_table; /* first edge of each bucket or -1 */
+} RETrie;
+
+#define TRIE_NODE(t, i) (((RETrieNode *)(t)->nodes.buf)[i])
+#define TRIE_EDGE(t, i) (((RETrieEdge *)(t)->edges.buf)[i])
+
+/* return the new node index or -1 if memory error */
+static int re_trie_new_node(RETrie *t)
+{
+    RETrieNode n;
+    n.edges = -1;
+    n.edge_count = 0;
+    n.is_final = FALSE;
+    if (dbuf_put(&t->nodes, (uint8_t *)&n, sizeof(n)))
+        return -1;
+    return t->nodes.size / sizeof(n) - 1;
+}
+
+static void re_trie_init(RETrie *t, void *opaque)
+{
+    dbuf_init2(&t->nodes, opaque, lre_realloc);
+    dbuf_init2(&t->edges, opaque, lre_realloc);
+    t->hash_bits = 0;
+    t->hash_table = NULL;
+}
+
+static void re_trie_free(RETrie *t)
+{
+    lre_realloc(t->nodes.opaque, t->hash_table, 0);
+    dbuf_free(&t->nodes);
+    dbuf_free(&t->edges);
+}
+
+static uint32_t re_trie_hash(RETrie *t, int node, uint32_t c)
+{
+    return ((node * 263 + c) * 0x61C88647) >> (32 - t->hash_bits);
+}
+
+/* remove all the nodes and edges. Return -1 if memory error. */
+static int re_trie_reset(RETrie *t)
+{
+    RETrieEdge *edge;
+    int e, n_edges;
+
+    n_edges = t->edges.size / sizeof(RETrieEdge);
+    for(e = 0; e < n_edges; e++) {
+        edge = &TRIE_EDGE(t, e);
+        t->hash_table[re_trie_hash(t, edge->node, edge->c)] = -1;
+    }
+    t->nodes.size = 0;
+    t->edges.size = 0;
+    return re_trie_new_node(t);
+}
+
+/* return the edge of 'node' for the char 'c' or -1 */
+static int re_trie_find(RETrie *t, int node, uint32_t c)
+{
+    int e;
+    if (!t->hash_table)
+        return -1;
+    for(e = t->hash_table[re_trie_hash(t, node, c)]; e >= 0;
+        e = TRIE_EDGE(t, e).hash_next) {
+        if (TRIE_EDGE(t, e).node == node && TRIE_EDGE(t, e).c == c)
+            return e;
+    }
+    return -1;
+}
+
+/* add an edge from 'node' to 'child' for the char 'c'. Return -1 if
+   memory error. */
+static int re_trie_add_edge(RETrie *t, int node, uint32_t c, int child,
+                            int nvar)
+{
+    RETrieEdge edge, *e1;
+    int n_edges, e, *new_hash_table;
+    uint32_t h;
+
+    n_edges = t->edges.size / sizeof(RETrieEdge);
+    /* increase the size of the hash table if needed */
+    if (n_edges + 1 > (1 << t->hash_bits) / 2) {
+        t->hash_bits = max_int(t->hash_bits + 1, 4);
+        new_hash_table = lre_realloc(t->nodes.opaque, t->hash_table,
+                                     sizeof(int) << t->hash_bits);
+        if (!new_hash_table)
+            return -1;
+        t->hash_table = new_hash_table;
+        for(h = 0; h < (1 << t->hash_bits); h++)
+            t->hash_table[h] = -1;
+        for(e = 0; e < n_edges; e++) {
+            e1 = &TRIE_EDGE(t, e);
+            h = re_trie_hash(t, e1->node, e1->c);
+            e1->hash_next = t->hash_table[h];
+            t->hash_table[h] = e;
+        }
+    }
+    h = re_trie_hash(t, node, c);
+    edge.c = c;
+    edge.node = node;
+    edge.child = child;
+    edge.nvar = nvar;
+    edge.next = TRIE_NODE(t, node).edges;
+    edge.hash_next = t->hash_table[h];
+    if (dbuf_put(&t->edges, (uint8_t *)&edge, sizeof(edge)))
+        return -1;
+    t->hash_table[h] = n_edges;
+    TRIE_NODE(t, node).edges = n_edges;
+    TRIE_NODE(t, node).edge_count++;
+    return 0;
+}
+
+/* Add the literal alternative made of the REOP_char ops between 'pos'
+   and 'end'. The case variants of a char lead to the same node. Return
+   1 if it cannot be added because a shorter alternative which is a
+   prefix of it was added before or because the chars are not
+   consistent with the existing edges, -1 if memory error. */
+static int re_trie_add(RETrie *t, const uint8_t *bc_buf, int pos, int end)
+{
+    uint32_t c[2];
+    int node, child, p, e, e1, nvar, i;
+
+    node = 0;
+    for(p = pos; p < end; p += reopcode_info[bc_buf[p]].size) {
+        nvar = re_get_op_chars(c, bc_buf + p);
+        e = re_trie_find(t, node, c[0]);
+        if (nvar == 2) {
+            e1 = re_trie_find(t, node, c[1]);
+            if ((e < 0) != (e1 < 0))
+                return 1;
+            if (e >= 0 && TRIE_EDGE(t, e1).child != TRIE_EDGE(t, e).child)
+                return 1;
+        }
+        if (e < 0)
             break;
-        case REOP_any:
-            if (cptr == cbuf_end)
-                goto no_match;
-            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+        if (TRIE_EDGE(t, e).nvar != nvar)
+            return 1;
+        node = TRIE_EDGE(t, e).child;
+        if (TRIE_NODE(t, node).is_final &&
+            p + reopcode_info[bc_buf[p]].size < end)
+            return 1;
+    }
+
+    node = 0;
+    for(p = pos; p < end; p += reopcode_info[bc_buf[p]].size) {
+        nvar = re_get_op_chars(c, bc_buf + p);
+        e = re_trie_find(t, node, c[0]);
+        if (e >= 0) {
+            node = TRIE_EDGE(t, e).child;
+            continue;
+        }
+        child = re_trie_new_node(t);
+        if (child < 0)
+            return -1;
+        for(i = 0; i < nvar; i++) {
+            if (re_trie_add_edge(t, node, c[i], child, nvar))
+                return -1;
+        }
+        node = child;
+    }
+    TRIE_NODE(t, node).is_final = TRUE;
+    return 0;
+}
+
+static int re_trie_edge_cmp(const void *a, const void *b, void *arg)
+{
+    uint32_t c1 = ((const RETrieEdge *)a)->c;
+    uint32_t c2 = ((const RETrieEdge *)b)->c;
+    return (c1 > c2) - (c1 < c2);
+}
+
+/* return TRUE if the nodes 'a' and 'b' of re_trie_write() match the
+   same strings */
+static BOOL re_trie_node_equal(RETrie *t, const RETrieEdge *tab,
+                               const int *first, int a, int b)
+{
+    int i, n;
+    if (TRIE_NODE(t, a).is_final != TRIE_NODE(t, b).is_final)
+        return FALSE;
+    n = first[a + 1] - first[a];
+    if (n != first[b + 1] - first[b])
+        return FALSE;
+    for(i = 0; i < n; i++) {
+        if (tab[first[a] + i].c != tab[first[b] + i].c ||
+            tab[first[a] + i].child != tab[first[b] + i].child)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Each node is stored as a u32 (number of edges * 2 + 1 if an
+   alternative ends there) followed by the sorted chars of its edges
+   and by the offsets of their child nodes from the root, as u32. The
+   nodes which match the same strings are stored once, so that the
+   common suffixes of the alternatives, such as the leaves and the
+   modifiers of the emoji sequences, do not take space for each
+   alternative. Return -1 if memory error. */
+static int re_trie_write(DynBuf *out, RETrie *t, void *opaque)
+{
+    RETrieEdge *tab;
+    uint32_t *offsets, off, h;
+    int *first, *canon, *hash_table;
+    int n_nodes, n_edges, hash_size, i, j, e, ret;
+
+    n_nodes = t->nodes.size / sizeof(RETrieNode);
+    n_edges = t->edges.size / sizeof(RETrieEdge);
+    hash_size = 1;
+    while (hash_size < 2 * n_nodes)
+        hash_size <<= 1;
+    tab = lre_realloc(opaque, NULL, sizeof(tab[0]) * max_int(n_edges, 1));
+    offsets = lre_realloc(opaque, NULL, sizeof(offsets[0]) * n_nodes);
+    first = lre_realloc(opaque, NULL, sizeof(first[0]) * (n_nodes + 1));
+    canon = lre_realloc(opaque, NULL, sizeof(canon[0]) * n_nodes);
+    hash_table = lre_realloc(opaque, NULL, sizeof(hash_table[0]) * hash_size);
+    ret = -1;
+    if (!tab || !offsets || !first || !canon || !hash_table)
+        goto done;
+
+    /* the sorted edges of node i are tab[first[i]] to tab[first[i + 1] - 1] */
+    j = 0;
+    for(i = 0; i < n_nodes; i++) {
+        first[i] = j;
+        for(e = TRIE_NODE(t, i).edges; e >= 0; e = TRIE_EDGE(t, e).next)
+            tab[j++] = TRIE_EDGE(t, e);
+        rqsort(tab + first[i], j - first[i], sizeof(tab[0]),
+               re_trie_edge_cmp, NULL);
+    }
+    first[n_nodes] = j;
+
+    /* the children have a larger index than their parent, so they are
+       merged first. The root is kept at offset 0. */
+    for(i = 0; i < hash_size; i++)
+        hash_table[i] = -1;
+    for(i = n_nodes - 1; i >= 0; i--) {
+        h = TRIE_NODE(t, i).is_final;
+        for(e = first[i]; e < first[i + 1]; e++) {
+            tab[e].child = canon[tab[e].child];
+            h = (h * 263 + tab[e].c) * 263 + tab[e].child;
+        }
+        canon[i] = i;
+        if (i == 0)
             break;
-        case REOP_space:
-            if (cptr == cbuf_end)
-                goto no_match;
-            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
-            if (!lre_is_space(c))
-                goto no_match;
+        h = (h * 0x61C88647) & (hash_size - 1);
+        while (hash_table[h] >= 0) {
+            if (re_trie_node_equal(t, tab, first, hash_table[h], i)) {
+                canon[i] = hash_table[h];
+                break;
+            }
+            h = (h + 1) & (hash_size - 1);
+        }
+        if (canon[i] == i)
+            hash_table[h] = i;
+    }
+
+    off = 0;
+    for(i = 0; i < n_nodes; i++) {
+        if (canon[i] == i) {
+            offsets[i] = off;
+            off += 4 + 8 * (first[i + 1] - first[i]);
+        }
+    }
+    for(i = 0; i < n_nodes; i++) {
+        if (canon[i] != i)
+            continue;
+        dbuf_put_u32(out, (first[i + 1] - first[i]) * 2 +
+                     TRIE_NODE(t, i).is_final);
+        for(e = first[i]; e < first[i + 1]; e++)
+            dbuf_put_u32(out, tab[e].c);
+        for(e = first[i]; e < first[i + 1]; e++)
+            dbuf_put_u32(out, offsets[tab[e].child]);
+    }
+    ret = dbuf_error(out);
+ done:
+    lre_realloc(opaque, tab, 0);
+    lre_realloc(opaque, offsets, 0);
+    lre_realloc(opaque, first, 0);
+    lre_realloc(opaque, canon, 0);
+    lre_realloc(opaque, hash_table, 0);
+    return ret;
+}
+
+/* return the position after the REOP_char ops starting at 'pos' */
+static int re_skip_chars(const uint8_t *bc_buf, int bc_len, int pos)
+{
+    uint32_t c[2];
+    while (pos < bc_len && re_get_op_chars(c, bc_buf + pos))
+        pos += reopcode_info[bc_buf[pos]].size;
+    return pos;
+}
+
+/* Add to the trie the chain of literal alternatives starting at 'pos'
+   as long as they can be added. Return their number (-1 if memory
+   error), the jump target of the alternatives in '*pend' and the
+   position of the remaining ones in '*ptail' (-1 if none). */
+static int re_parse_switch(RETrie *t, int *pend, int *ptail,
+                           const uint8_t *bc_buf, int bc_len, int pos)
+{
+    int n_alt, end, next, p, target, ret;
+
+    n_alt = 0;
+    end = -1;
+    while (pos < bc_len) {
+        if (bc_buf[pos] == REOP_split_next_first) {
+            /* split_next_first next; chars; goto end; next: */
+            next = pos + 5 + (int)get_u32(bc_buf + pos + 1);
+            p = re_skip_chars(bc_buf, bc_len, pos + 5);
+            if (p == pos + 5 || p + 5 != next || bc_buf[p] != REOP_goto)
+                break;
+            target = next + (int)get_u32(bc_buf + p + 1);
+            if (end >= 0 && target != end)
+                break;
+            ret = re_trie_add(t, bc_buf, pos + 5, p);
+            if (ret < 0)
+                return -1;
+            if (ret)
+                break;
+            end = target;
+            n_alt++;
+            pos = next;
+        } else {
+            /* last alternative: chars; end: */
+            p = re_skip_chars(bc_buf, bc_len, pos);
+            if (end < 0 || p == pos || p != end)
+                break;
+            ret = re_trie_add(t, bc_buf, pos, p);
+            if (ret < 0)
+                return -1;
+            if (ret)
+                break;
+            n_alt++;
+            pos = -1;
+            break;
+        }
+    }
+    *pend = end;
+    *ptail = pos;
+    return n_alt;
+}
+
+/* Peephole pass: insert a REOP_switch before the chains of at least
+   RE_SWITCH_ALT_MIN literal alternatives, such as the ones generated
+   by re_emit_string_list() for the class strings and the properties
+   of strings:
+
+       split_next_first L1; REOP_char ops; goto E
+   L1: split_next_first L2; REOP_char ops; goto E
+   ...
+   Ln: REOP_char ops
+   E:
+
+   It holds a trie of the alternatives so that lre_exec_backtrack()
+   finds the matching ones in one pass: REOP_switch is followed by its
+   length, the offsets of E and of the alternatives which are not in
+   the trie (0 if none) from the chain and the trie. An alternative is
+   not added if a shorter one which is a prefix of it comes before, so
+   that the matches are tried from the longest one. The other engines
+   take it as a goto to the chain. Return -1 if memory error. */
+static int re_add_switches(REParseState *s, DynBuf *onepass, int onepass_count,
+                           DynBuf *glushkov, int glushkov_count)
+{
+    DynBuf out, switches;
+    RETrie trie;
+    const uint8_t *bc_buf;
+    uint8_t *pc;
+    int bc_len, pos, len, n_alt, end, tail, next_pos, i, chain, start, ret;
+    int *pos_map, *jump_map;
+
+    bc_buf = s->byte_code.buf + RE_HEADER_LEN;
+    bc_len = s->byte_code.size - RE_HEADER_LEN;
+    pos_map = lre_realloc(s->opaque, NULL, sizeof(pos_map[0]) * (bc_len + 1) * 2);
+    if (!pos_map)
+        return -1;
+    jump_map = pos_map + bc_len + 1;
+    dbuf_init2(&out, s->opaque, lre_bytecode_realloc);
+    dbuf_init2(&switches, s->opaque, lre_realloc);
+    re_trie_init(&trie, s->opaque);
+    dbuf_put(&out, s->byte_code.buf, RE_HEADER_LEN);
+    ret = -1;
+    next_pos = 0;
+    for(pos = 0; pos < bc_len; pos += len) {
+        pos_map[pos] = jump_map[pos] = out.size - RE_HEADER_LEN;
+        len = re_get_op_len(bc_buf + pos);
+        if (bc_buf[pos] == REOP_split_next_first && pos >= next_pos) {
+            if (re_trie_reset(&trie) < 0)
+                goto done;
+            n_alt = re_parse_switch(&trie, &end, &tail, bc_buf, bc_len, pos);
+            if (n_alt < 0)
+                goto done;
+            if (n_alt >= RE_SWITCH_ALT_MIN) {
+                /* the targets are relocated below */
+                start = out.size;
+                dbuf_putc(&out, REOP_switch);
+                dbuf_put_u32(&out, 0);
+                dbuf_put_u32(&out, end);
+                dbuf_put_u32(&out, tail);
+                if (re_trie_write(&out, &trie, s->opaque))
+                    goto done;
+                /* the other alternatives of the chain are only reached
+                   from the switch. Its suffixes are not tried if the
+                   trie is dropped, which would be quadratic. */
+                next_pos = tail >= 0 ? tail : end;
+                /* the trie must not be larger than the alternatives it
+                   replaces so that the bytecode at most doubles */
+                if (out.size - (start + 13) > next_pos - pos) {
+                    out.size = start;
+                } else {
+                    put_u32(out.buf + start + 1, out.size - (start + 5));
+                    dbuf_put_u32(&switches, start - RE_HEADER_LEN);
+                    pos_map[pos] = out.size - RE_HEADER_LEN;
+                }
+            }
+        }
+        dbuf_put(&out, bc_buf + pos, len);
+    }
+    pos_map[bc_len] = jump_map[bc_len] = out.size - RE_HEADER_LEN;
+    if (dbuf_error(&out) || dbuf_error(&switches))
+        goto done;
+    ret = 0;
+    if (switches.size == 0)
+        goto done;
+    /* the positions in the tables are 16 bit */
+    if (out.size - RE_HEADER_LEN > 0xffff &&
+        (onepass_count >= 0 || glushkov_count >= 0))
+        goto done;
+
+    for(i = 0; i < switches.size; i += 4) {
+        pc = out.buf + RE_HEADER_LEN + get_u32(switches.buf + i);
+        chain = pc - (out.buf + RE_HEADER_LEN) + re_get_op_len(pc);
+        put_u32(pc + 5, jump_map[get_u32(pc + 5)] - chain);
+        tail = get_u32(pc + 9);
+        put_u32(pc + 9, tail >= 0 ? jump_map[tail] - chain : 0);
+    }
+    re_relocate(s, &out, pos_map, jump_map, onepass, onepass_count,
+                glushkov, glushkov_count);
+    /* now owned by s->byte_code */
+    dbuf_init2(&out, s->opaque, lre_bytecode_realloc);
+ done:
+    dbuf_free(&out);
+    dbuf_free(&switches);
+    re_trie_free(&trie);
+    lre_realloc(s->opaque, pos_map, 0);
+    return ret;
+}
+
+/* maximum number of loops whose continuation is analysed */
+#define RE_POSSESSIVE_LOOP_MAX 256
+
+/* return TRUE if 'opcode' consumes one char */
+static BOOL re_is_char_op(int opcode)
+{
+    switch(opcode) {
+    case REOP_char:
+    case REOP_char_i:
+    case REOP_char32:
+    case REOP_char32_i:
+    case REOP_dot:
+    case REOP_any:
+    case REOP_space:
+    case REOP_not_space:
+    case REOP_range:
+    case REOP_range32:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* If a greedy or lazy loop of a single char op starts at 'pos',
+   return its length, the position of the char op in '*patom', the
+   repetition counts in '*pmin' and '*pmax' and whether it is greedy in
+   '*pgreedy'. Otherwise return 0. The loops are:
+   x*: L: split E; x; goto L; E:
+   x?:    split E; x; E:
+   x+: L: x; split L; E:
+*/
+static int re_get_char_loop(int *patom, int *pmin, int *pmax, BOOL *pgreedy,
+                            const uint8_t *bc_buf, int bc_len, int pos)
+{
+    int opcode, atom, next, end;
+
+    opcode = bc_buf[pos];
+    if (opcode == REOP_split_goto_first || opcode == REOP_split_next_first) {
+        end = pos + 5 + (int)get_u32(bc_buf + pos + 1);
+        atom = pos + 5;
+        if (atom >= bc_len || !re_is_char_op(bc_buf[atom]))
+            return 0;
+        next = atom + re_get_op_len(bc_buf + atom);
+        *patom = atom;
+        *pmin = 0;
+        *pgreedy = (opcode == REOP_split_next_first);
+        if (next == end) {
+            *pmax = 1;
+            return end - pos;
+        }
+        if (next + 5 == end && bc_buf[next] == REOP_goto &&
+            end + (int)get_u32(bc_buf + next + 1) == pos) {
+            *pmax = INT32_MAX;
+            return end - pos;
+        }
+    } else if (re_is_char_op(opcode)) {
+        next = pos + re_get_op_len(bc_buf + pos);
+        if (next >= bc_len)
+            return 0;
+        opcode = bc_buf[next];
+        if ((opcode == REOP_split_goto_first ||
+             opcode == REOP_split_next_first) &&
+            next + 5 + (int)get_u32(bc_buf + next + 1) == pos) {
+            *patom = pos;
+            *pmin = 1;
+            *pgreedy = (opcode == REOP_split_goto_first);
+            *pmax = INT32_MAX;
+            return next + 5 - pos;
+        }
+    }
+    return 0;
+}
+
+/* Tell if the loop of the char op at 'atom' never needs to give back a
+   char: the code at 'end' after the loop must consume a char before
+   reaching the match and this char is never accepted by the loop. */
+static BOOL re_loop_is_possessive(const uint8_t *bc_buf, int bc_len,
+                                  int atom, int end,
+                                  uint8_t *visited, int *stack)
+{
+    uint8_t bits[32], pages[32], atom_bits[32], atom_pages[32];
+    int flags, i;
+    uint32_t c;
+
+    memset(bits, 0, sizeof(bits));
+    memset(pages, 0, sizeof(pages));
+    memset(visited, 0, bc_len);
+    flags = 0;
+    if (re_compute_branch_first(bits, pages, &flags, 0, 1, bc_buf, end,
+                                visited, stack) || flags != 0)
+        return FALSE;
+    memset(atom_bits, 0, sizeof(atom_bits));
+    memset(atom_pages, 0, sizeof(atom_pages));
+    for(c = 0; c < 256; c++) {
+        if (re_first_op_accepts(bc_buf + atom, c))
+            re_set_bits(atom_bits, c, c);
+    }
+    re_first_op_pages(atom_pages, bc_buf + atom);
+    for(i = 0; i < 32; i++) {
+        if ((bits[i] & atom_bits[i]) || (pages[i] & atom_pages[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Peephole pass: insert a REOP_possessive_loop before the single char
+   loops which never need to give back a char, such as \d+ in \d+\. or
+   [^,]* in [^,]*, (the greedy and the lazy loops then stop at the same
+   position), and a REOP_greedy_loop or REOP_lazy_loop before the other
+   unbounded ones. The op is followed by its length, the repetition
+   counts and the offsets of the char op and of the end from the loop,
+   so that lre_exec_backtrack() runs the loop without pushing a state
+   per iteration. The other engines take it as a goto to the
+   loop. The code before 'start' (the implicit search loop) is left
+   unchanged. Return -1 if memory error. */
+static int re_add_char_loops(REParseState *s, int start,
+                             DynBuf *onepass, int onepass_count,
+                             DynBuf *glushkov, int glushkov_count)
+{
+    DynBuf out;
+    const uint8_t *bc_buf;
+    uint8_t *visited;
+    int bc_len, pos, len, loop_len, atom, min, max, n_loops, count, ret, op;
+    int *stack, *pos_map, *jump_map;
+    BOOL greedy;
+
+    bc_buf = s->byte_code.buf + RE_HEADER_LEN;
+    bc_len = s->byte_code.size - RE_HEADER_LEN;
+    ret = -1;
+    dbuf_init2(&out, s->opaque, lre_bytecode_realloc);
+    visited = lre_realloc(s->opaque, NULL, bc_len);
+    stack = lre_realloc(s->opaque, NULL, sizeof(stack[0]) * bc_len);
+    pos_map = lre_realloc(s->opaque, NULL, sizeof(pos_map[0]) * (bc_len + 1) * 2);
+    if (!visited || !stack || !pos_map)
+        goto done;
+    jump_map = pos_map + bc_len + 1;
+    dbuf_put(&out, s->byte_code.buf, RE_HEADER_LEN);
+    n_loops = 0;
+    count = 0;
+    for(pos = 0; pos < bc_len; pos += len) {
+        pos_map[pos] = jump_map[pos] = out.size - RE_HEADER_LEN;
+        len = re_get_op_len(bc_buf + pos);
+        if (pos < start)
+            loop_len = 0;
+        else
+            loop_len = re_get_char_loop(&atom, &min, &max, &greedy,
+                                        bc_buf, bc_len, pos);
+        op = -1;
+        if (loop_len > 0) {
+            if (n_loops < RE_POSSESSIVE_LOOP_MAX) {
+                n_loops++;
+                if (re_loop_is_possessive(bc_buf, bc_len, atom,
+                                          pos + loop_len, visited, stack))
+                    op = REOP_possessive_loop;
+            }
+            /* the state of the lazy loop does not hold the count */
+            if (op < 0 && max == INT32_MAX)
+                op = greedy ? REOP_greedy_loop : REOP_lazy_loop;
+        }
+        if (op >= 0) {
+            dbuf_putc(&out, op);
+            dbuf_put_u32(&out, 16);
+            dbuf_put_u32(&out, min);
+            dbuf_put_u32(&out, max);
+            dbuf_put_u32(&out, atom - pos);
+            dbuf_put_u32(&out, loop_len);
+            pos_map[pos] = out.size - RE_HEADER_LEN;
+            count++;
+        }
+        dbuf_put(&out, bc_buf + pos, len);
+    }
+    pos_map[bc_len] = jump_map[bc_len] = out.size - RE_HEADER_LEN;
+    if (dbuf_error(&out))
+        goto done;
+    ret = 0;
+    if (count == 0)
+        goto done;
+    /* the positions in the tables are 16 bit */
+    if (out.size - RE_HEADER_LEN > 0xffff &&
+        (onepass_count >= 0 || glushkov_count >= 0))
+        goto done;
+    re_relocate(s, &out, pos_map, jump_map, onepass, onepass_count,
+                glushkov, glushkov_count);
+    /* now owned by s->byte_code */
+    dbuf_init2(&out, s->opaque, lre_bytecode_realloc);
+ done:
+    dbuf_free(&out);
+    lre_realloc(s->opaque, pos_map, 0);
+    lre_realloc(s->opaque, stack, 0);
+    lre_realloc(s->opaque, visited, 0);
+    return ret;
+}
+
+/* 'buf' must be a zero terminated UTF-8 string of length buf_len.
+   Return NULL if error and allocate an error message in *perror_msg,
+   otherwise the compiled bytecode and its length in plen.
+*/
+uint8_t *lre_compile(int *plen, char *error_msg, int error_msg_size,
+                     const char *buf, size_t buf_len, int re_flags,
+                     void *opaque)
+{
+    REParseState s_s, *s = &s_s;
+    int register_count, prefix_len, i;
+    BOOL is_sticky;
+    int required_len, bc_body_len;
+    uint16_t prefix[RE_PREFIX_LEN_MAX], required[RE_PREFIX_LEN_MAX];
+    const uint8_t *bc_body;
+    uint8_t skip[256];
+    DynBuf onepass, glushkov;
+    int onepass_count, glushkov_count;
+
+    memset(s, 0, sizeof(*s));
+    s->opaque = opaque;
+    s->buf_ptr = (const uint8_t *)buf;
+    s->buf_end = s->buf_ptr + buf_len;
+    s->buf_start = s->buf_ptr;
+    s->re_flags = re_flags;
+    s->is_unicode = ((re_flags & (LRE_FLAG_UNICODE | LRE_FLAG_UNICODE_SETS)) != 0);
+    is_sticky = ((re_flags & LRE_FLAG_STICKY) != 0);
+    s->ignore_case = ((re_flags & LRE_FLAG_IGNORECASE) != 0);
+    s->multi_line = ((re_flags & LRE_FLAG_MULTILINE) != 0);
+    s->dotall = ((re_flags & LRE_FLAG_DOTALL) != 0);
+    s->unicode_sets = ((re_flags & LRE_FLAG_UNICODE_SETS) != 0);
+    s->capture_count = 1;
+    s->total_capture_count = -1;
+    s->has_named_captures = -1;
+
+    dbuf_init2(&s->byte_code, opaque, lre_bytecode_realloc);
+    dbuf_init2(&s->group_names, opaque, lre_realloc);
+
+    dbuf_put_u16(&s->byte_code, re_flags); /* first element is the flags */
+    dbuf_putc(&s->byte_code, 0); /* second element is the number of captures */
+    dbuf_putc(&s->byte_code, 0); /* stack size */
+    dbuf_put_u32(&s->byte_code, 0); /* bytecode length */
+    dbuf_putc(&s->byte_code, RE_SEARCH_LOOP); /* search mode */
+    dbuf_putc(&s->byte_code, 0); /* literal prefix length */
+    dbuf_putc(&s->byte_code, 0); /* required literal length */
+    dbuf_putc(&s->byte_code, RE_DFA_NONE); /* DFA mode */
+    dbuf_putc(&s->byte_code, 0); /* one-pass entry count */
+    dbuf_putc(&s->byte_code, 0); /* Glushkov position count */
+    for(i = 0; i < 64; i++)
+        dbuf_putc(&s->byte_code, 0); /* first chars and pages bit sets */
+    dbuf_putc(&s->byte_code, 0); /* memoized backtracking */
+    dbuf_putc(&s->byte_code, 0); /* back references */
+
+    if (!is_sticky) {
+        /* iterate thru all positions (about the same as .*?( ... ) )
+           .  We do it without an explicit loop so that lock step
+           thread execution will be possible in an optimized
+           implementation */
+        re_emit_op_u32(s, REOP_split_goto_first, 1 + 5);
+        re_emit_op(s, REOP_any);
+        re_emit_op_u32(s, REOP_goto, -(5 + 1 + 5));
+    }
+    re_emit_op_u8(s, REOP_save_start, 0);
+
+    if (re_parse_disjunction(s, FALSE)) {
+    error:
+        dbuf_free(&s->byte_code);
+        dbuf_free(&s->group_names);
+        pstrcpy(error_msg, error_msg_size, s->u.error_msg);
+        *plen = 0;
+        return NULL;
+    }
+
+    re_emit_op_u8(s, REOP_save_end, 0);
+
+    re_emit_op(s, REOP_match);
+
+    if (*s->buf_ptr != '\0') {
+        re_parse_error(s, "extraneous characters at the end");
+        goto error;
+    }
+
+    if (dbuf_error(&s->byte_code)) {
+        re_parse_out_of_memory(s);
+        goto error;
+    }
+
+    register_count = compute_register_count(s->byte_code.buf, s->byte_code.size);
+    if (register_count < 0) {
+        re_parse_error(s, "too many imbricated quantifiers");
+        goto error;
+    }
+
+    s->byte_code.buf[RE_HEADER_CAPTURE_COUNT] = s->capture_count;
+    s->byte_code.buf[RE_HEADER_REGISTER_COUNT] = register_count;
+    put_u32(s->byte_code.buf + RE_HEADER_BYTECODE_LEN,
+            s->byte_code.size - RE_HEADER_LEN);
+
+    /* the literal prefix (stored after the bytecode) or the set of
+       the first chars are used to skip the positions in the implicit
+       search loop. */
+    bc_body = s->byte_code.buf + RE_HEADER_LEN;
+    bc_body_len = s->byte_code.size - RE_HEADER_LEN;
+    if (!is_sticky) {
+        bc_body += RE_SEARCH_LOOP_LEN;
+        bc_body_len -= RE_SEARCH_LOOP_LEN;
+    }
+    /* a literal which must appear in every match is stored after the
+       prefix with its skip table so that the subjects which do not
+       contain it are rejected without running the interpreter. The
+       prefix is not used because it is already searched. */
+    required_len = compute_required(required, bc_body, bc_body_len, !is_sticky);
+    if (!is_sticky) {
+        /* the anchored regexps are tried at the start of the input or
+           of the lines only */
+        if (re_is_anchored(bc_body, bc_body_len, REOP_line_start)) {
+            s->byte_code.buf[RE_HEADER_SEARCH_MODE] = RE_SEARCH_ANCHORED;
+        } else if (re_is_anchored(bc_body, bc_body_len, REOP_line_start_m)) {
+            s->byte_code.buf[RE_HEADER_SEARCH_MODE] = RE_SEARCH_LINE_START;
+        } else if ((prefix_len = compute_prefix(prefix, bc_body,
+                                                bc_body_len)) != 0) {
+            s->byte_code.buf[RE_HEADER_SEARCH_MODE] = RE_SEARCH_PREFIX;
+            s->byte_code.buf[RE_HEADER_PREFIX_LEN] = prefix_len;
+        } else if (compute_first_chars(s->byte_code.buf + RE_HEADER_FIRST_CHARS,
+                                       s->byte_code.buf + RE_HEADER_FIRST_PAGES,
+                                       bc_body, bc_body_len, opaque)) {
+            /* useless if all the chars can start a match */
+            for(i = RE_HEADER_FIRST_CHARS; i < RE_HEADER_FIRST_PAGES + 32; i++) {
+                if (s->byte_code.buf[i] != 0xff) {
+                    s->byte_code.buf[RE_HEADER_SEARCH_MODE] = RE_SEARCH_FIRST_CHARS;
+                    break;
+                }
+            }
+        }
+    }
+
+    s->byte_code.buf[RE_HEADER_DFA_MODE] =
+        compute_dfa_mode(s->byte_code.buf + RE_HEADER_LEN,
+                         get_u32(s->byte_code.buf + RE_HEADER_BYTECODE_LEN));
+
+    /* the linear engine has the same restrictions as the DFA and
+       keeps a bit mask of the registers */
+    if (re_flags & LRE_FLAG_LINEAR) {
+        if (s->byte_code.buf[RE_HEADER_DFA_MODE] == RE_DFA_NONE) {
+            re_parse_error(s, "linear mode does not allow back references or lookarounds");
+            goto error;
+        }
+        if (register_count > 64) {
+            re_parse_error(s, "too many imbricated quantifiers");
+            goto error;
+        }
+    }
+
+    /* the anchored regexps where the next char tells which branch to
+       take at each split are run without backtracking */
+    dbuf_init2(&onepass, opaque, lre_realloc);
+    onepass_count = -1;
+    bc_body = s->byte_code.buf + RE_HEADER_LEN;
+    bc_body_len = get_u32(s->byte_code.buf + RE_HEADER_BYTECODE_LEN);
+    if (s->byte_code.buf[RE_HEADER_DFA_MODE] != RE_DFA_NONE &&
+        (is_sticky || s->byte_code.buf[RE_HEADER_SEARCH_MODE] ==
+         RE_SEARCH_ANCHORED)) {
+        onepass_count = compute_onepass(&onepass, bc_body, bc_body_len,
+                                        is_sticky ? 0 : RE_SEARCH_LOOP_LEN,
+                                        opaque);
+    }
+
+    /* test() and search() run the short patterns on a bit-parallel
+       automaton */
+    dbuf_init2(&glushkov, opaque, lre_realloc);
+    glushkov_count = -1;
+    if (s->byte_code.buf[RE_HEADER_DFA_MODE] == RE_DFA_EXACT) {
+        glushkov_count = compute_glushkov(&glushkov, bc_body, bc_body_len,
+                                          is_sticky ? 0 : RE_SEARCH_LOOP_LEN,
+                                          opaque);
+    }
+
+    if (re_add_char_loops(s, is_sticky ? 0 : RE_SEARCH_LOOP_LEN,
+                          &onepass, onepass_count, &glushkov, glushkov_count) ||
+        re_add_switches(s, &onepass, onepass_count, &glushkov, glushkov_count) ||
+        re_add_strings(s, &onepass, onepass_count, &glushkov, glushkov_count)) {
+        dbuf_free(&onepass);
+        dbuf_free(&glushkov);
+        re_parse_out_of_memory(s);
+        goto error;
+    }
+
+    s->byte_code.buf[RE_HEADER_MEMO] =
+        re_need_memo(s->byte_code.buf + RE_HEADER_LEN,
+                     get_u32(s->byte_code.buf + RE_HEADER_BYTECODE_LEN),
+                     s->byte_code.buf[RE_HEADER_DFA_MODE], register_count);
+    s->byte_code.buf[RE_HEADER_BACK_REFS] =
+        re_has_back_reference(s->byte_code.buf + RE_HEADER_LEN,
+                              get_u32(s->byte_code.buf + RE_HEADER_BYTECODE_LEN));
+
+    for(i = 0; i < s->byte_code.buf[RE_HEADER_PREFIX_LEN]; i++)
+        dbuf_put_u16(&s->byte_code, prefix[i]);
+    if (required_len != 0) {
+        s->byte_code.buf[RE_HEADER_REQUIRED_LEN] = required_len;
+        for(i = 0; i < required_len; i++)
+            dbuf_put_u16(&s->byte_code, required[i]);
+        if (required_len >= 2) {
+            /* Boyer-Moore-Horspool skip table indexed by the low byte
+               of the code units */
+            memset(skip, required_len, sizeof(skip));
+            for(i = 0; i < required_len - 1; i++)
+                skip[required[i] & 0xff] = required_len - 1 - i;
+            dbuf_put(&s->byte_code, skip, sizeof(skip));
+        }
+    }
+
+    if (onepass_count >= 0 && !dbuf_error(&onepass)) {
+        s->byte_code.buf[RE_HEADER_ONEPASS_LEN] = onepass_count + 1;
+        dbuf_put(&s->byte_code, onepass.buf, onepass.size);
+    }
+    dbuf_free(&onepass);
+    if (glushkov_count >= 0 && !dbuf_error(&glushkov)) {
+        s->byte_code.buf[RE_HEADER_GLUSHKOV_LEN] = glushkov_count + 1;
+        dbuf_put(&s->byte_code, glushkov.buf, glushkov.size);
+    }
+    dbuf_free(&glushkov);
+
+    /* add the named groups if needed */
+    if (s->group_names.size > (s->capture_count - 1) * LRE_GROUP_NAME_TRAILER_LEN) {
+        dbuf_put(&s->byte_code, s->group_names.buf, s->group_names.size);
+        put_u16(s->byte_code.buf + RE_HEADER_FLAGS,
+                lre_get_flags(s->byte_code.buf) | LRE_FLAG_NAMED_GROUPS);
+    }
+    dbuf_free(&s->group_names);
+
+#ifdef DUMP_REOP
+    lre_dump_bytecode(s->byte_code.buf, s->byte_code.size);
+#endif
+
+    error_msg[0] = '\0';
+    *plen = s->byte_code.size;
+    return s->byte_code.buf;
+}
+
+/* log2 of the code unit size */
+#define CBUF_SHIFT(cbuf_type) ((cbuf_type) == 1 || (cbuf_type) == 2)
+
+/* return the char of the valid UTF-8 sequence starting with 'c' (>=
+   0x80) whose next bytes are at '*pp' */
+static inline uint32_t lre_utf8_get(uint32_t c, const uint8_t **pp)
+{
+    const uint8_t *p = *pp;
+
+    if (c < 0xe0) {
+        c = ((c & 0x1f) << 6) | (p[0] & 0x3f);
+        p += 1;
+    } else if (c < 0xf0) {
+        c = ((c & 0x0f) << 12) | ((p[0] & 0x3f) << 6) | (p[1] & 0x3f);
+        p += 2;
+    } else {
+        c = ((c & 0x07) << 18) | ((p[0] & 0x3f) << 12) |
+            ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+        p += 3;
+    }
+    *pp = p;
+    return c;
+}
+
+/* return the start of the UTF-8 sequence which ends at 'p' */
+static inline const uint8_t *lre_utf8_prev(const uint8_t *p)
+{
+    do {
+        p--;
+    } while ((*p & 0xc0) == 0x80);
+    return p;
+}
+
+#define GET_CHAR(c, cptr, cbuf_end, cbuf_type)                          \
+    do {                                                                \
+        if (cbuf_type == 0) {                                           \
+            c = *cptr++;                                                \
+        } else if (cbuf_type == 3) {                                    \
+            c = *cptr++;                                                \
+            if (c >= 0x80)                                              \
+                c = lre_utf8_get(c, &cptr);                             \
+        } else {                                                        \
+            const uint16_t *_p = (const uint16_t *)cptr;                \
+            const uint16_t *_end = (const uint16_t *)cbuf_end;          \
+            c = *_p++;                                                  \
+            if (is_hi_surrogate(c) && cbuf_type == 2) {                 \
+                if (_p < _end && is_lo_surrogate(*_p)) {                \
+                    c = from_surrogate(c, *_p++);                       \
+                }                                                       \
+            }                                                           \
+            cptr = (const void *)_p;                                    \
+        }                                                               \
+    } while (0)
+
+#define PEEK_CHAR(c, cptr, cbuf_end, cbuf_type)                         \
+    do {                                                                \
+        if (cbuf_type == 0) {                                           \
+            c = cptr[0];                                                \
+        } else if (cbuf_type == 3) {                                    \
+            const uint8_t *_p = cptr + 1;                               \
+            c = cptr[0];                                                \
+            if (c >= 0x80)                                              \
+                c = lre_utf8_get(c, &_p);                               \
+        } else {                                                        \
+            const uint16_t *_p = (const uint16_t *)cptr;                \
+            const uint16_t *_end = (const uint16_t *)cbuf_end;          \
+            c = *_p++;                                                  \
+            if (is_hi_surrogate(c) && cbuf_type == 2) {                 \
+                if (_p < _end && is_lo_surrogate(*_p)) {                \
+                    c = from_surrogate(c, *_p);                         \
+                }                                                       \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
+#define PEEK_PREV_CHAR(c, cptr, cbuf_start, cbuf_type)                  \
+    do {                                                                \
+        if (cbuf_type == 0) {                                           \
+            c = cptr[-1];                                               \
+        } else if (cbuf_type == 3) {                                    \
+            const uint8_t *_p = lre_utf8_prev(cptr);                    \
+            c = *_p++;                                                  \
+            if (c >= 0x80)                                              \
+                c = lre_utf8_get(c, &_p);                               \
+        } else {                                                        \
+            const uint16_t *_p = (const uint16_t *)cptr - 1;            \
+            const uint16_t *_start = (const uint16_t *)cbuf_start;      \
+            c = *_p;                                                    \
+            if (is_lo_surrogate(c) && cbuf_type == 2) {                 \
+                if (_p > _start && is_hi_surrogate(_p[-1])) {           \
+                    c = from_surrogate(*--_p, c);                       \
+                }                                                       \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
+#define GET_PREV_CHAR(c, cptr, cbuf_start, cbuf_type)                   \
+    do {                                                                \
+        if (cbuf_type == 0) {                                           \
+            cptr--;                                                     \
+            c = cptr[0];                                                \
+        } else if (cbuf_type == 3) {                                    \
+            const uint8_t *_p;                                          \
+            cptr = lre_utf8_prev(cptr);                                 \
+            _p = cptr + 1;                                              \
+            c = cptr[0];                                                \
+            if (c >= 0x80)                                              \
+                c = lre_utf8_get(c, &_p);                               \
+        } else {                                                        \
+            const uint16_t *_p = (const uint16_t *)cptr - 1;            \
+            const uint16_t *_start = (const uint16_t *)cbuf_start;      \
+            c = *_p;                                                    \
+            if (is_lo_surrogate(c) && cbuf_type == 2) {                 \
+                if (_p > _start && is_hi_surrogate(_p[-1])) {           \
+                    c = from_surrogate(*--_p, c);                       \
+                }                                                       \
+            }                                                           \
+            cptr = (const void *)_p;                                    \
+        }                                                               \
+    } while (0)
+
+#define PREV_CHAR(cptr, cbuf_start, cbuf_type)                          \
+    do {                                                                \
+        if (cbuf_type == 0) {                                           \
+            cptr--;                                                     \
+        } else if (cbuf_type == 3) {                                    \
+            cptr = lre_utf8_prev(cptr);                                 \
+        } else {                                                        \
+            const uint16_t *_p = (const uint16_t *)cptr - 1;            \
+            const uint16_t *_start = (const uint16_t *)cbuf_start;      \
+            if (is_lo_surrogate(*_p) && cbuf_type == 2) {               \
+                if (_p > _start && is_hi_surrogate(_p[-1])) {           \
+                    --_p;                                               \
+                }                                                       \
+            }                                                           \
+            cptr = (const void *)_p;                                    \
+        }                                                               \
+    } while (0)
+
+typedef enum {
+    RE_EXEC_STATE_SPLIT,
+    RE_EXEC_STATE_LOOKAHEAD,
+    RE_EXEC_STATE_NEGATIVE_LOOKAHEAD,
+    RE_EXEC_STATE_LOOP, /* preceded by one more element */
+} REExecStateEnum;
+
+#if INTPTR_MAX >= INT64_MAX
+#define BP_TYPE_BITS 3
+#else
+#define BP_TYPE_BITS 2
+#endif
+
+typedef union {
+    uint8_t *ptr;
+    intptr_t val; /* for bp, the low BP_SHIFT bits store REExecStateEnum */
+    struct {
+        uintptr_t val : sizeof(uintptr_t) * 8 - BP_TYPE_BITS;
+        uintptr_t type : BP_TYPE_BITS;
+    } bp;
+} StackElem;
+
+typedef struct {
+    const uint8_t *cbuf;
+    const uint8_t *cbuf_end;
+    /* 0 = 8 bit chars, 1 = 16 bit chars, 2 = 16 bit chars, UTF-16,
+       3 = UTF-8 */
+    int cbuf_type;
+    int capture_count;
+    BOOL is_unicode;
+    int interrupt_counter;
+    void *opaque; /* used for stack overflow check */
+    /* if FALSE, only the capture 0 is saved by the backtracking */
+    BOOL save_captures;
+
+    const LREJit *jit; /* native code or NULL */
+    /* position of the next '\n' found by lre_find_line_start() or
+       cbuf_end if none, NULL if not searched yet */
+    const uint8_t *next_lf;
+
+    /* memoized backtracking: bit set of the (op, position) pairs
+       already tried from 'memo_cbuf', the ops are numbered by
+       'memo_index'. It is only allocated after 'memo_steps' memoized
+       ops were run so that the calls which match quickly do not pay
+       for it. 'memo_steps' is 0 if the backtracking is not memoized. */
+    uint8_t *memo;
+    int *memo_index;
+    const uint8_t *memo_bc_buf;
+    int memo_bc_len;
+    const uint8_t *memo_cbuf;
+    size_t memo_npos;
+    size_t memo_steps;
+
+    StackElem *stack_buf;
+    size_t stack_size;
+    LREStack *stack; /* where the allocated stack is kept, or NULL */
+    StackElem static_stack_buf[32]; /* static stack to avoid allocation in most cases */
+} REExecContext;
+
+struct LREStack {
+    StackElem *buf; /* NULL if not allocated yet */
+    size_t size;
+    size_t size_max; /* maximum size in bytes of the kept stack and DFA */
+    struct DFAContext *dfa; /* states of the lazy DFA of lre_exec_test() */
+};
+
+static int lre_poll_timeout(REExecContext *s)
+{
+    if (unlikely(--s->interrupt_counter <= 0)) {
+        s->interrupt_counter = INTERRUPT_COUNTER_INIT;
+        if (lre_check_timeout(s->opaque))
+            return LRE_RET_TIMEOUT;
+    }
+    return 0;
+}
+
+/* maximum size of the memo bit set */
+#define RE_MEMO_BITS_MAX (1 << 25)
+/* number of memoized ops run before the memo is allocated, in
+   addition to one per position it covers so that clearing it does
+   not take longer than the steps already done */
+#define RE_MEMO_STEPS_MIN 1000
+
+/* Enable the memo for the positions from 'cptr'. It is allocated by
+   lre_memo_test_and_set() once the steps are used up. */
+static void lre_memo_init(REExecContext *s, const uint8_t *bc_buf,
+                          const uint8_t *cptr)
+{
+    s->memo_bc_buf = bc_buf + RE_HEADER_LEN;
+    s->memo_bc_len = get_u32(bc_buf + RE_HEADER_BYTECODE_LEN);
+    s->memo_cbuf = cptr;
+    s->memo_npos = ((s->cbuf_end - cptr) >> CBUF_SHIFT(s->cbuf_type)) + 1;
+    s->memo_steps = RE_MEMO_STEPS_MIN + s->memo_npos;
+}
+
+/* Number the splits and the char loops of the bytecode and allocate
+   the memo bit set. The memo is not used if the input is too long.
+   Return -1 if memory error. */
+static int lre_memo_alloc(REExecContext *s)
+{
+    const uint8_t *bc;
+    int pos, len, n;
+    size_t nbits;
+
+    bc = s->memo_bc_buf;
+    s->memo_index = lre_realloc(s->opaque, NULL,
+                                sizeof(s->memo_index[0]) * s->memo_bc_len);
+    if (!s->memo_index)
+        return -1;
+    n = 0;
+    for(pos = 0; pos < s->memo_bc_len; pos += len) {
+        len = re_get_op_len(bc + pos);
+        switch(bc[pos]) {
+        case REOP_split_goto_first:
+        case REOP_split_next_first:
+        case REOP_possessive_loop:
+        case REOP_greedy_loop:
+        case REOP_lazy_loop:
+            s->memo_index[pos] = n++;
+            break;
+        default:
+            break;
+        }
+    }
+    if (s->memo_npos > RE_MEMO_BITS_MAX / (n + 1)) {
+        s->memo_steps = 0;
+        return 0;
+    }
+    nbits = n * s->memo_npos;
+    s->memo = lre_realloc(s->opaque, NULL, (nbits + 7) / 8);
+    if (!s->memo)
+        return -1;
+    memset(s->memo, 0, (nbits + 7) / 8);
+    /* the memo is tested from now on */
+    s->memo_steps = 1;
+    return 0;
+}
+
+static void lre_memo_free(REExecContext *s)
+{
+    if (s->memo)
+        lre_realloc(s->opaque, s->memo, 0);
+    if (s->memo_index)
+        lre_realloc(s->opaque, s->memo_index, 0);
+}
+
+/* Return 1 if the op at 'pc' was already run at 'cptr', otherwise
+   record it and return 0. Return -1 if memory error. */
+static inline int lre_memo_test_and_set(REExecContext *s, const uint8_t *pc,
+                                        const uint8_t *cptr)
+{
+    size_t idx;
+    int mask;
+
+    if (!s->memo) {
+        if (--s->memo_steps != 0)
+            return 0;
+        if (lre_memo_alloc(s))
+            return -1;
+        if (!s->memo)
+            return 0;
+    }
+    idx = s->memo_index[pc - s->memo_bc_buf] * s->memo_npos +
+        ((cptr - s->memo_cbuf) >> CBUF_SHIFT(s->cbuf_type));
+    mask = 1 << (idx & 7);
+    if (s->memo[idx >> 3] & mask)
+        return 1;
+    s->memo[idx >> 3] |= mask;
+    return 0;
+}
+
+static no_inline int stack_realloc(REExecContext *s, size_t n)
+{
+    StackElem *new_stack;
+    size_t new_size;
+    new_size = s->stack_size * 3 / 2;
+    if (new_size < n)
+        new_size = n;
+    /* the user can limit the size of the backtracking stack */
+    if (lre_check_stack_overflow(s->opaque, new_size * sizeof(StackElem)))
+        return -1;
+    if (s->stack_buf == s->static_stack_buf) {
+        new_stack = lre_realloc(s->opaque, NULL, new_size * sizeof(StackElem));
+        if (!new_stack)
+            return -1;
+        /* XXX: could use correct size */
+        memcpy(new_stack, s->stack_buf, s->stack_size * sizeof(StackElem));
+    } else {
+        new_stack = lre_realloc(s->opaque, s->stack_buf, new_size * sizeof(StackElem));
+        if (!new_stack)
+            return -1;
+    }
+    s->stack_size = new_size;
+    s->stack_buf = new_stack;
+    return 0;
+}
+
+#ifdef CONFIG_JIT
+
+/* x86-64 JIT. The bytecode is translated to native code which uses the
+   same backtracking stack as lre_exec_backtrack(): a split pushes the
+   resume address, the char position and the offset of the previous
+   frame, and the capture modifications push (index, old value). Only
+   8 bit strings are supported. The registers are:
+
+   rbx: cptr, rbp: cbuf_end, r12: capture, r13: sp, r14: bp,
+   r15: JitContext */
+
+struct LREJit {
+    const uint8_t *bc_buf;
+    uint8_t *code;
+    size_t code_size; /* size of the mapping */
+    int entry[2]; /* code offset of the positions 0 and RE_SEARCH_LOOP_LEN */
+};
+
+typedef struct {
+    const uint8_t *cbuf;
+    const uint8_t *cbuf_end;
+    StackElem *stack_buf;
+    StackElem *stack_end;
+    StackElem *sp; /* only valid in jit_stack_grow() */
+    StackElem *bp;
+    REExecContext *s;
+    int interrupt_counter;
+} JitContext;
+
+typedef int JitFunc(JitContext *ctx, uint8_t **capture, const uint8_t *cptr,
+                    const uint8_t *entry);
+
+enum {
+    JIT_RAX, JIT_RCX, JIT_RDX, JIT_RBX, JIT_RSP, JIT_RBP, JIT_RSI, JIT_RDI,
+    JIT_R8, JIT_R9, JIT_R10, JIT_R11, JIT_R12, JIT_R13, JIT_R14, JIT_R15,
+};
+
+#define JIT_CPTR    JIT_RBX
+#define JIT_END     JIT_RBP
+#define JIT_CAPTURE JIT_R12
+#define JIT_SP      JIT_R13
+#define JIT_BP      JIT_R14
+#define JIT_CTX     JIT_R15
+
+/* condition codes */
+#define JIT_CC_B  0x2
+#define JIT_CC_AE 0x3
+#define JIT_CC_E  0x4
+#define JIT_CC_NE 0x5
+#define JIT_CC_BE 0x6
+#define JIT_CC_G  0xf
+#define JIT_JMP   (-1)
+
+#define JIT_CTX_OFF(field) ((int)offsetof(JitContext, field))
+
+typedef enum {
+    JIT_FIXUP_LABEL, /* rel32 to the code of a bytecode position */
+    JIT_FIXUP_TABLE, /* rel32 to a 256 byte table */
+} JitFixupEnum;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t target;
+    JitFixupEnum type;
+} JitFixup;
+
+typedef struct {
+    DynBuf code;
+    DynBuf tables; /* 256 byte tables of the char tests */
+    DynBuf fixups;
+    int *labels; /* code offset of each bytecode position or -1 */
+    int epilogue, poll_stub, grow_stub, no_match;
+} JitState;
+
+static void jit_byte(JitState *j, int v)
+{
+    dbuf_putc(&j->code, v);
+}
+
+static void jit_u32(JitState *j, uint32_t v)
+{
+    dbuf_put_u32(&j->code, v);
+}
+
+/* emit 'op' (one or two bytes) with the register 'reg' and the memory
+   operand [base + index * (1 << scale) + disp]. 'index' = -1 if none. */
+static void jit_mem(JitState *j, int w, int op, int reg, int base,
+                    int index, int scale, int32_t disp)
+{
+    int rex;
+    rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if (index >= 0)
+        rex |= (index >> 3) << 1;
+    if (rex != 0x40)
+        jit_byte(j, rex);
+    if (op > 0xff)
+        jit_byte(j, op >> 8);
+    jit_byte(j, op & 0xff);
+    if (index < 0 && (base & 7) != JIT_RSP) {
+        jit_byte(j, 0x80 | ((reg & 7) << 3) | (base & 7));
+    } else {
+        jit_byte(j, 0x84 | ((reg & 7) << 3));
+        if (index < 0)
+            jit_byte(j, 0x20 | (base & 7));
+        else
+            jit_byte(j, (scale << 6) | ((index & 7) << 3) | (base & 7));
+    }
+    jit_u32(j, disp);
+}
+
+/* emit 'op' with the registers 'reg' and 'rm' */
+static void jit_rr(JitState *j, int w, int op, int reg, int rm)
+{
+    int rex;
+    rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40)
+        jit_byte(j, rex);
+    if (op > 0xff)
+        jit_byte(j, op >> 8);
+    jit_byte(j, op & 0xff);
+    jit_byte(j, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op rm, imm32 where 'ext' is the opcode extension of 0x81 */
+static void jit_ri(JitState *j, int w, int ext, int rm, uint32_t imm)
+{
+    jit_rr(j, w, 0x81, ext, rm);
+    jit_u32(j, imm);
+}
+
+static void jit_push(JitState *j, int reg)
+{
+    if (reg >= 8)
+        jit_byte(j, 0x41);
+    jit_byte(j, 0x50 + (reg & 7));
+}
+
+static void jit_pop(JitState *j, int reg)
+{
+    if (reg >= 8)
+        jit_byte(j, 0x41);
+    jit_byte(j, 0x58 + (reg & 7));
+}
+
+static void jit_mov_imm64(JitState *j, int reg, uint64_t v)
+{
+    jit_byte(j, 0x48 | (reg >> 3));
+    jit_byte(j, 0xb8 + (reg & 7));
+    dbuf_put_u64(&j->code, v);
+}
+
+/* jump to the code offset 'target' which is already emitted */
+static void jit_jump(JitState *j, int cc, int target)
+{
+    if (cc == JIT_JMP) {
+        jit_byte(j, 0xe9);
+    } else {
+        jit_byte(j, 0x0f);
+        jit_byte(j, 0x80 + cc);
+    }
+    jit_u32(j, target - (int)(j->code.size + 4));
+}
+
+static void jit_call(JitState *j, int target)
+{
+    jit_byte(j, 0xe8);
+    jit_u32(j, target - (int)(j->code.size + 4));
+}
+
+/* emit a forward jump and return the position to patch with
+   jit_patch() */
+static int jit_jump_fwd(JitState *j, int cc)
+{
+    jit_jump(j, cc, j->code.size + (cc == JIT_JMP ? 5 : 6));
+    return j->code.size - 4;
+}
+
+static void jit_patch(JitState *j, int pos)
+{
+    if (!j->code.error)
+        put_u32(j->code.buf + pos, j->code.size - (pos + 4));
+}
+
+static void jit_add_fixup(JitState *j, JitFixupEnum type, uint32_t target)
+{
+    JitFixup f;
+    f.offset = j->code.size - 4;
+    f.target = target;
+    f.type = type;
+    dbuf_put(&j->fixups, (uint8_t *)&f, sizeof(f));
+}
+
+/* jump to the code of the bytecode position 'pos' */
+static void jit_jump_label(JitState *j, int cc, int pos)
+{
+    jit_jump(j, cc, j->code.size + (cc == JIT_JMP ? 5 : 6));
+    jit_add_fixup(j, JIT_FIXUP_LABEL, pos);
+}
+
+/* lea reg, [rip + label] */
+static void jit_lea_label(JitState *j, int reg, int pos)
+{
+    jit_byte(j, 0x48 | ((reg >> 3) << 2));
+    jit_byte(j, 0x8d);
+    jit_byte(j, ((reg & 7) << 3) | 5);
+    jit_u32(j, 0);
+    jit_add_fixup(j, JIT_FIXUP_LABEL, pos);
+}
+
+/* lea reg, [rip + table] */
+static void jit_lea_table(JitState *j, int reg, const uint8_t *tab)
+{
+    size_t pos;
+    for(pos = 0; pos < j->tables.size; pos += 256) {
+        if (!memcmp(j->tables.buf + pos, tab, 256))
+            break;
+    }
+    if (pos == j->tables.size)
+        dbuf_put(&j->tables, tab, 256);
+    jit_byte(j, 0x48 | ((reg >> 3) << 2));
+    jit_byte(j, 0x8d);
+    jit_byte(j, ((reg & 7) << 3) | 5);
+    jit_u32(j, 0);
+    jit_add_fixup(j, JIT_FIXUP_TABLE, pos);
+}
+
+/* call the helper at 'func' with the JitContext as argument */
+static void jit_call_helper(JitState *j, void *func)
+{
+    jit_rr(j, 1, 0x8b, JIT_RDI, JIT_CTX); /* mov rdi, r15 */
+    jit_mov_imm64(j, JIT_RAX, (uintptr_t)func);
+    jit_rr(j, 0, 0xff, 2, JIT_RAX); /* call rax */
+}
+
+static void jit_poll_timeout(JitState *j)
+{
+    int skip;
+    /* dec dword [r15 + interrupt_counter] */
+    jit_mem(j, 0, 0xff, 1, JIT_CTX, -1, 0, JIT_CTX_OFF(interrupt_counter));
+    skip = jit_jump_fwd(j, JIT_CC_G);
+    jit_call(j, j->poll_stub);
+    jit_patch(j, skip);
+}
+
+/* ensure that 'n' stack elements are available */
+static void jit_check_stack_space(JitState *j, int n)
+{
+    int skip;
+    jit_mem(j, 1, 0x8b, JIT_RAX, JIT_CTX, -1, 0, JIT_CTX_OFF(stack_end));
+    jit_rr(j, 1, 0x29, JIT_SP, JIT_RAX); /* sub rax, r13 */
+    jit_ri(j, 1, 7, JIT_RAX, n * sizeof(StackElem));
+    skip = jit_jump_fwd(j, JIT_CC_AE);
+    jit_byte(j, 0xb8 + JIT_RCX); /* mov ecx, n */
+    jit_u32(j, n);
+    jit_call(j, j->grow_stub);
+    jit_patch(j, skip);
+}
+
+/* push (idx, capture[idx]) without checking the stack space */
+static void jit_push_undo(JitState *j, int idx)
+{
+    int disp = idx * sizeof(StackElem);
+    jit_mem(j, 1, 0xc7, 0, JIT_SP, -1, 0, 0); /* mov qword [r13], idx */
+    jit_u32(j, idx);
+    jit_mem(j, 1, 0x8b, JIT_RAX, JIT_CAPTURE, -1, 0, disp);
+    jit_mem(j, 1, 0x89, JIT_RAX, JIT_SP, -1, 0, 8);
+    jit_ri(j, 1, 0, JIT_SP, 2 * sizeof(StackElem));
+}
+
+/* emit the undo record of capture[idx] unless it was already saved
+   since the last split (same as SAVE_CAPTURE_CHECK) */
+static void jit_push_undo_check(JitState *j, int idx)
+{
+    int loop, done, saved;
+    jit_rr(j, 1, 0x8b, JIT_RAX, JIT_SP); /* mov rax, r13 */
+    loop = j->code.size;
+    jit_rr(j, 1, 0x39, JIT_BP, JIT_RAX); /* cmp rax, r14 */
+    done = jit_jump_fwd(j, JIT_CC_BE);
+    jit_mem(j, 1, 0x81, 7, JIT_RAX, -1, 0, -2 * (int)sizeof(StackElem));
+    jit_u32(j, idx);
+    saved = jit_jump_fwd(j, JIT_CC_E);
+    jit_ri(j, 1, 5, JIT_RAX, 2 * sizeof(StackElem));
+    jit_jump(j, JIT_JMP, loop);
+    jit_patch(j, done);
+    jit_check_stack_space(j, 2);
+    jit_push_undo(j, idx);
+    jit_patch(j, saved);
+}
+
+/* push a backtracking state resuming at the bytecode position 'pos' */
+static void jit_push_state(JitState *j, int pos)
+{
+    jit_check_stack_space(j, 3);
+    jit_lea_label(j, JIT_RAX, pos);
+    jit_mem(j, 1, 0x89, JIT_RAX, JIT_SP, -1, 0, 0);
+    jit_mem(j, 1, 0x89, JIT_CPTR, JIT_SP, -1, 0, 8);
+    jit_rr(j, 1, 0x8b, JIT_RAX, JIT_BP); /* mov rax, r14 */
+    jit_mem(j, 1, 0x2b, JIT_RAX, JIT_CTX, -1, 0, JIT_CTX_OFF(stack_buf));
+    jit_mem(j, 1, 0x89, JIT_RAX, JIT_SP, -1, 0, 16);
+    jit_ri(j, 1, 0, JIT_SP, 3 * sizeof(StackElem));
+    jit_rr(j, 1, 0x8b, JIT_BP, JIT_SP); /* mov r14, r13 */
+}
+
+/* load the char at [rbx + disp] in eax */
+static void jit_load_char(JitState *j, int disp)
+{
+    jit_mem(j, 0, 0x0fb6, JIT_RAX, JIT_CPTR, -1, 0, disp);
+}
+
+/* jump to the code for no match if eax is not a line terminator */
+static void jit_test_line_terminator(JitState *j)
+{
+    int ok;
+    jit_ri(j, 0, 7, JIT_RAX, '\n');
+    ok = jit_jump_fwd(j, JIT_CC_E);
+    jit_ri(j, 0, 7, JIT_RAX, '\r');
+    jit_jump(j, JIT_CC_NE, j->no_match);
+    jit_patch(j, ok);
+}
+
+static int jit_stack_grow(JitContext *ctx, int n)
+{
+    REExecContext *s = ctx->s;
+    size_t sp, bp;
+
+    sp = ctx->sp - ctx->stack_buf;
+    bp = ctx->bp - ctx->stack_buf;
+    if (stack_realloc(s, sp + n))
+        return -1;
+    ctx->stack_buf = s->stack_buf;
+    ctx->stack_end = s->stack_buf + s->stack_size;
+    ctx->sp = s->stack_buf + sp;
+    ctx->bp = s->stack_buf + bp;
+    return 0;
+}
+
+static int jit_check_timeout(JitContext *ctx)
+{
+    ctx->interrupt_counter = INTERRUPT_COUNTER_INIT;
+    return lre_check_timeout(ctx->s->opaque);
+}
+
+/* entry point, epilogue, helper stubs and the backtracking code */
+static void jit_emit_runtime(JitState *j)
+{
+    int pos, pos1;
+
+    /* entry(ctx, capture, cptr, entry) */
+    jit_push(j, JIT_RBX);
+    jit_push(j, JIT_RBP);
+    jit_push(j, JIT_R12);
+    jit_push(j, JIT_R13);
+    jit_push(j, JIT_R14);
+    jit_push(j, JIT_R15);
+    jit_ri(j, 1, 5, JIT_RSP, 8); /* align the stack */
+    jit_rr(j, 1, 0x8b, JIT_CTX, JIT_RDI);
+    jit_rr(j, 1, 0x8b, JIT_CAPTURE, JIT_RSI);
+    jit_rr(j, 1, 0x8b, JIT_CPTR, JIT_RDX);
+    jit_mem(j, 1, 0x8b, JIT_END, JIT_CTX, -1, 0, JIT_CTX_OFF(cbuf_end));
+    jit_mem(j, 1, 0x8b, JIT_SP, JIT_CTX, -1, 0, JIT_CTX_OFF(stack_buf));
+    jit_rr(j, 1, 0x8b, JIT_BP, JIT_SP);
+    jit_rr(j, 0, 0xff, 4, JIT_RCX); /* jmp rcx */
+
+    /* epilogue, the result is in eax */
+    j->epilogue = j->code.size;
+    jit_ri(j, 1, 0, JIT_RSP, 8);
+    jit_pop(j, JIT_R15);
+    jit_pop(j, JIT_R14);
+    jit_pop(j, JIT_R13);
+    jit_pop(j, JIT_R12);
+    jit_pop(j, JIT_RBP);
+    jit_pop(j, JIT_RBX);
+    jit_byte(j, 0xc3);
+
+    /* called when the interrupt counter reaches 0 */
+    j->poll_stub = j->code.size;
+    jit_ri(j, 1, 5, JIT_RSP, 8);
+    jit_call_helper(j, jit_check_timeout);
+    jit_ri(j, 1, 0, JIT_RSP, 8);
+    jit_rr(j, 0, 0x85, JIT_RAX, JIT_RAX);
+    pos = jit_jump_fwd(j, JIT_CC_NE);
+    jit_byte(j, 0xc3);
+    jit_patch(j, pos);
+    jit_ri(j, 1, 0, JIT_RSP, 8); /* return address */
+    jit_byte(j, 0xb8); /* mov eax, LRE_RET_TIMEOUT */
+    jit_u32(j, LRE_RET_TIMEOUT);
+    jit_jump(j, JIT_JMP, j->epilogue);
+
+    /* called with the number of needed stack elements in ecx */
+    j->grow_stub = j->code.size;
+    jit_ri(j, 1, 5, JIT_RSP, 8);
+    jit_mem(j, 1, 0x89, JIT_SP, JIT_CTX, -1, 0, JIT_CTX_OFF(sp));
+    jit_mem(j, 1, 0x89, JIT_BP, JIT_CTX, -1, 0, JIT_CTX_OFF(bp));
+    jit_rr(j, 0, 0x8b, JIT_RSI, JIT_RCX);
+    jit_call_helper(j, jit_stack_grow);
+    jit_ri(j, 1, 0, JIT_RSP, 8);
+    jit_rr(j, 0, 0x85, JIT_RAX, JIT_RAX);
+    pos = jit_jump_fwd(j, JIT_CC_NE);
+    jit_mem(j, 1, 0x8b, JIT_SP, JIT_CTX, -1, 0, JIT_CTX_OFF(sp));
+    jit_mem(j, 1, 0x8b, JIT_BP, JIT_CTX, -1, 0, JIT_CTX_OFF(bp));
+    jit_byte(j, 0xc3);
+    jit_patch(j, pos);
+    jit_ri(j, 1, 0, JIT_RSP, 8); /* return address */
+    jit_byte(j, 0xb8); /* mov eax, LRE_RET_MEMORY_ERROR */
+    jit_u32(j, LRE_RET_MEMORY_ERROR);
+    jit_jump(j, JIT_JMP, j->epilogue);
+
+    /* backtrack to the last saved state */
+    j->no_match = j->code.size;
+    jit_mem(j, 1, 0x3b, JIT_BP, JIT_CTX, -1, 0, JIT_CTX_OFF(stack_buf));
+    pos = jit_jump_fwd(j, JIT_CC_NE);
+    jit_rr(j, 0, 0x31, JIT_RAX, JIT_RAX); /* xor eax, eax */
+    jit_jump(j, JIT_JMP, j->epilogue);
+    jit_patch(j, pos);
+    /* undo the modifications to capture[] */
+    pos1 = j->code.size;
+    jit_rr(j, 1, 0x39, JIT_BP, JIT_SP); /* cmp r13, r14 */
+    pos = jit_jump_fwd(j, JIT_CC_BE);
+    jit_mem(j, 1, 0x8b, JIT_RAX, JIT_SP, -1, 0, -16);
+    jit_mem(j, 1, 0x8b, JIT_RCX, JIT_SP, -1, 0, -8);
+    jit_mem(j, 1, 0x89, JIT_RCX, JIT_CAPTURE, JIT_RAX, 3, 0);
+    jit_ri(j, 1, 5, JIT_SP, 2 * sizeof(StackElem));
+    jit_jump(j, JIT_JMP, pos1);
+    jit_patch(j, pos);
+    jit_poll_timeout(j);
+    jit_mem(j, 1, 0x8b, JIT_CPTR, JIT_SP, -1, 0, -16);
+    jit_mem(j, 1, 0x8b, JIT_RAX, JIT_SP, -1, 0, -24);
+    jit_mem(j, 1, 0x8b, JIT_BP, JIT_SP, -1, 0, -8);
+    jit_mem(j, 1, 0x03, JIT_BP, JIT_CTX, -1, 0, JIT_CTX_OFF(stack_buf));
+    jit_ri(j, 1, 5, JIT_SP, 3 * sizeof(StackElem));
+    jit_rr(j, 0, 0xff, 4, JIT_RAX); /* jmp rax */
+}
+
+/* return FALSE if the bytecode uses an opcode which is not
+   supported */
+static BOOL jit_emit_bytecode(JitState *j, const uint8_t *bc_buf, int bc_len,
+                              int capture_count)
+{
+    int pos, len, opcode, idx, n, c, target, last_c, pos1;
+    uint32_t val, limit;
+    uint8_t tab[256];
+    const uint8_t *pc;
+
+    for(pos = 0; pos < bc_len; pos += len) {
+        pc = bc_buf + pos;
+        opcode = pc[0];
+        len = re_get_op_len(pc);
+        j->labels[pos] = j->code.size;
+        switch(opcode) {
+        case REOP_char:
+        case REOP_char_i:
+        case REOP_char32:
+        case REOP_char32_i:
+        case REOP_dot:
+        case REOP_any:
+        case REOP_space:
+        case REOP_not_space:
+        case REOP_range:
+        case REOP_range32:
+            n = 0;
+            last_c = 0;
+            for(c = 0; c < 256; c++) {
+                tab[c] = re_first_op_accepts(pc, c);
+                if (tab[c]) {
+                    n++;
+                    last_c = c;
+                }
+            }
+            if (n == 0) {
+                jit_jump(j, JIT_JMP, j->no_match);
+                break;
+            }
+            jit_rr(j, 1, 0x39, JIT_END, JIT_CPTR); /* cmp rbx, rbp */
+            jit_jump(j, JIT_CC_AE, j->no_match);
+            if (n == 1) {
+                jit_load_char(j, 0);
+                jit_ri(j, 0, 7, JIT_RAX, last_c);
+                jit_jump(j, JIT_CC_NE, j->no_match);
+            } else if (n < 256) {
+                jit_load_char(j, 0);
+                jit_lea_table(j, JIT_RDX, tab);
+                /* cmp byte [rdx + rax], 0 */
+                jit_mem(j, 0, 0x80, 7, JIT_RDX, JIT_RAX, 0, 0);
+                jit_byte(j, 0);
+                jit_jump(j, JIT_CC_E, j->no_match);
+            }
+            jit_rr(j, 1, 0xff, 0, JIT_CPTR); /* inc rbx */
+            break;
+        case REOP_line_start:
+        case REOP_line_start_m:
+            jit_mem(j, 1, 0x3b, JIT_CPTR, JIT_CTX, -1, 0, JIT_CTX_OFF(cbuf));
+            pos1 = jit_jump_fwd(j, JIT_CC_E);
+            if (opcode == REOP_line_start) {
+                jit_jump(j, JIT_JMP, j->no_match);
+            } else {
+                jit_load_char(j, -1);
+                jit_test_line_terminator(j);
+            }
+            jit_patch(j, pos1);
+            break;
+        case REOP_line_end:
+        case REOP_line_end_m:
+            jit_rr(j, 1, 0x39, JIT_END, JIT_CPTR);
+            pos1 = jit_jump_fwd(j, JIT_CC_E);
+            if (opcode == REOP_line_end) {
+                jit_jump(j, JIT_JMP, j->no_match);
+            } else {
+                jit_load_char(j, 0);
+                jit_test_line_terminator(j);
+            }
+            jit_patch(j, pos1);
+            break;
+        case REOP_word_boundary:
+        case REOP_word_boundary_i:
+        case REOP_not_word_boundary:
+        case REOP_not_word_boundary_i:
+            for(c = 0; c < 256; c++)
+                tab[c] = (lre_is_word_byte(c) != 0);
+            /* ecx = char before is a word char */
+            jit_rr(j, 0, 0x31, JIT_RCX, JIT_RCX);
+            jit_mem(j, 1, 0x3b, JIT_CPTR, JIT_CTX, -1, 0, JIT_CTX_OFF(cbuf));
+            pos1 = jit_jump_fwd(j, JIT_CC_E);
+            jit_load_char(j, -1);
+            jit_lea_table(j, JIT_RDX, tab);
+            jit_mem(j, 0, 0x0fb6, JIT_RCX, JIT_RDX, JIT_RAX, 0, 0);
+            jit_patch(j, pos1);
+            /* esi = current char is a word char */
+            jit_rr(j, 0, 0x31, JIT_RSI, JIT_RSI);
+            jit_rr(j, 1, 0x39, JIT_END, JIT_CPTR);
+            pos1 = jit_jump_fwd(j, JIT_CC_AE);
+            jit_load_char(j, 0);
+            jit_lea_table(j, JIT_RDX, tab);
+            jit_mem(j, 0, 0x0fb6, JIT_RSI, JIT_RDX, JIT_RAX, 0, 0);
+            jit_patch(j, pos1);
+            jit_rr(j, 0, 0x39, JIT_RSI, JIT_RCX); /* cmp ecx, esi */
+            if (opcode == REOP_word_boundary || opcode == REOP_word_boundary_i)
+                jit_jump(j, JIT_CC_E, j->no_match);
+            else
+                jit_jump(j, JIT_CC_NE, j->no_match);
+            break;
+        case REOP_goto:
+            target = pos + len + (int)get_u32(pc + 1);
+            jit_poll_timeout(j);
+            jit_jump_label(j, JIT_JMP, target);
+            break;
+        case REOP_split_goto_first:
+        case REOP_split_next_first:
+            target = pos + len + (int)get_u32(pc + 1);
+            if (opcode == REOP_split_next_first) {
+                jit_push_state(j, target);
+            } else {
+                jit_push_state(j, pos + len);
+                jit_jump_label(j, JIT_JMP, target);
+            }
+            break;
+        case REOP_string:
+        case REOP_string_i:
+            /* the REOP_char ops which follow are compiled */
+            break;
+        case REOP_switch:
+            /* the chain of alternatives which follows is compiled */
+            break;
+        case REOP_possessive_loop:
+            /* same as lre_exec_backtrack(): the chars accepted by the
+               atom are consumed without pushing a state per iteration */
+            {
+                int loop, end_max, end_cptr, end_char;
+                target = pos + len + get_u32(pc + 13);
+                for(c = 0; c < 256; c++)
+                    tab[c] = re_first_op_accepts(bc_buf + target, c);
+                jit_rr(j, 0, 0x31, JIT_RCX, JIT_RCX); /* xor ecx, ecx */
+                loop = j->code.size;
+                jit_ri(j, 0, 7, JIT_RCX, get_u32(pc + 9)); /* cmp ecx, max */
+                end_max = jit_jump_fwd(j, JIT_CC_AE);
+                jit_rr(j, 1, 0x39, JIT_END, JIT_CPTR); /* cmp rbx, rbp */
+                end_cptr = jit_jump_fwd(j, JIT_CC_AE);
+                jit_load_char(j, 0);
+                jit_lea_table(j, JIT_RDX, tab);
+                jit_mem(j, 0, 0x80, 7, JIT_RDX, JIT_RAX, 0, 0);
+                jit_byte(j, 0);
+                end_char = jit_jump_fwd(j, JIT_CC_E);
+                jit_rr(j, 1, 0xff, 0, JIT_CPTR); /* inc rbx */
+                jit_rr(j, 0, 0xff, 0, JIT_RCX); /* inc ecx */
+                jit_jump(j, JIT_JMP, loop);
+                jit_patch(j, end_max);
+                jit_patch(j, end_cptr);
+                jit_patch(j, end_char);
+                jit_ri(j, 0, 7, JIT_RCX, get_u32(pc + 5)); /* cmp ecx, min */
+                jit_jump(j, JIT_CC_B, j->no_match);
+                jit_jump_label(j, JIT_JMP, pos + len + get_u32(pc + 17));
+            }
+            break;
+        case REOP_greedy_loop:
+        case REOP_lazy_loop:
+            /* the loop which follows is compiled */
+            break;
+        case REOP_match:
+            jit_byte(j, 0xb8); /* mov eax, 1 */
+            jit_u32(j, 1);
+            jit_jump(j, JIT_JMP, j->epilogue);
+            break;
+        case REOP_save_start:
+        case REOP_save_end:
+            idx = 2 * pc[1] + opcode - REOP_save_start;
+            jit_check_stack_space(j, 2);
+            jit_push_undo(j, idx);
+            jit_mem(j, 1, 0x89, JIT_CPTR, JIT_CAPTURE, -1, 0,
+                    idx * sizeof(StackElem));
+            break;
+        case REOP_save_reset:
+            jit_check_stack_space(j, 4 * (pc[2] - pc[1] + 1));
+            for(idx = 2 * pc[1]; idx <= 2 * pc[2] + 1; idx++) {
+                jit_push_undo(j, idx);
+                jit_mem(j, 1, 0xc7, 0, JIT_CAPTURE, -1, 0,
+                        idx * sizeof(StackElem));
+                jit_u32(j, 0);
+            }
+            break;
+        case REOP_set_i32:
+            idx = 2 * capture_count + pc[1];
+            jit_push_undo_check(j, idx);
+            jit_byte(j, 0xb8); /* mov eax, val */
+            jit_u32(j, get_u32(pc + 2));
+            jit_mem(j, 1, 0x89, JIT_RAX, JIT_CAPTURE, -1, 0,
+                    idx * sizeof(StackElem));
+            break;
+        case REOP_set_char_pos:
+            idx = 2 * capture_count + pc[1];
+            jit_push_undo_check(j, idx);
+            jit_mem(j, 1, 0x89, JIT_CPTR, JIT_CAPTURE, -1, 0,
+                    idx * sizeof(StackElem));
+            break;
+        case REOP_check_advance:
+            idx = 2 * capture_count + pc[1];
+            jit_mem(j, 1, 0x3b, JIT_CPTR, JIT_CAPTURE, -1, 0,
+                    idx * sizeof(StackElem));
+            jit_jump(j, JIT_CC_E, j->no_match);
+            break;
+        case REOP_loop:
+        case REOP_loop_split_goto_first:
+        case REOP_loop_split_next_first:
+        case REOP_loop_check_adv_split_goto_first:
+        case REOP_loop_check_adv_split_next_first:
+            idx = 2 * capture_count + pc[1];
+            if (opcode == REOP_loop) {
+                limit = 0;
+                val = get_u32(pc + 2);
+            } else {
+                limit = get_u32(pc + 2);
+                val = get_u32(pc + 6);
+            }
+            target = pos + len + (int)val;
+            /* decrement the counter, eax = new value */
+            jit_push_undo_check(j, idx);
+            jit_mem(j, 0, 0x8b, JIT_RAX, JIT_CAPTURE, -1, 0,
+                    idx * sizeof(StackElem));
+            jit_ri(j, 0, 5, JIT_RAX, 1);
+            jit_mem(j, 1, 0x89, JIT_RAX, JIT_CAPTURE, -1, 0,
+                    idx * sizeof(StackElem));
+            /* normal loop if counter > limit */
+            jit_ri(j, 0, 7, JIT_RAX, limit);
+            pos1 = jit_jump_fwd(j, JIT_CC_BE);
+            jit_poll_timeout(j);
+            jit_jump_label(j, JIT_JMP, target);
+            jit_patch(j, pos1);
+            if (opcode == REOP_loop)
+                break;
+            if (opcode == REOP_loop_check_adv_split_goto_first ||
+                opcode == REOP_loop_check_adv_split_next_first) {
+                pos1 = jit_jump_fwd(j, JIT_CC_E); /* counter == limit */
+                jit_mem(j, 1, 0x3b, JIT_CPTR, JIT_CAPTURE, -1, 0,
+                        (idx + 1) * sizeof(StackElem));
+                jit_jump(j, JIT_CC_E, j->no_match);
+                jit_patch(j, pos1);
+            }
+            /* otherwise conditional split */
+            jit_rr(j, 0, 0x85, JIT_RAX, JIT_RAX);
+            pos1 = jit_jump_fwd(j, JIT_CC_E);
+            if (opcode == REOP_loop_split_next_first ||
+                opcode == REOP_loop_check_adv_split_next_first) {
+                jit_push_state(j, target);
+            } else {
+                jit_push_state(j, pos + len);
+                jit_jump_label(j, JIT_JMP, target);
+            }
+            jit_patch(j, pos1);
+            break;
+        default:
+            /* lookahead, back reference and lookbehind */
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Return the native code of the regexp or NULL if it cannot be
+   compiled (unsupported opcode or no executable memory). The result
+   can only be used with 'bc_buf' and must be freed with
+   lre_jit_free(). */
+LREJit *lre_jit_compile(const uint8_t *bc_buf, void *opaque)
+{
+    JitState j_s, *j = &j_s;
+    LREJit *jit;
+    const uint8_t *bc_start;
+    JitFixup *f;
+    int bc_len, re_flags, i, code_len;
+    size_t size, page_size;
+    uint8_t *code;
+    int32_t target;
+
+    re_flags = lre_get_flags(bc_buf);
+    if (re_flags & LRE_FLAG_LINEAR)
+        return NULL;
+    bc_start = bc_buf + RE_HEADER_LEN;
+    bc_len = get_u32(bc_buf + RE_HEADER_BYTECODE_LEN);
+
+    memset(j, 0, sizeof(*j));
+    dbuf_init2(&j->code, opaque, lre_realloc);
+    dbuf_init2(&j->tables, opaque, lre_realloc);
+    dbuf_init2(&j->fixups, opaque, lre_realloc);
+    jit = NULL;
+    j->labels = lre_realloc(opaque, NULL, sizeof(j->labels[0]) * (bc_len + 1));
+    if (!j->labels)
+        goto done;
+    for(i = 0; i <= bc_len; i++)
+        j->labels[i] = -1;
+
+    jit_emit_runtime(j);
+    if (!jit_emit_bytecode(j, bc_start, bc_len,
+                           bc_buf[RE_HEADER_CAPTURE_COUNT]))
+        goto done;
+    if (dbuf_error(&j->code) || dbuf_error(&j->tables) ||
+        dbuf_error(&j->fixups))
+        goto done;
+
+    /* the tables are stored after the code */
+    code_len = (j->code.size + 15) & ~15;
+    for(f = (JitFixup *)j->fixups.buf;
+        f < (JitFixup *)(j->fixups.buf + j->fixups.size); f++) {
+        if (f->type == JIT_FIXUP_LABEL) {
+            target = j->labels[f->target];
+            if (target < 0)
+                goto done;
+        } else {
+            target = code_len + f->target;
+        }
+        put_u32(j->code.buf + f->offset, target - (f->offset + 4));
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+    size = (code_len + j->tables.size + page_size - 1) & ~(page_size - 1);
+    code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        goto done;
+    memcpy(code, j->code.buf, j->code.size);
+    if (j->tables.size != 0)
+        memcpy(code + code_len, j->tables.buf, j->tables.size);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        goto done;
+    }
+    jit = lre_realloc(opaque, NULL, sizeof(*jit));
+    if (!jit) {
+        munmap(code, size);
+        goto done;
+    }
+    jit->bc_buf = bc_buf;
+    jit->code = code;
+    jit->code_size = size;
+    jit->entry[0] = j->labels[0];
+    if (re_flags & LRE_FLAG_STICKY)
+        jit->entry[1] = -1;
+    else
+        jit->entry[1] = j->labels[RE_SEARCH_LOOP_LEN];
+ done:
+    lre_realloc(opaque, j->labels, 0);
+    dbuf_free(&j->code);
+    dbuf_free(&j->tables);
+    dbuf_free(&j->fixups);
+    return jit;
+}
+
+void lre_jit_free(LREJit *jit, void *opaque)
+{
+    if (!jit)
+        return;
+    munmap(jit->code, jit->code_size);
+    lre_realloc(opaque, jit, 0);
+}
+
+/* run the native code from the bytecode position 'pc'. Return
+   JIT_RET_UNKNOWN if there is no entry point at 'pc'. */
+#define JIT_RET_UNKNOWN (-3)
+
+static intptr_t lre_exec_jit_code(REExecContext *s, uint8_t **capture,
+                                  const uint8_t *pc, const uint8_t *cptr)
+{
+    const LREJit *jit = s->jit;
+    JitContext ctx;
+    JitFunc *func;
+    int offset, ret;
+
+    offset = pc - (jit->bc_buf + RE_HEADER_LEN);
+    if (offset == 0)
+        offset = jit->entry[0];
+    else if (offset == RE_SEARCH_LOOP_LEN)
+        offset = jit->entry[1];
+    else
+        offset = -1;
+    if (offset < 0)
+        return JIT_RET_UNKNOWN;
+    ctx.cbuf = s->cbuf;
+    ctx.cbuf_end = s->cbuf_end;
+    ctx.stack_buf = s->stack_buf;
+    ctx.stack_end = s->stack_buf + s->stack_size;
+    ctx.s = s;
+    ctx.interrupt_counter = s->interrupt_counter;
+    func = (JitFunc *)(void *)jit->code;
+    ret = func(&ctx, capture, cptr, jit->code + offset);
+    s->interrupt_counter = ctx.interrupt_counter;
+    return ret;
+}
+
+#else
+
+LREJit *lre_jit_compile(const uint8_t *bc_buf, void *opaque)
+{
+    return NULL;
+}
+
+void lre_jit_free(LREJit *jit, void *opaque)
+{
+}
+
+#endif /* CONFIG_JIT */
+
+/* dispatch the opcodes of lre_exec_backtrack() with computed gotos
+   so that each opcode has its own indirect jump */
+#if defined(__GNUC__) && !defined(DUMP_EXEC) && !defined(LRE_NO_DIRECT_DISPATCH)
+#define DIRECT_DISPATCH 1
+#else
+#define DIRECT_DISPATCH 0
+#endif
+
+/* return 1 if match, 0 if not match or < 0 if error. */
+static intptr_t lre_exec_backtrack(REExecContext *s, uint8_t **capture,
+                                   const uint8_t *pc, const uint8_t *cptr)
+{
+    int opcode;
+    int cbuf_type;
+    uint32_t val, val2, c, idx;
+    const uint8_t *cbuf_end;
+    StackElem *sp, *bp, *stack_end;
+#ifdef DUMP_EXEC
+    const uint8_t *pc_start = pc; /* TEST */
+#endif
+#if DIRECT_DISPATCH
+    static const void * const dispatch_table[256] = {
+#define DEF(id, size) && case_REOP_ ## id,
+#include "libregexp-opcode.h"
+#undef DEF
+        [ REOP_COUNT ... 255 ] = &&case_default
+    };
+#define SWITCH(pc)      goto *dispatch_table[opcode = *pc++];
+#define CASE(op)        case_ ## op
+#define DEFAULT         case_default
+#define BREAK           SWITCH(pc)
+#else
+#define SWITCH(pc)      switch(opcode = *pc++)
+#define CASE(op)        case op
+#define DEFAULT         default
+#define BREAK           break
+#endif
+    cbuf_type = s->cbuf_type;
+    cbuf_end = s->cbuf_end;
+
+    sp = s->stack_buf;
+    bp = s->stack_buf;
+    stack_end = s->stack_buf + s->stack_size;
+
+#ifdef CONFIG_JIT
+    if (s->jit && cbuf_type == 0 && s->memo_steps == 0) {
+        intptr_t ret = lre_exec_jit_code(s, capture, pc, cptr);
+        if (ret != JIT_RET_UNKNOWN)
+            return ret;
+    }
+#endif
+    
+#define CHECK_STACK_SPACE(n)                            \
+    if (unlikely((stack_end - sp) < (n))) {             \
+        size_t saved_sp = sp - s->stack_buf;            \
+        size_t saved_bp = bp - s->stack_buf;            \
+        if (stack_realloc(s, sp - s->stack_buf + (n)))  \
+            return LRE_RET_MEMORY_ERROR;                \
+        stack_end = s->stack_buf + s->stack_size;       \
+        sp = s->stack_buf + saved_sp;                   \
+        bp = s->stack_buf + saved_bp;                   \
+    }
+
+    /* fail if the op at 'pc - 1' was already run at 'cptr' */
+#define MEMO_TEST()                                     \
+    if (s->memo_steps != 0) {                           \
+        int memo_ret = lre_memo_test_and_set(s, pc - 1, cptr); \
+        if (memo_ret < 0)                               \
+            return LRE_RET_MEMORY_ERROR;                \
+        if (memo_ret)                                   \
+            goto no_match;                              \
+    }
+
+    /* XXX: could test if the value was saved to reduce the stack size
+       but slower */
+#define SAVE_CAPTURE(idx, value)                        \
+    {                                                   \
+        CHECK_STACK_SPACE(2);                           \
+        sp[0].val = idx;                                \
+        sp[1].ptr = capture[idx];                       \
+        sp += 2;                                        \
+        capture[idx] = (value);                         \
+    }
+
+    /* avoid saving the previous value if already saved */
+#define SAVE_CAPTURE_CHECK(idx, value)          \
+    {                                           \
+        StackElem *sp1;                         \
+        sp1 = sp;                               \
+        for(;;) {                               \
+            if (sp1 > bp) {                             \
+                if (sp1[-2].val == idx)                 \
+                    break;                              \
+                sp1 -= 2;                               \
+            } else {                                    \
+                CHECK_STACK_SPACE(2);                   \
+                sp[0].val = idx;                        \
+                sp[1].ptr = capture[idx];               \
+                sp += 2;                                \
+                break;                                  \
+            }                                           \
+        }                                               \
+        capture[idx] = (value);                         \
+    }
+
+
+#ifdef DUMP_EXEC
+    printf("%5s %5s %5s %5s %s\n", "PC", "CP", "BP", "SP", "OPCODE");
+#endif    
+    for(;;) {
+#ifdef DUMP_EXEC
+        printf("%5ld %5ld %5ld %5ld %s\n",
+               pc - pc_start,
+               (cptr - s->cbuf) >> CBUF_SHIFT(cbuf_type),
+               bp - s->stack_buf,
+               sp - s->stack_buf,
+               reopcode_info[*pc].name);
+#endif        
+        SWITCH(pc) {
+        CASE(REOP_match):
+            return 1;
+        no_match:
+            for(;;) {
+                REExecStateEnum type;
+                if (bp == s->stack_buf)
+                    return 0;
+                /* undo the modifications to capture[] */
+                while (sp > bp) {
+                    capture[sp[-2].val] = sp[-1].ptr;
+                    sp -= 2;
+                }
+                
+                type = sp[-1].bp.type;
+                if (type == RE_EXEC_STATE_LOOP) {
+                    /* REOP_greedy_loop or REOP_lazy_loop: the state
+                       stays until the range of positions is exhausted */
+                    const uint8_t *op, *loop, *cptr1;
+
+                    op = sp[-3].ptr;
+                    cptr = sp[-2].ptr;
+                    loop = op + 5 + get_u32(op + 1);
+                    pc = loop + (int)get_u32(op + 17);
+                    if (*op == REOP_greedy_loop) {
+                        /* give back one char, sp[-4] is the lowest position */
+                        PREV_CHAR(cptr, sp[-4].ptr, cbuf_type);
+                        if (cptr > sp[-4].ptr) {
+                            sp[-2].ptr = (uint8_t *)cptr;
+                            break;
+                        }
+                        bp = s->stack_buf + sp[-1].bp.val;
+                        sp -= 4;
+                        break;
+                    }
+                    /* take one more char */
+                    if (cptr < cbuf_end) {
+                        cptr1 = cptr;
+                        GET_CHAR(c, cptr1, cbuf_end, cbuf_type);
+                        if (re_first_op_accepts(loop + get_u32(op + 13), c)) {
+                            cptr = cptr1;
+                            sp[-2].ptr = (uint8_t *)cptr;
+                            break;
+                        }
+                    }
+                    bp = s->stack_buf + sp[-1].bp.val;
+                    sp -= 4;
+                    continue;
+                }
+                pc = sp[-3].ptr;
+                cptr = sp[-2].ptr;
+                bp = s->stack_buf + sp[-1].bp.val;
+                sp -= 3;
+                if (type != RE_EXEC_STATE_LOOKAHEAD)
+                    break;
+            }
+            if (lre_poll_timeout(s))
+                return LRE_RET_TIMEOUT;
+            BREAK;
+        CASE(REOP_lookahead_match):
+            /* pop all the saved states until reaching the start of
+               the lookahead and keep the updated captures and
+               variables and the corresponding undo info. */
+            {
+                StackElem *sp1, *sp_top, *next_sp;
+                REExecStateEnum type;
+
+                sp_top = sp;
+                for(;;) {
+                    sp1 = sp;
+                    sp = bp;
+                    pc = sp[-3].ptr;
+                    cptr = sp[-2].ptr;
+                    type = sp[-1].bp.type;
+                    bp = s->stack_buf + sp[-1].bp.val;
+                    sp[-1].ptr = (void *)sp1; /* save the next value for the copy step */
+                    sp1 = sp;
+                    sp -= 3 + (type == RE_EXEC_STATE_LOOP);
+                    sp[0].ptr = (void *)sp1; /* and the end of the state */
+                    if (type == RE_EXEC_STATE_LOOKAHEAD)
+                        break;
+                }
+                if (sp != s->stack_buf) {
+                    /* keep the undo info if there is a saved state */
+                    sp1 = sp;
+                    while (sp1 < sp_top) {
+                        sp1 = (void *)sp1[0].ptr;
+                        next_sp = (void *)sp1[-1].ptr;
+                        while (sp1 < next_sp)
+                            *sp++ = *sp1++;
+                    }
+                }
+            }
+            BREAK;
+        CASE(REOP_negative_lookahead_match):
+            /* pop all the saved states until reaching start of the negative lookahead */
+            for(;;) {
+                REExecStateEnum type;
+                type = bp[-1].bp.type;
+                /* undo the modifications to capture[] */
+                while (sp > bp) {
+                    capture[sp[-2].val] = sp[-1].ptr;
+                    sp -= 2;
+                }
+                pc = sp[-3].ptr;
+                cptr = sp[-2].ptr;
+                type = sp[-1].bp.type;
+                bp = s->stack_buf + sp[-1].bp.val;
+                sp -= 3 + (type == RE_EXEC_STATE_LOOP);
+                if (type == RE_EXEC_STATE_NEGATIVE_LOOKAHEAD)
+                    break;
+            }
+            goto no_match;
+        CASE(REOP_char32):
+            val = get_u32(pc);
+            pc += 4;
+            goto test_char;
+        CASE(REOP_char):
+            val = get_u16(pc);
+            pc += 2;
+        test_char:
+            if (cptr >= cbuf_end)
+                goto no_match;
+            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+            if (val != c)
+                goto no_match;
+            BREAK;
+        CASE(REOP_char32_i):
+            val = get_u32(pc);
+            val2 = get_u32(pc + 4);
+            pc += 8;
+            goto test_char2;
+        CASE(REOP_char_i):
+            val = get_u16(pc);
+            val2 = get_u16(pc + 2);
+            pc += 4;
+        test_char2:
+            if (cptr >= cbuf_end)
+                goto no_match;
+            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+            if (val != c && val2 != c)
+                goto no_match;
+            BREAK;
+        CASE(REOP_string):
+            /* same as the REOP_char ops which follow */
+            val = get_u32(pc);
+            pc += 4;
+            if (cbuf_type == 3) {
+                /* the chars >= 0x80 have several bytes: run the ops */
+                pc += val;
+                BREAK;
+            }
+            if ((cbuf_end - cptr) < (val << (cbuf_type != 0)))
+                goto no_match;
+            if (cbuf_type == 0) {
+                if (cptr[0] != pc[0] || memcmp(cptr, pc, val) != 0)
+                    goto no_match;
+            } else {
+                uint32_t i;
+                for(i = 0; i < val; i++) {
+                    if (((const uint16_t *)cptr)[i] != pc[i])
+                        goto no_match;
+                }
+            }
+            cptr += val << (cbuf_type != 0);
+            pc += 4 * val;
+            BREAK;
+        CASE(REOP_string_i):
+            /* same as the REOP_char_i ops which follow */
+            {
+                uint32_t i, n;
+                val = get_u32(pc);
+                pc += 4;
+                if (cbuf_type == 3) {
+                    pc += val;
+                    BREAK;
+                }
+                n = val / 2;
+                if ((cbuf_end - cptr) < (n << (cbuf_type != 0)))
+                    goto no_match;
+                for(i = 0; i < n; i++) {
+                    if (cbuf_type == 0) {
+                        c = cptr[i];
+                    } else {
+                        c = ((const uint16_t *)cptr)[i];
+                    }
+                    if (c != pc[i] && c != pc[n + i])
+                        goto no_match;
+                }
+                cptr += n << (cbuf_type != 0);
+                pc += val + 5 * n;
+            }
+            BREAK;
+        CASE(REOP_switch):
+            /* same as the chain of alternatives which follows: the
+               matching alternatives are found by walking the trie and
+               tried from the longest one, then the alternatives left
+               in the chain are tried */
+            {
+                const uint8_t *chain, *trie, *node, *cptr1, *cptr_match, *pc1;
+                uint32_t n, tail, lo, hi, mid;
+                int end;
+
+                val = get_u32(pc);
+                chain = pc + 4 + val;
+                end = get_u32(pc + 4);
+                tail = get_u32(pc + 8);
+                trie = pc + 12;
+                node = trie;
+                cptr1 = cptr;
+                cptr_match = NULL;
+                for(;;) {
+                    n = get_u32(node);
+                    if (n & 1) {
+                        /* push the previous match or the chain */
+                        if (cptr_match) {
+                            pc1 = chain + end;
+                        } else if (tail != 0) {
+                            pc1 = chain + tail;
+                        } else {
+                            pc1 = NULL;
+                        }
+                        if (pc1) {
+                            CHECK_STACK_SPACE(3);
+                            sp[0].ptr = (uint8_t *)pc1;
+                            sp[1].ptr = (uint8_t *)(cptr_match ? cptr_match : cptr);
+                            sp[2].bp.val = bp - s->stack_buf;
+                            sp[2].bp.type = RE_EXEC_STATE_SPLIT;
+                            sp += 3;
+                            bp = sp;
+                        }
+                        cptr_match = cptr1;
+                    }
+                    n >>= 1;
+                    if (n == 0 || cptr1 >= cbuf_end)
+                        break;
+                    GET_CHAR(c, cptr1, cbuf_end, cbuf_type);
+                    lo = 0;
+                    hi = n;
+                    while (lo < hi) {
+                        mid = (lo + hi) / 2;
+                        if (get_u32(node + 4 + mid * 4) < c)
+                            lo = mid + 1;
+                        else
+                            hi = mid;
+                    }
+                    if (lo == n || get_u32(node + 4 + lo * 4) != c)
+                        break;
+                    node = trie + get_u32(node + 4 + (n + lo) * 4);
+                }
+                if (cptr_match) {
+                    pc = chain + end;
+                    cptr = cptr_match;
+                } else if (tail != 0) {
+                    pc = chain + tail;
+                } else {
+                    goto no_match;
+                }
+            }
+            BREAK;
+        CASE(REOP_possessive_loop):
+            /* same as the loop which follows because the code after it
+               cannot match a char accepted by the loop */
+            {
+                const uint8_t *loop, *atom, *cptr1;
+                uint32_t n, max;
+
+                MEMO_TEST();
+                val = get_u32(pc);
+                loop = pc + 4 + val;
+                max = get_u32(pc + 8);
+                atom = loop + get_u32(pc + 12);
+                for(n = 0; n < max && cptr < cbuf_end; n++) {
+                    cptr1 = cptr;
+                    GET_CHAR(c, cptr1, cbuf_end, cbuf_type);
+                    if (!re_first_op_accepts(atom, c))
+                        break;
+                    cptr = cptr1;
+                }
+                if (n < get_u32(pc + 4))
+                    goto no_match;
+                pc = loop + (int)get_u32(pc + 16);
+            }
+            BREAK;
+        CASE(REOP_greedy_loop):
+        CASE(REOP_lazy_loop):
+            /* same as the loop which follows but a single state is
+               pushed for all the iterations */
+            {
+                const uint8_t *loop, *atom, *cptr1, *cptr_min;
+                uint32_t n, max;
+
+                MEMO_TEST();
+                val = get_u32(pc);
+                loop = pc + 4 + val;
+                atom = loop + get_u32(pc + 12);
+                for(n = get_u32(pc + 4); n != 0; n--) {
+                    if (cptr >= cbuf_end)
+                        goto no_match;
+                    GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+                    if (!re_first_op_accepts(atom, c))
+                        goto no_match;
+                }
+                cptr_min = cptr;
+                if (opcode == REOP_greedy_loop) {
+                    max = get_u32(pc + 8) - get_u32(pc + 4);
+                    for(n = 0; n < max && cptr < cbuf_end; n++) {
+                        cptr1 = cptr;
+                        GET_CHAR(c, cptr1, cbuf_end, cbuf_type);
+                        if (!re_first_op_accepts(atom, c))
+                            break;
+                        cptr = cptr1;
+                    }
+                }
+                if (opcode == REOP_greedy_loop ? cptr > cptr_min :
+                    cptr < cbuf_end) {
+                    CHECK_STACK_SPACE(4);
+                    sp[0].ptr = (uint8_t *)cptr_min;
+                    sp[1].ptr = (uint8_t *)(pc - 1);
+                    sp[2].ptr = (uint8_t *)cptr;
+                    sp[3].bp.val = bp - s->stack_buf;
+                    sp[3].bp.type = RE_EXEC_STATE_LOOP;
+                    sp += 4;
+                    bp = sp;
+                }
+                pc = loop + (int)get_u32(pc + 16);
+            }
+            BREAK;
+        CASE(REOP_split_goto_first):
+        CASE(REOP_split_next_first):
+            {
+                const uint8_t *pc1;
+
+                MEMO_TEST();
+                val = get_u32(pc);
+                pc += 4;
+                if (opcode == REOP_split_next_first) {
+                    pc1 = pc + (int)val;
+                } else {
+                    pc1 = pc;
+                    pc = pc + (int)val;
+                }
+                CHECK_STACK_SPACE(3);
+                sp[0].ptr = (uint8_t *)pc1;
+                sp[1].ptr = (uint8_t *)cptr;
+                sp[2].bp.val = bp - s->stack_buf;
+                sp[2].bp.type = RE_EXEC_STATE_SPLIT;
+                sp += 3;
+                bp = sp;
+            }
+            BREAK;
+        CASE(REOP_lookahead):
+        CASE(REOP_negative_lookahead):
+            val = get_u32(pc);
+            pc += 4;
+            CHECK_STACK_SPACE(3);
+            sp[0].ptr = (uint8_t *)(pc + (int)val);
+            sp[1].ptr = (uint8_t *)cptr;
+            sp[2].bp.val = bp - s->stack_buf;
+            sp[2].bp.type = RE_EXEC_STATE_LOOKAHEAD + opcode - REOP_lookahead;
+            sp += 3;
+            bp = sp;
+            BREAK;
+        CASE(REOP_goto):
+            val = get_u32(pc);
+            pc += 4 + (int)val;
+            if (lre_poll_timeout(s))
+                return LRE_RET_TIMEOUT;
+            BREAK;
+        CASE(REOP_line_start):
+        CASE(REOP_line_start_m):
+            if (cptr == s->cbuf)
+                BREAK;
+            if (opcode == REOP_line_start)
+                goto no_match;
+            PEEK_PREV_CHAR(c, cptr, s->cbuf, cbuf_type);
+            if (!is_line_terminator(c))
+                goto no_match;
+            BREAK;
+        CASE(REOP_line_end):
+        CASE(REOP_line_end_m):
+            if (cptr == cbuf_end)
+                BREAK;
+            if (opcode == REOP_line_end)
+                goto no_match;
+            PEEK_CHAR(c, cptr, cbuf_end, cbuf_type);
+            if (!is_line_terminator(c))
+                goto no_match;
+            BREAK;
+        CASE(REOP_dot):
+            if (cptr == cbuf_end)
+                goto no_match;
+            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+            if (is_line_terminator(c))
+                goto no_match;
+            BREAK;
+        CASE(REOP_any):
+            if (cptr == cbuf_end)
+                goto no_match;
+            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+            BREAK;
+        CASE(REOP_space):
+            if (cptr == cbuf_end)
+                goto no_match;
+            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+            if (!lre_is_space(c))
+                goto no_match;
+            BREAK;
+        CASE(REOP_not_space):
+            if (cptr == cbuf_end)
+                goto no_match;
+            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+            if (lre_is_space(c))
+                goto no_match;
+            BREAK;
+        CASE(REOP_save_start):
+        CASE(REOP_save_end):
+            val = *pc++;
+            assert(val < s->capture_count);
+            if (val != 0 && !s->save_captures)
+                BREAK;
+            idx = 2 * val + opcode - REOP_save_start;
+            SAVE_CAPTURE(idx, (uint8_t *)cptr);
+            BREAK;
+        CASE(REOP_save_reset):
+            {
+                val = pc[0];
+                val2 = pc[1];
+                pc += 2;
+                assert(val2 < s->capture_count);
+                if (!s->save_captures)
+                    BREAK;
+                CHECK_STACK_SPACE(2 * (val2 - val + 1));
+                while (val <= val2) {
+                    idx = 2 * val;
+                    SAVE_CAPTURE(idx, NULL);
+                    idx = 2 * val + 1;
+                    SAVE_CAPTURE(idx, NULL);
+                    val++;
+                }
+            }
+            BREAK;
+        CASE(REOP_set_i32):
+            idx = 2 * s->capture_count + pc[0];
+            val = get_u32(pc + 1);
+            pc += 5;
+            SAVE_CAPTURE_CHECK(idx, (void *)(uintptr_t)val);
+            BREAK;
+        CASE(REOP_loop):
+            {
+                idx = 2 * s->capture_count + pc[0];
+                val = get_u32(pc + 1);
+                pc += 5;
+
+                val2 = (uintptr_t)capture[idx] - 1;
+                SAVE_CAPTURE_CHECK(idx, (void *)(uintptr_t)val2);
+                if (val2 != 0) {
+                    pc += (int)val;
+                    if (lre_poll_timeout(s))
+                        return LRE_RET_TIMEOUT;
+                }
+            }
+            BREAK;
+        CASE(REOP_loop_split_goto_first):
+        CASE(REOP_loop_split_next_first):
+        CASE(REOP_loop_check_adv_split_goto_first):
+        CASE(REOP_loop_check_adv_split_next_first):
+            {
+                const uint8_t *pc1;
+                uint32_t val2, limit;
+                idx = 2 * s->capture_count + pc[0];
+                limit = get_u32(pc + 1);
+                val = get_u32(pc + 5);
+                pc += 9;
+
+                /* decrement the counter */
+                val2 = (uintptr_t)capture[idx] - 1;
+                SAVE_CAPTURE_CHECK(idx, (void *)(uintptr_t)val2);
+
+                if (val2 > limit) {
+                    /* normal loop if counter > limit */
+                    pc += (int)val;
+                    if (lre_poll_timeout(s))
+                        return LRE_RET_TIMEOUT;
+                } else {
+                    /* check advance */
+                    if ((opcode == REOP_loop_check_adv_split_goto_first ||
+                         opcode == REOP_loop_check_adv_split_next_first) &&
+                        capture[idx + 1] == cptr &&
+                        val2 != limit) {
+                        goto no_match;
+                    }
+                    
+                    /* otherwise conditional split */
+                    if (val2 != 0) {
+                        if (opcode == REOP_loop_split_next_first ||
+                            opcode == REOP_loop_check_adv_split_next_first) {
+                            pc1 = pc + (int)val;
+                        } else {
+                            pc1 = pc;
+                            pc = pc + (int)val;
+                        }
+                        CHECK_STACK_SPACE(3);
+                        sp[0].ptr = (uint8_t *)pc1;
+                        sp[1].ptr = (uint8_t *)cptr;
+                        sp[2].bp.val = bp - s->stack_buf;
+                        sp[2].bp.type = RE_EXEC_STATE_SPLIT;
+                        sp += 3;
+                        bp = sp;
+                    }
+                }
+            }
+            BREAK;
+        CASE(REOP_set_char_pos):
+            idx = 2 * s->capture_count + pc[0];
+            pc++;
+            SAVE_CAPTURE_CHECK(idx, (uint8_t *)cptr);
+            BREAK;
+        CASE(REOP_check_advance):
+            idx = 2 * s->capture_count + pc[0];
+            pc++;
+            if (capture[idx] == cptr)
+                goto no_match;
+            BREAK;
+        CASE(REOP_word_boundary):
+        CASE(REOP_word_boundary_i):
+        CASE(REOP_not_word_boundary):
+        CASE(REOP_not_word_boundary_i):
+            {
+                BOOL v1, v2;
+                int ignore_case = (opcode == REOP_word_boundary_i || opcode == REOP_not_word_boundary_i);
+                BOOL is_boundary = (opcode == REOP_word_boundary || opcode == REOP_word_boundary_i);
+                /* char before */
+                if (cptr == s->cbuf) {
+                    v1 = FALSE;
+                } else {
+                    PEEK_PREV_CHAR(c, cptr, s->cbuf, cbuf_type);
+                    if (c < 256) {
+                        v1 = (lre_is_word_byte(c) != 0);
+                    } else {
+                        v1 = ignore_case && (c == 0x017f || c == 0x212a);
+                    }
+                }
+                /* current char */
+                if (cptr >= cbuf_end) {
+                    v2 = FALSE;
+                } else {
+                    PEEK_CHAR(c, cptr, cbuf_end, cbuf_type);
+                    if (c < 256) {
+                        v2 = (lre_is_word_byte(c) != 0);
+                    } else {
+                        v2 = ignore_case && (c == 0x017f || c == 0x212a);
+                    }
+                }
+                if (v1 ^ v2 ^ is_boundary)
+                    goto no_match;
+            }
+            BREAK;
+        CASE(REOP_back_reference):
+        CASE(REOP_back_reference_i):
+        CASE(REOP_backward_back_reference):
+        CASE(REOP_backward_back_reference_i):
+            {
+                const uint8_t *cptr1, *cptr1_end, *cptr1_start;
+                const uint8_t *pc1;
+                uint32_t c1, c2;
+                int i, n;
+
+                n = *pc++;
+                pc1 = pc;
+                pc += n;
+
+                for(i = 0; i < n; i++) {
+                    val = pc1[i];
+                    if (val >= s->capture_count)
+                        goto no_match;
+                    cptr1_start = capture[2 * val];
+                    cptr1_end = capture[2 * val + 1];
+                    /* test the first not empty capture */
+                    if (cptr1_start && cptr1_end) {
+                        if (opcode == REOP_back_reference ||
+                            opcode == REOP_back_reference_i) {
+                            cptr1 = cptr1_start;
+                            while (cptr1 < cptr1_end) {
+                                if (cptr >= cbuf_end)
+                                    goto no_match;
+                                GET_CHAR(c1, cptr1, cptr1_end, cbuf_type);
+                                GET_CHAR(c2, cptr, cbuf_end, cbuf_type);
+                                if (opcode == REOP_back_reference_i) {
+                                    c1 = lre_canonicalize(c1, s->is_unicode);
+                                    c2 = lre_canonicalize(c2, s->is_unicode);
+                                }
+                                if (c1 != c2)
+                                    goto no_match;
+                            }
+                        } else {
+                            cptr1 = cptr1_end;
+                            while (cptr1 > cptr1_start) {
+                                if (cptr == s->cbuf)
+                                    goto no_match;
+                                GET_PREV_CHAR(c1, cptr1, cptr1_start, cbuf_type);
+                                GET_PREV_CHAR(c2, cptr, s->cbuf, cbuf_type);
+                                if (opcode == REOP_backward_back_reference_i) {
+                                    c1 = lre_canonicalize(c1, s->is_unicode);
+                                    c2 = lre_canonicalize(c2, s->is_unicode);
+                                }
+                                if (c1 != c2)
+                                    goto no_match;
+                            }
+                        }
+                        break;
+                    }
+                }
+            }
+            BREAK;
+        CASE(REOP_range):
+            {
+                int n;
+                uint32_t low, high, idx_min, idx_max, idx;
+
+                n = get_u16(pc); /* n must be >= 1 */
+                pc += 2;
+                if (cptr >= cbuf_end)
+                    goto no_match;
+                GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+                if (c < 256) {
+                    if (!((pc[4 * n + (c >> 3)] >> (c & 7)) & 1))
+                        goto no_match;
+                    goto range_match;
+                }
+                idx_min = 0;
+                low = get_u16(pc + 0 * 4);
+                if (c < low)
+                    goto no_match;
+                idx_max = n - 1;
+                high = get_u16(pc + idx_max * 4 + 2);
+                /* 0xffff in for last value means +infinity */
+                if (unlikely(c >= 0xffff) && high == 0xffff)
+                    goto range_match;
+                if (c > high)
+                    goto no_match;
+                while (idx_min <= idx_max) {
+                    idx = (idx_min + idx_max) / 2;
+                    low = get_u16(pc + idx * 4);
+                    high = get_u16(pc + idx * 4 + 2);
+                    if (c < low)
+                        idx_max = idx - 1;
+                    else if (c > high)
+                        idx_min = idx + 1;
+                    else
+                        goto range_match;
+                }
+                goto no_match;
+            range_match:
+                pc += 4 * n + RE_RANGE_BITMAP_LEN;
+            }
+            BREAK;
+        CASE(REOP_range32):
+            {
+                int n;
+                uint32_t low, high, idx_min, idx_max, idx;
+
+                n = get_u16(pc); /* n must be >= 1 */
+                pc += 2;
+                if (cptr >= cbuf_end)
+                    goto no_match;
+                GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+                if (c < 256) {
+                    if (!((pc[8 * n + (c >> 3)] >> (c & 7)) & 1))
+                        goto no_match;
+                    goto range32_match;
+                }
+                idx_min = 0;
+                low = get_u32(pc + 0 * 8);
+                if (c < low)
+                    goto no_match;
+                idx_max = n - 1;
+                high = get_u32(pc + idx_max * 8 + 4);
+                if (c > high)
+                    goto no_match;
+                while (idx_min <= idx_max) {
+                    idx = (idx_min + idx_max) / 2;
+                    low = get_u32(pc + idx * 8);
+                    high = get_u32(pc + idx * 8 + 4);
+                    if (c < low)
+                        idx_max = idx - 1;
+                    else if (c > high)
+                        idx_min = idx + 1;
+                    else
+                        goto range32_match;
+                }
+                goto no_match;
+            range32_match:
+                pc += 8 * n + RE_RANGE_BITMAP_LEN;
+            }
+            BREAK;
+        CASE(REOP_prev):
+            /* go to the previous char */
+            if (cptr == s->cbuf)
+                goto no_match;
+            PREV_CHAR(cptr, s->cbuf, cbuf_type);
+            BREAK;
+        CASE(REOP_invalid):
+        DEFAULT:
+#ifdef DUMP_EXEC
+            printf("unknown opcode pc=%ld\n", pc - 1 - pc_start);
+#endif            
+            abort();
+        }
+    }
+}
+
+/* Convert the UTF-16 literal 'str' of 'len' code units to UTF-8. A
+   high surrogate at the end is dropped, and so is a low surrogate at
+   the start if 'drop_start' is TRUE. Return the length in bytes or -1
+   if the literal cannot be present in a UTF-8 string. */
+static int lre_literal_to_utf8(uint8_t *buf, const uint8_t *str, int len,
+                               BOOL drop_start)
+{
+    int i, n;
+    uint32_t c, c1;
+
+    n = 0;
+    for(i = 0; i < len; i++) {
+        c = get_u16(str + i * 2);
+        if (is_hi_surrogate(c)) {
+            if (i == len - 1)
+                break;
+            c1 = get_u16(str + i * 2 + 2);
+            if (!is_lo_surrogate(c1))
+                return -1;
+            c = from_surrogate(c, c1);
+            i++;
+        } else if (is_lo_surrogate(c)) {
+            if (i == 0 && drop_start)
+                continue;
+            return -1;
+        }
+        n += unicode_to_utf8(buf + n, c);
+    }
+    return n;
+}
+
+/* Return the first position >= 'cptr' where the literal prefix is
+   present or NULL if there is none. */
+static const uint8_t *lre_find_prefix(REExecContext *s, const uint8_t *prefix,
+                                      int prefix_len, const uint8_t *cptr)
+{
+    uint32_t c0;
+    int i;
+
+    c0 = get_u16(prefix);
+    if (s->cbuf_type == 0) {
+        const uint8_t *p, *end;
+        for(i = 0; i < prefix_len; i++) {
+            /* cannot match with 8 bit chars */
+            if (get_u16(prefix + i * 2) > 0xff)
+                return NULL;
+        }
+        p = cptr;
+        end = s->cbuf_end;
+        while ((end - p) >= prefix_len) {
+            p = memchr(p, c0, end - p - (prefix_len - 1));
+            if (!p)
+                return NULL;
+            for(i = 1; i < prefix_len; i++) {
+                if (p[i] != get_u16(prefix + i * 2))
+                    break;
+            }
+            if (i == prefix_len)
+                return p;
+            p++;
+        }
+    } else if (s->cbuf_type == 3) {
+        uint8_t str[RE_PREFIX_LEN_MAX * 3];
+        const uint8_t *p, *end;
+        int len;
+
+        len = lre_literal_to_utf8(str, prefix, prefix_len, FALSE);
+        if (len < 0)
+            return NULL;
+        if (len == 0) /* the match is not empty */
+            return cptr < s->cbuf_end ? cptr : NULL;
+        p = cptr;
+        end = s->cbuf_end;
+        while ((end - p) >= len) {
+            p = memchr(p, str[0], end - p - (len - 1));
+            if (!p)
+                return NULL;
+            if (!memcmp(p + 1, str + 1, len - 1))
+                return p;
+            p++;
+        }
+    } else {
+        const uint16_t *p, *end;
+        p = (const uint16_t *)cptr;
+        end = (const uint16_t *)s->cbuf_end;
+        for(; (end - p) >= prefix_len; p++) {
+            if (*p != c0)
+                continue;
+            for(i = 1; i < prefix_len; i++) {
+                if (p[i] != get_u16(prefix + i * 2))
+                    break;
+            }
+            if (i == prefix_len)
+                return (const uint8_t *)p;
+        }
+    }
+    return NULL;
+}
+
+/* Return the first character position >= 'cptr' whose first code
+   unit is in the first char set or NULL if there is none. */
+static const uint8_t *lre_find_first_char(REExecContext *s, const uint8_t *bc_buf,
+                                          const uint8_t *cptr)
+{
+    const uint8_t *bits = bc_buf + RE_HEADER_FIRST_CHARS;
+    const uint8_t *pages = bc_buf + RE_HEADER_FIRST_PAGES;
+    uint32_t c;
+
+    if (s->cbuf_type == 0) {
+        const uint8_t *p;
+        for(p = cptr; p < s->cbuf_end; p++) {
+            c = *p;
+            if (bits[c >> 3] & (1 << (c & 7)))
+                return p;
+        }
+    } else if (s->cbuf_type == 3) {
+        const uint8_t *p, *p1;
+        for(p = cptr; p < s->cbuf_end; p = p1) {
+            p1 = p + 1;
+            c = *p;
+            if (c < 0x80) {
+                if (bits[c >> 3] & (1 << (c & 7)))
+                    return p;
+                continue;
+            }
+            c = lre_utf8_get(c, &p1);
+            /* first UTF-16 code unit */
+            if (c > 0xffff)
+                c = 0xd800 + ((c - 0x10000) >> 10);
+            if (c < 256) {
+                if (bits[c >> 3] & (1 << (c & 7)))
+                    return p;
+            } else {
+                if (pages[c >> 11] & (1 << ((c >> 8) & 7)))
+                    return p;
+            }
+        }
+    } else {
+        const uint16_t *p, *end;
+        p = (const uint16_t *)cptr;
+        end = (const uint16_t *)s->cbuf_end;
+        while (p < end) {
+            c = *p;
+            if (c < 256) {
+                if (bits[c >> 3] & (1 << (c & 7)))
+                    return (const uint8_t *)p;
+            } else {
+                if (pages[c >> 11] & (1 << ((c >> 8) & 7)))
+                    return (const uint8_t *)p;
+                /* skip the low surrogate of a pair */
+                if (s->cbuf_type == 2 && is_hi_surrogate(c) &&
+                    (p + 1) < end && is_lo_surrogate(p[1]))
+                    p++;
+            }
+            p++;
+        }
+    }
+    return NULL;
+}
+
+/* Return the first position >= 'cptr' which is at the start of a
+   line or NULL if there is none. */
+static const uint8_t *lre_find_line_start(REExecContext *s, const uint8_t *cptr)
+{
+    uint32_t c;
+
+    if (cptr == s->cbuf)
+        return cptr;
+    PEEK_PREV_CHAR(c, cptr, s->cbuf, s->cbuf_type);
+    if (is_line_terminator(c))
+        return cptr;
+    if (s->cbuf_type == 0 || s->cbuf_type == 3) {
+        const uint8_t *p, *end, *lim;
+        end = s->cbuf_end;
+        /* the first '\n' or '\r'. The '\n' is kept for the next calls
+           so that the input is not searched again up to it when the
+           lines end with '\r'. */
+        if (!s->next_lf || s->next_lf < cptr) {
+            s->next_lf = memchr(cptr, '\n', end - cptr);
+            if (!s->next_lf)
+                s->next_lf = end;
+        }
+        lim = s->next_lf;
+        p = memchr(cptr, '\r', lim - cptr);
+        if (p)
+            lim = p;
+        if (s->cbuf_type == 3) {
+            /* U+2028 and U+2029 are encoded as e2 80 a8 and e2 80 a9 */
+            for(p = cptr; (p = memchr(p, 0xe2, lim - p)) != NULL; p++) {
+                if ((end - p) >= 3 && p[1] == 0x80 && (p[2] & 0xfe) == 0xa8)
+                    return p + 3;
+            }
+        }
+        if (lim < end)
+            return lim + 1;
+    } else {
+        const uint16_t *p, *end;
+        p = (const uint16_t *)cptr;
+        end = (const uint16_t *)s->cbuf_end;
+        for(; p < end; p++) {
+            if (is_line_terminator(*p))
+                return (const uint8_t *)(p + 1);
+        }
+    }
+    return NULL;
+}
+
+/* Return TRUE if the required literal of the regexp appears after
+   'cptr'. The Boyer-Moore-Horspool algorithm is used. */
+static BOOL lre_has_required(REExecContext *s, const uint8_t *bc_buf,
+                             const uint8_t *cptr)
+{
+    const uint8_t *required, *skip;
+    int required_len, i, last;
+
+    required_len = bc_buf[RE_HEADER_REQUIRED_LEN];
+    required = bc_buf + RE_HEADER_LEN + get_u32(bc_buf + RE_HEADER_BYTECODE_LEN) +
+        bc_buf[RE_HEADER_PREFIX_LEN] * 2;
+    skip = required + required_len * 2;
+    last = required_len - 1;
+    if (s->cbuf_type == 0) {
+        uint8_t str[RE_PREFIX_LEN_MAX];
+        const uint8_t *p, *end;
+        for(i = 0; i < required_len; i++) {
+            uint32_t c = get_u16(required + i * 2);
+            if (c > 0xff)
+                return FALSE;
+            str[i] = c;
+        }
+        if (required_len == 1)
+            return memchr(cptr, str[0], s->cbuf_end - cptr) != NULL;
+        end = s->cbuf_end;
+        p = cptr;
+        while ((end - p) >= required_len) {
+            if (p[last] == str[last] && !memcmp(p, str, last))
+                return TRUE;
+            p += skip[p[last]];
+        }
+    } else if (s->cbuf_type == 3) {
+        uint8_t str[RE_PREFIX_LEN_MAX * 3];
+        const uint8_t *p, *end;
+        int len;
+
+        len = lre_literal_to_utf8(str, required, required_len, TRUE);
+        if (len <= 0)
+            return len == 0;
+        end = s->cbuf_end;
+        p = cptr;
+        while ((end - p) >= len) {
+            p = memchr(p, str[0], end - p - (len - 1));
+            if (!p)
+                return FALSE;
+            if (!memcmp(p + 1, str + 1, len - 1))
+                return TRUE;
+            p++;
+        }
+    } else {
+        const uint16_t *p, *end;
+        p = (const uint16_t *)cptr;
+        end = (const uint16_t *)s->cbuf_end;
+        if (required_len == 1) {
+            uint32_t c0 = get_u16(required);
+            for(; p < end; p++) {
+                if (*p == c0)
+                    return TRUE;
+            }
+            return FALSE;
+        }
+        while ((end - p) >= required_len) {
+            for(i = last; i >= 0; i--) {
+                if (p[i] != get_u16(required + i * 2))
+                    break;
+            }
+            if (i < 0)
+                return TRUE;
+            p += skip[p[last] & 0xff];
+        }
+    }
+    return FALSE;
+}
+
+/* Same as executing the implicit search loop but the interpreter is
+   only run at the positions where a match can start. */
+static intptr_t lre_exec_search(REExecContext *s, uint8_t **capture,
+                                const uint8_t *bc_buf, const uint8_t *cptr)
+{
+    const uint8_t *pc, *prefix;
+    int search_mode, prefix_len, i;
+    uint32_t c;
+    intptr_t ret;
+
+    pc = bc_buf + RE_HEADER_LEN + RE_SEARCH_LOOP_LEN;
+    search_mode = bc_buf[RE_HEADER_SEARCH_MODE];
+    if (search_mode == RE_SEARCH_ANCHORED) {
+        if (cptr != s->cbuf)
+            return 0;
+        return lre_exec_backtrack(s, capture, pc, cptr);
+    }
+    prefix = bc_buf + RE_HEADER_LEN + get_u32(bc_buf + RE_HEADER_BYTECODE_LEN);
+    prefix_len = bc_buf[RE_HEADER_PREFIX_LEN];
+    for(;;) {
+        if (search_mode == RE_SEARCH_PREFIX)
+            cptr = lre_find_prefix(s, prefix, prefix_len, cptr);
+        else if (search_mode == RE_SEARCH_LINE_START)
+            cptr = lre_find_line_start(s, cptr);
+        else
+            cptr = lre_find_first_char(s, bc_buf, cptr);
+        if (!cptr)
+            return 0;
+        ret = lre_exec_backtrack(s, capture, pc, cptr);
+        if (ret != 0)
+            return ret;
+        /* the captures may be modified if no state was saved */
+        for(i = 0; i < s->capture_count * 2; i++)
+            capture[i] = NULL;
+        /* only the matches at the start of a line can be empty */
+        if (cptr >= s->cbuf_end)
+            return 0;
+        GET_CHAR(c, cptr, s->cbuf_end, s->cbuf_type);
+        if (lre_poll_timeout(s))
+            return LRE_RET_TIMEOUT;
+    }
+}
+
+/* Lazy DFA used by lre_exec_test(). A state is the set of the
+   positions reached in the bytecode after the last char and the
+   context of that char. The transitions are computed on demand with
+   the epsilon closure of the positions, so the assertions are
+   evaluated with both the previous and the next char. */
+
+#define DFA_CTX_START  (1 << 0) /* start of the input */
+#define DFA_CTX_END    (1 << 1) /* end of the input */
+#define DFA_CTX_LT     (1 << 2) /* line terminator */
+#define DFA_CTX_WORD   (1 << 3) /* word char */
+#define DFA_CTX_WORD_I (1 << 4) /* word char with ignore case */
+
+#define DFA_STATE_MAX 128 /* maximum number of cached states */
+#define DFA_HASH_SIZE 256
+/* the DFA is abandoned if its cache is flushed more often */
+#define DFA_FLUSH_MIN_CHARS (DFA_STATE_MAX * 16)
+/* below this length, running the interpreter is faster */
+#define DFA_INPUT_LEN_MIN 32
+
+/* the DFA cannot decide: run the interpreter */
+#define DFA_RET_UNKNOWN (-3)
+
+typedef struct DFAState {
+    struct DFAState *hash_next;
+    struct DFAState *next[256]; /* transitions for the chars < 256 */
+    struct DFAState *hi_next; /* last transition for a char >= 256 */
+    uint32_t hi_char;
+    uint32_t hash;
+    int8_t end_match; /* -1 if not computed */
+    uint8_t ctx;
+    int pc_count;
+    int pcs[0]; /* sorted bytecode positions */
+} DFAState;
+
+/* special state reached when a match is found */
+#define DFA_MATCH ((DFAState *)1)
+
+typedef struct DFAContext {
+    const uint8_t *bc_buf; /* bytecode without the header */
+    int bc_len;
+    void *opaque;
+    int state_count;
+    size_t states_size; /* size in bytes of the states */
+    DFAState *states[DFA_STATE_MAX];
+    DFAState *hash_table[DFA_HASH_SIZE];
+    const uint8_t *flush_cptr; /* position of the last cache flush */
+    uint32_t mark_gen;
+    uint32_t *marks; /* bc_len entries */
+    int *stack; /* bc_len entries */
+    int *closure; /* bc_len entries */
+    int *pcs; /* bc_len entries */
+} DFAContext;
+
+static int dfa_char_ctx(uint32_t c)
+{
+    int ctx = 0;
+    if (is_line_terminator(c))
+        ctx |= DFA_CTX_LT;
+    if (c < 256 && lre_is_word_byte(c))
+        ctx |= DFA_CTX_WORD | DFA_CTX_WORD_I;
+    else if (c == 0x017f || c == 0x212a)
+        ctx |= DFA_CTX_WORD_I;
+    return ctx;
+}
+
+static int dfa_cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Compute in d->closure the char test positions reachable from 'pcs'
+   without consuming a char. Return -1 if the match opcode is
+   reachable, otherwise the number of positions. */
+static int dfa_closure(DFAContext *d, const int *pcs, int pc_count,
+                       int prev_ctx, int next_ctx)
+{
+    const uint8_t *bc_buf = d->bc_buf;
+    int pos, len, stack_len, count, i;
+    BOOL v1, v2;
+
+    if (++d->mark_gen == 0) {
+        memset(d->marks, 0, sizeof(d->marks[0]) * d->bc_len);
+        d->mark_gen = 1;
+    }
+    stack_len = 0;
+    for(i = pc_count - 1; i >= 0; i--)
+        d->stack[stack_len++] = pcs[i];
+    count = 0;
+    while (stack_len > 0) {
+        pos = d->stack[--stack_len];
+        for(;;) {
+            if (d->marks[pos] == d->mark_gen)
+                break;
+            d->marks[pos] = d->mark_gen;
+            len = reopcode_info[bc_buf[pos]].size;
+            switch(bc_buf[pos]) {
+            case REOP_char:
+            case REOP_char_i:
+            case REOP_char32:
+            case REOP_char32_i:
+            case REOP_dot:
+            case REOP_any:
+            case REOP_space:
+            case REOP_not_space:
+            case REOP_range:
+            case REOP_range32:
+                if (!(next_ctx & DFA_CTX_END))
+                    d->closure[count++] = pos;
+                goto next_thread;
+            case REOP_match:
+                return -1;
+            case REOP_line_start:
+                if (!(prev_ctx & DFA_CTX_START))
+                    goto next_thread;
+                break;
+            case REOP_line_start_m:
+                if (!(prev_ctx & (DFA_CTX_START | DFA_CTX_LT)))
+                    goto next_thread;
+                break;
+            case REOP_line_end:
+                if (!(next_ctx & DFA_CTX_END))
+                    goto next_thread;
+                break;
+            case REOP_line_end_m:
+                if (!(next_ctx & (DFA_CTX_END | DFA_CTX_LT)))
+                    goto next_thread;
+                break;
+            case REOP_word_boundary:
+            case REOP_not_word_boundary:
+                v1 = (prev_ctx & DFA_CTX_WORD) != 0;
+                v2 = (next_ctx & DFA_CTX_WORD) != 0;
+                if ((v1 ^ v2) != (bc_buf[pos] == REOP_word_boundary))
+                    goto next_thread;
+                break;
+            case REOP_word_boundary_i:
+            case REOP_not_word_boundary_i:
+                v1 = (prev_ctx & DFA_CTX_WORD_I) != 0;
+                v2 = (next_ctx & DFA_CTX_WORD_I) != 0;
+                if ((v1 ^ v2) != (bc_buf[pos] == REOP_word_boundary_i))
+                    goto next_thread;
+                break;
+            case REOP_goto:
+            case REOP_string:
+            case REOP_string_i:
+            case REOP_switch:
+            case REOP_possessive_loop:
+            case REOP_greedy_loop:
+            case REOP_lazy_loop:
+                pos += len + (int)get_u32(bc_buf + pos + 1);
+                continue;
+            case REOP_split_goto_first:
+            case REOP_split_next_first:
+            case REOP_loop:
+            case REOP_loop_split_goto_first:
+            case REOP_loop_split_next_first:
+            case REOP_loop_check_adv_split_goto_first:
+            case REOP_loop_check_adv_split_next_first:
+                /* the loop counters are ignored */
+                d->stack[stack_len++] = pos + len + (int)get_u32(bc_buf + pos + len - 4);
+                break;
+            default:
+                /* save_start, save_end, save_reset, set_i32,
+                   set_char_pos, check_advance: an empty iteration
+                   cannot change the existence of a match */
+                break;
+            }
+            pos += len;
+        }
+    next_thread: ;
+    }
+    qsort(d->closure, count, sizeof(d->closure[0]), dfa_cmp_int);
+    return count;
+}
+
+static void dfa_flush(DFAContext *d)
+{
+    int i;
+    for(i = 0; i < d->state_count; i++)
+        lre_realloc(d->opaque, d->states[i], 0);
+    d->state_count = 0;
+    d->states_size = 0;
+    memset(d->hash_table, 0, sizeof(d->hash_table));
+}
+
+/* return a DFA without states for 'bc_buf' or NULL if memory error */
+static DFAContext *dfa_new(const uint8_t *bc_buf, void *opaque)
+{
+    DFAContext *d;
+    int bc_len;
+
+    bc_len = get_u32(bc_buf + RE_HEADER_BYTECODE_LEN);
+    d = lre_realloc(opaque, NULL, sizeof(*d) +
+                    (sizeof(uint32_t) + sizeof(int) * 3) * bc_len);
+    if (!d)
+        return NULL;
+    memset(d, 0, sizeof(*d));
+    d->bc_buf = bc_buf + RE_HEADER_LEN;
+    d->bc_len = bc_len;
+    d->opaque = opaque;
+    d->marks = (uint32_t *)(d + 1);
+    memset(d->marks, 0, sizeof(uint32_t) * bc_len);
+    d->stack = (int *)(d->marks + bc_len);
+    d->closure = d->stack + bc_len;
+    d->pcs = d->closure + bc_len;
+    return d;
+}
+
+static void dfa_free(DFAContext *d, void *opaque)
+{
+    d->opaque = opaque;
+    dfa_flush(d);
+    lre_realloc(opaque, d, 0);
+}
+
+/* return the state with the positions 'pcs' or NULL if error */
+static DFAState *dfa_get_state(DFAContext *d, const int *pcs, int pc_count,
+                               int ctx)
+{
+    DFAState *st;
+    uint32_t h;
+    int i;
+
+    h = ctx;
+    for(i = 0; i < pc_count; i++)
+        h = h * 263 + pcs[i];
+    for(st = d->hash_table[h % DFA_HASH_SIZE]; st != NULL; st = st->hash_next) {
+        if (st->hash == h && st->ctx == ctx && st->pc_count == pc_count &&
+            !memcmp(st->pcs, pcs, sizeof(pcs[0]) * pc_count))
+            return st;
+    }
+    if (d->state_count == DFA_STATE_MAX)
+        return NULL;
+    st = lre_realloc(d->opaque, NULL, sizeof(*st) + sizeof(pcs[0]) * pc_count);
+    if (!st)
+        return NULL;
+    d->states_size += sizeof(*st) + sizeof(pcs[0]) * pc_count;
+    memset(st, 0, sizeof(*st));
+    st->hash = h;
+    st->ctx = ctx;
+    st->end_match = -1;
+    st->pc_count = pc_count;
+    memcpy(st->pcs, pcs, sizeof(pcs[0]) * pc_count);
+    st->hash_next = d->hash_table[h % DFA_HASH_SIZE];
+    d->hash_table[h % DFA_HASH_SIZE] = st;
+    d->states[d->state_count++] = st;
+    return st;
+}
+
+/* Compute the transition of 'st' for the char 'c' at 'cptr'. Return
+   NULL if the DFA must be abandoned. */
+static DFAState *dfa_transition(DFAContext *d, DFAState *st, uint32_t c,
+                                const uint8_t *cptr)
+{
+    DFAState *st1;
+    int count, pc_count, next_ctx, i, pos;
+
+    next_ctx = dfa_char_ctx(c);
+    count = dfa_closure(d, st->pcs, st->pc_count, st->ctx, next_ctx);
+    if (count < 0) {
+        st1 = DFA_MATCH;
+    } else {
+        pc_count = 0;
+        for(i = 0; i < count; i++) {
+            pos = d->closure[i];
+            if (re_first_op_accepts(d->bc_buf + pos, c))
+                d->pcs[pc_count++] = pos + re_get_op_len(d->bc_buf + pos);
+        }
+        st1 = dfa_get_state(d, d->pcs, pc_count, next_ctx);
+        if (!st1) {
+            /* the cache is full: restart with an empty cache if it
+               was useful enough */
+            if (d->state_count != DFA_STATE_MAX ||
+                (cptr - d->flush_cptr) < DFA_FLUSH_MIN_CHARS)
+                return NULL;
+            dfa_flush(d);
+            d->flush_cptr = cptr;
+            /* 'st' was freed: the transition is not recorded */
+            return dfa_get_state(d, d->pcs, pc_count, next_ctx);
+        }
+    }
+    if (c < 256) {
+        st->next[c] = st1;
+    } else {
+        st->hi_char = c;
+        st->hi_next = st1;
+    }
+    return st1;
+}
+
+/* Return 1 if the regexp matches at or after 'cptr', 0 if not,
+   LRE_RET_TIMEOUT or DFA_RET_UNKNOWN if the DFA cannot be used. If
+   'stack' is not NULL, the states are kept in it for the next calls
+   as long as they take less than its 'size_max' bytes. */
+static int lre_exec_dfa(REExecContext *s, LREStack *stack,
+                        const uint8_t *bc_buf, const uint8_t *cptr)
+{
+    DFAContext *d;
+    DFAState *st, *st1;
+    int ret, ctx, pc0, count;
+    uint32_t c;
+    const uint8_t *cbuf_end = s->cbuf_end;
+    int cbuf_type = s->cbuf_type;
+
+    d = stack ? stack->dfa : NULL;
+    if (d && d->bc_buf != bc_buf + RE_HEADER_LEN) {
+        dfa_free(d, s->opaque);
+        stack->dfa = d = NULL;
+    }
+    if (!d) {
+        d = dfa_new(bc_buf, s->opaque);
+        if (!d)
+            return DFA_RET_UNKNOWN;
+        if (stack)
+            stack->dfa = d;
+    }
+    d->opaque = s->opaque;
+    d->flush_cptr = cptr;
+
+    if (cptr == s->cbuf) {
+        ctx = DFA_CTX_START;
+    } else {
+        PEEK_PREV_CHAR(c, cptr, s->cbuf, cbuf_type);
+        ctx = dfa_char_ctx(c);
+    }
+    pc0 = 0;
+    st = dfa_get_state(d, &pc0, 1, ctx);
+    if (!st) {
+        ret = DFA_RET_UNKNOWN;
+        goto done;
+    }
+    while (cptr < cbuf_end) {
+        if (cbuf_type == 0 || (cbuf_type == 3 && *cptr < 0x80)) {
+            c = *cptr++;
+            st1 = st->next[c];
+        } else {
+            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+            if (c < 256)
+                st1 = st->next[c];
+            else if (c == st->hi_char)
+                st1 = st->hi_next;
+            else
+                st1 = NULL;
+        }
+        if (unlikely(!st1)) {
+            st1 = dfa_transition(d, st, c, cptr);
+            if (!st1) {
+                ret = DFA_RET_UNKNOWN;
+                goto done;
+            }
+        }
+        if (st1 == DFA_MATCH) {
+            ret = 1;
+            goto done;
+        }
+        st = st1;
+        if (st->pc_count == 0) {
+            ret = 0;
+            goto done;
+        }
+        if (lre_poll_timeout(s)) {
+            ret = LRE_RET_TIMEOUT;
+            goto done;
+        }
+    }
+    if (st->end_match < 0) {
+        count = dfa_closure(d, st->pcs, st->pc_count, st->ctx, DFA_CTX_END);
+        st->end_match = (count < 0);
+    }
+    ret = st->end_match;
+ done:
+    if (!stack) {
+        dfa_free(d, s->opaque);
+    } else if (ret == DFA_RET_UNKNOWN || d->states_size > stack->size_max) {
+        /* the next call starts from an empty cache */
+        dfa_flush(d);
+    }
+    return ret;
+}
+
+/* Pike VM used for the regexps compiled with LRE_FLAG_LINEAR. The
+   threads run in lock step and are kept in priority order so that
+   the captures are the same as with lre_exec_backtrack(). Two threads
+   which reach the same bytecode position at the same char position
+   with the same loop state have the same future, so only the first
+   one is kept. A register holding a char position is only compared
+   with the current position, hence it is reduced to a 'fresh' bit in
+   the state. The registers are cleared when they become dead. */
+
+#define PIKE_REG_FRESH 0xffffffff
+#define PIKE_REG_STALE 0xfffffffe
+
+typedef struct {
+    const uint8_t *pc;
+    uint64_t pos_mask; /* registers containing a char position */
+} PikeThread;
+
+typedef struct {
+    int count;
+    int size;
+    PikeThread *threads;
+    uint8_t **slots; /* 'slot_count' entries per thread */
+} PikeList;
+
+typedef struct {
+    REExecContext *s;
+    const uint8_t *bc_buf; /* bytecode without the header */
+    int slot_count; /* captures followed by the registers */
+    int reg_start;
+    int reg_count;
+    /* set of the states visited at the current char position */
+    uint32_t gen;
+    int key_len;
+    int key_count;
+    int key_size;
+    uint32_t *keys; /* 'key_len' entries per state */
+    int hash_size; /* power of two */
+    uint32_t *hash_gen;
+    int *hash_index;
+    /* pending branches of the closure */
+    int stack_len;
+    int stack_size;
+    PikeThread *stack;
+    uint8_t **stack_slots;
+    uint8_t **cur_slots;
+} PikeContext;
+
+static BOOL lre_check_assertion(REExecContext *s, int opcode,
+                                const uint8_t *cptr)
+{
+    uint32_t c;
+    BOOL v1, v2;
+    int ignore_case;
+
+    switch(opcode) {
+    case REOP_line_start:
+    case REOP_line_start_m:
+        if (cptr == s->cbuf)
+            return TRUE;
+        if (opcode == REOP_line_start)
+            return FALSE;
+        PEEK_PREV_CHAR(c, cptr, s->cbuf, s->cbuf_type);
+        return is_line_terminator(c);
+    case REOP_line_end:
+    case REOP_line_end_m:
+        if (cptr == s->cbuf_end)
+            return TRUE;
+        if (opcode == REOP_line_end)
+            return FALSE;
+        PEEK_CHAR(c, cptr, s->cbuf_end, s->cbuf_type);
+        return is_line_terminator(c);
+    default:
+        ignore_case = (opcode == REOP_word_boundary_i ||
+                       opcode == REOP_not_word_boundary_i);
+        if (cptr == s->cbuf) {
+            v1 = FALSE;
+        } else {
+            PEEK_PREV_CHAR(c, cptr, s->cbuf, s->cbuf_type);
+            if (c < 256)
+                v1 = (lre_is_word_byte(c) != 0);
+            else
+                v1 = ignore_case && (c == 0x017f || c == 0x212a);
+        }
+        if (cptr >= s->cbuf_end) {
+            v2 = FALSE;
+        } else {
+            PEEK_CHAR(c, cptr, s->cbuf_end, s->cbuf_type);
+            if (c < 256)
+                v2 = (lre_is_word_byte(c) != 0);
+            else
+                v2 = ignore_case && (c == 0x017f || c == 0x212a);
+        }
+        return (v1 ^ v2) == (opcode == REOP_word_boundary ||
+                             opcode == REOP_word_boundary_i);
+    }
+}
+
+static void pike_next_gen(PikeContext *p)
+{
+    p->key_count = 0;
+    if (++p->gen == 0) {
+        memset(p->hash_gen, 0, sizeof(p->hash_gen[0]) * p->hash_size);
+        p->gen = 1;
+    }
+}
+
+static int pike_resize_hash(PikeContext *p, int new_size)
+{
+    uint32_t *new_gen, h;
+    int *new_index, i, j, k;
+
+    new_gen = lre_realloc(p->s->opaque, NULL, sizeof(new_gen[0]) * new_size);
+    if (!new_gen)
+        return -1;
+    new_index = lre_realloc(p->s->opaque, NULL, sizeof(new_index[0]) * new_size);
+    if (!new_index) {
+        lre_realloc(p->s->opaque, new_gen, 0);
+        return -1;
+    }
+    memset(new_gen, 0, sizeof(new_gen[0]) * new_size);
+    for(i = 0; i < p->key_count; i++) {
+        h = 0;
+        for(k = 0; k < p->key_len; k++)
+            h = h * 263 + p->keys[i * p->key_len + k];
+        for(j = h & (new_size - 1); new_gen[j] == p->gen; j = (j + 1) & (new_size - 1))
+            continue;
+        new_gen[j] = p->gen;
+        new_index[j] = i;
+    }
+    lre_realloc(p->s->opaque, p->hash_gen, 0);
+    lre_realloc(p->s->opaque, p->hash_index, 0);
+    p->hash_gen = new_gen;
+    p->hash_index = new_index;
+    p->hash_size = new_size;
+    return 0;
+}
+
+/* Return 1 if the state was not visited at the position 'cptr', 0 if
+   it was visited or -1 if memory error. */
+static int pike_visit(PikeContext *p, const uint8_t *pc, uint64_t pos_mask,
+                      uint8_t **regs, const uint8_t *cptr)
+{
+    uint32_t *key, h;
+    int i, j;
+
+    if (p->key_count == p->key_size) {
+        int new_size = p->key_size * 3 / 2 + 16;
+        uint32_t *new_keys;
+        new_keys = lre_realloc(p->s->opaque, p->keys,
+                               sizeof(new_keys[0]) * p->key_len * new_size);
+        if (!new_keys)
+            return -1;
+        p->keys = new_keys;
+        p->key_size = new_size;
+    }
+    /* build the key after the last one */
+    key = p->keys + p->key_count * p->key_len;
+    key[0] = pc - p->bc_buf;
+    for(i = 0; i < p->reg_count; i++) {
+        if ((pos_mask >> i) & 1)
+            key[i + 1] = (regs[i] == cptr) ? PIKE_REG_FRESH : PIKE_REG_STALE;
+        else
+            key[i + 1] = (uintptr_t)regs[i];
+    }
+    h = 0;
+    for(i = 0; i < p->key_len; i++)
+        h = h * 263 + key[i];
+    for(j = h & (p->hash_size - 1); p->hash_gen[j] == p->gen;
+        j = (j + 1) & (p->hash_size - 1)) {
+        if (!memcmp(p->keys + p->hash_index[j] * p->key_len, key,
+                    sizeof(key[0]) * p->key_len))
+            return 0;
+    }
+    p->hash_gen[j] = p->gen;
+    p->hash_index[j] = p->key_count++;
+    if (p->key_count * 2 > p->hash_size) {
+        if (pike_resize_hash(p, p->hash_size * 2))
+            return -1;
+    }
+    return 1;
+}
+
+static int pike_add_thread(PikeContext *p, PikeList *l, const uint8_t *pc,
+                           uint64_t pos_mask, uint8_t **slots)
+{
+    if (l->count == l->size) {
+        int new_size = l->size * 3 / 2 + 16;
+        PikeThread *new_threads;
+        uint8_t **new_slots;
+        new_threads = lre_realloc(p->s->opaque, l->threads,
+                                  sizeof(new_threads[0]) * new_size);
+        if (!new_threads)
+            return -1;
+        l->threads = new_threads;
+        new_slots = lre_realloc(p->s->opaque, l->slots,
+                                sizeof(new_slots[0]) * p->slot_count * new_size);
+        if (!new_slots)
+            return -1;
+        l->slots = new_slots;
+        l->size = new_size;
+    }
+    l->threads[l->count].pc = pc;
+    l->threads[l->count].pos_mask = pos_mask;
+    memcpy(l->slots + l->count * p->slot_count, slots,
+           sizeof(slots[0]) * p->slot_count);
+    l->count++;
+    return 0;
+}
+
+static int pike_push(PikeContext *p, const uint8_t *pc, uint64_t pos_mask)
+{
+    if (p->stack_len == p->stack_size) {
+        int new_size = p->stack_size * 3 / 2 + 16;
+        PikeThread *new_stack;
+        uint8_t **new_slots;
+        new_stack = lre_realloc(p->s->opaque, p->stack,
+                                sizeof(new_stack[0]) * new_size);
+        if (!new_stack)
+            return -1;
+        p->stack = new_stack;
+        new_slots = lre_realloc(p->s->opaque, p->stack_slots,
+                                sizeof(new_slots[0]) * p->slot_count * new_size);
+        if (!new_slots)
+            return -1;
+        p->stack_slots = new_slots;
+        p->stack_size = new_size;
+    }
+    p->stack[p->stack_len].pc = pc;
+    p->stack[p->stack_len].pos_mask = pos_mask;
+    memcpy(p->stack_slots + p->stack_len * p->slot_count, p->cur_slots,
+           sizeof(p->cur_slots[0]) * p->slot_count);
+    p->stack_len++;
+    return 0;
+}
+
+/* Add to 'l' the threads reachable from 'pc' without consuming a char
+   at the position 'cptr'. 'slots' may be modified. Each visited state
+   counts as a step for the timeout. Return 0, LRE_RET_MEMORY_ERROR or
+   LRE_RET_TIMEOUT. */
+static int pike_closure(PikeContext *p, PikeList *l, const uint8_t *pc,
+                        uint64_t pos_mask, uint8_t **slots,
+                        const uint8_t *cptr)
+{
+    uint8_t **cur, **regs;
+    const uint8_t *pc1;
+    uint32_t val, val2, limit;
+    int opcode, idx, ret;
+
+    cur = p->cur_slots;
+    regs = cur + p->reg_start;
+    memcpy(cur, slots, sizeof(cur[0]) * p->slot_count);
+    p->stack_len = 0;
+    for(;;) {
+        ret = pike_visit(p, pc, pos_mask, regs, cptr);
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            goto next_branch;
+        if (lre_poll_timeout(p->s))
+            return LRE_RET_TIMEOUT;
+        opcode = *pc;
+        switch(opcode) {
+        case REOP_goto:
+        case REOP_string:
+        case REOP_string_i:
+        case REOP_switch:
+        case REOP_possessive_loop:
+        case REOP_greedy_loop:
+        case REOP_lazy_loop:
+            pc += 5 + (int)get_u32(pc + 1);
             break;
-        case REOP_not_space:
-            if (cptr == cbuf_end)
-                goto no_match;
-            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
-            if (lre_is_space(c))
-                goto no_match;
+        case REOP_split_goto_first:
+        case REOP_split_next_first:
+            val = get_u32(pc + 1);
+            pc += 5;
+            if (opcode == REOP_split_goto_first) {
+                pc1 = pc;
+                pc += (int)val;
+            } else {
+                pc1 = pc + (int)val;
+            }
+            if (pike_push(p, pc1, pos_mask))
+                return -1;
             break;
         case REOP_save_start:
         case REOP_save_end:
-            val = *pc++;
-            assert(val < s->capture_count);
-            idx = 2 * val + opcode - REOP_save_start;
-            SAVE_CAPTURE(idx, (uint8_t *)cptr);
+            cur[2 * pc[1] + opcode - REOP_save_start] = (uint8_t *)cptr;
+            pc += 2;
             break;
         case REOP_save_reset:
-            {
-                uint32_t val2;
-                val = pc[0];
-                val2 = pc[1];
-                pc += 2;
-                assert(val2 < s->capture_count);
-                CHECK_STACK_SPACE(2 * (val2 - val + 1));
-                while (val <= val2) {
-                    idx = 2 * val;
-                    SAVE_CAPTURE(idx, NULL);
-                    idx = 2 * val + 1;
-                    SAVE_CAPTURE(idx, NULL);
-                    val++;
-                }
-            }
+            for(idx = 2 * pc[1]; idx <= 2 * pc[2] + 1; idx++)
+                cur[idx] = NULL;
+            pc += 3;
             break;
         case REOP_set_i32:
-            idx = 2 * s->capture_count + pc[0];
-            val = get_u32(pc + 1);
-            pc += 5;
-            SAVE_CAPTURE_CHECK(idx, (void *)(uintptr_t)val);
+            regs[pc[1]] = (uint8_t *)(uintptr_t)get_u32(pc + 2);
+            pos_mask &= ~((uint64_t)1 << pc[1]);
+            pc += 6;
+            break;
+        case REOP_set_char_pos:
+            regs[pc[1]] = (uint8_t *)cptr;
+            pos_mask |= (uint64_t)1 << pc[1];
+            pc += 2;
+            break;
+        case REOP_check_advance:
+            if (regs[pc[1]] == cptr)
+                goto next_branch;
+            regs[pc[1]] = NULL;
+            pos_mask &= ~((uint64_t)1 << pc[1]);
+            pc += 2;
             break;
         case REOP_loop:
-            {
-                uint32_t val2;
-                idx = 2 * s->capture_count + pc[0];
-                val = get_u32(pc + 1);
-                pc += 5;
-
-                val2 = (uintptr_t)capture[idx] - 1;
-                SAVE_CAPTURE_CHECK(idx, (void *)(uintptr_t)val2);
-                if (val2 != 0) {
-                    pc += (int)val;
-                    if (lre_poll_timeout(s))
-                        return LRE_RET_TIMEOUT;
-                }
+            idx = pc[1];
+            val = get_u32(pc + 2);
+            pc += 6;
+            val2 = (uintptr_t)regs[idx] - 1;
+            if (val2 != 0) {
+                regs[idx] = (uint8_t *)(uintptr_t)val2;
+                pc += (int)val;
+            } else {
+                regs[idx] = NULL;
             }
             break;
         case REOP_loop_split_goto_first:
@@ -3079,290 +7857,928 @@ static intptr_t lre_exec_backtrack(REExecContext *s, uint8_t **capture,
         case REOP_loop_check_adv_split_goto_first:
         case REOP_loop_check_adv_split_next_first:
             {
-                const uint8_t *pc1;
-                uint32_t val2, limit;
-                idx = 2 * s->capture_count + pc[0];
-                limit = get_u32(pc + 1);
-                val = get_u32(pc + 5);
-                pc += 9;
-
-                /* decrement the counter */
-                val2 = (uintptr_t)capture[idx] - 1;
-                SAVE_CAPTURE_CHECK(idx, (void *)(uintptr_t)val2);
-
+                BOOL check_adv, loop_first;
+                uint64_t exit_mask;
+
+                idx = pc[1];
+                limit = get_u32(pc + 2);
+                val = get_u32(pc + 6);
+                pc += 10;
+                val2 = (uintptr_t)regs[idx] - 1;
+                regs[idx] = (uint8_t *)(uintptr_t)val2;
                 if (val2 > limit) {
-                    /* normal loop if counter > limit */
                     pc += (int)val;
-                    if (lre_poll_timeout(s))
-                        return LRE_RET_TIMEOUT;
+                    break;
+                }
+                check_adv = (opcode == REOP_loop_check_adv_split_goto_first ||
+                             opcode == REOP_loop_check_adv_split_next_first);
+                if (check_adv && regs[idx + 1] == cptr && val2 != limit)
+                    goto next_branch;
+                /* the registers of the loop are dead after the exit */
+                exit_mask = pos_mask & ~((uint64_t)1 << idx);
+                if (check_adv)
+                    exit_mask &= ~((uint64_t)1 << (idx + 1));
+                if (val2 == 0) {
+                    regs[idx] = NULL;
+                    if (check_adv)
+                        regs[idx + 1] = NULL;
+                    pos_mask = exit_mask;
+                    break;
+                }
+                loop_first = (opcode == REOP_loop_split_goto_first ||
+                              opcode == REOP_loop_check_adv_split_goto_first);
+                if (loop_first) {
+                    if (pike_push(p, pc, exit_mask))
+                        return -1;
+                    /* clear the registers in the pushed branch */
+                    p->stack_slots[(p->stack_len - 1) * p->slot_count +
+                                   p->reg_start + idx] = NULL;
+                    if (check_adv)
+                        p->stack_slots[(p->stack_len - 1) * p->slot_count +
+                                       p->reg_start + idx + 1] = NULL;
+                    pc += (int)val;
                 } else {
-                    /* check advance */
-                    if ((opcode == REOP_loop_check_adv_split_goto_first ||
-                         opcode == REOP_loop_check_adv_split_next_first) &&
-                        capture[idx + 1] == cptr &&
-                        val2 != limit) {
-                        goto no_match;
-                    }
-                    
-                    /* otherwise conditional split */
-                    if (val2 != 0) {
-                        if (opcode == REOP_loop_split_next_first ||
-                            opcode == REOP_loop_check_adv_split_next_first) {
-                            pc1 = pc + (int)val;
-                        } else {
-                            pc1 = pc;
-                            pc = pc + (int)val;
-                        }
-                        CHECK_STACK_SPACE(3);
-                        sp[0].ptr = (uint8_t *)pc1;
-                        sp[1].ptr = (uint8_t *)cptr;
-                        sp[2].bp.val = bp - s->stack_buf;
-                        sp[2].bp.type = RE_EXEC_STATE_SPLIT;
-                        sp += 3;
-                        bp = sp;
-                    }
+                    if (pike_push(p, pc + (int)val, pos_mask))
+                        return -1;
+                    regs[idx] = NULL;
+                    if (check_adv)
+                        regs[idx + 1] = NULL;
+                    pos_mask = exit_mask;
                 }
             }
             break;
-        case REOP_set_char_pos:
-            idx = 2 * s->capture_count + pc[0];
-            pc++;
-            SAVE_CAPTURE_CHECK(idx, (uint8_t *)cptr);
-            break;
-        case REOP_check_advance:
-            idx = 2 * s->capture_count + pc[0];
-            pc++;
-            if (capture[idx] == cptr)
-                goto no_match;
-            break;
+        case REOP_line_start:
+        case REOP_line_start_m:
+        case REOP_line_end:
+        case REOP_line_end_m:
         case REOP_word_boundary:
         case REOP_word_boundary_i:
         case REOP_not_word_boundary:
         case REOP_not_word_boundary_i:
-            {
-                BOOL v1, v2;
-                int ignore_case = (opcode == REOP_word_boundary_i || opcode == REOP_not_word_boundary_i);
-                BOOL is_boundary = (opcode == REOP_word_boundary || opcode == REOP_word_boundary_i);
-                /* char before */
-                if (cptr == s->cbuf) {
-                    v1 = FALSE;
-                } else {
-                    PEEK_PREV_CHAR(c, cptr, s->cbuf, cbuf_type);
-                    if (c < 256) {
-                        v1 = (lre_is_word_byte(c) != 0);
-                    } else {
-                        v1 = ignore_case && (c == 0x017f || c == 0x212a);
-                    }
-                }
-                /* current char */
-                if (cptr >= cbuf_end) {
-                    v2 = FALSE;
-                } else {
-                    PEEK_CHAR(c, cptr, cbuf_end, cbuf_type);
-                    if (c < 256) {
-                        v2 = (lre_is_word_byte(c) != 0);
-                    } else {
-                        v2 = ignore_case && (c == 0x017f || c == 0x212a);
-                    }
+            if (!lre_check_assertion(p->s, opcode, cptr))
+                goto next_branch;
+            pc++;
+            break;
+        default:
+            /* char test or match: the thread waits for the next char */
+            if (pike_add_thread(p, l, pc, pos_mask, cur))
+                return -1;
+        next_branch:
+            if (p->stack_len == 0)
+                return 0;
+            p->stack_len--;
+            pc = p->stack[p->stack_len].pc;
+            pos_mask = p->stack[p->stack_len].pos_mask;
+            memcpy(cur, p->stack_slots + p->stack_len * p->slot_count,
+                   sizeof(cur[0]) * p->slot_count);
+            break;
+        }
+    }
+}
+
+/* same as lre_exec_backtrack() but in linear time */
+static intptr_t lre_exec_pike(REExecContext *s, uint8_t **capture,
+                              const uint8_t *bc_buf, const uint8_t *cptr)
+{
+    PikeContext p_s, *p = &p_s;
+    PikeList lists[2], *clist, *nlist, *tmp;
+    const uint8_t *cptr1, *pc;
+    uint8_t **slots;
+    uint32_t c;
+    intptr_t ret;
+    int i, err;
+
+    memset(p, 0, sizeof(*p));
+    memset(lists, 0, sizeof(lists));
+    p->s = s;
+    p->bc_buf = bc_buf + RE_HEADER_LEN;
+    p->reg_start = s->capture_count * 2;
+    p->reg_count = bc_buf[RE_HEADER_REGISTER_COUNT];
+    p->slot_count = p->reg_start + p->reg_count;
+    p->key_len = 1 + p->reg_count;
+    p->cur_slots = lre_realloc(s->opaque, NULL, sizeof(p->cur_slots[0]) * p->slot_count * 2);
+    if (!p->cur_slots || pike_resize_hash(p, 64)) {
+        ret = LRE_RET_MEMORY_ERROR;
+        goto done;
+    }
+    slots = p->cur_slots + p->slot_count;
+    for(i = 0; i < p->slot_count; i++)
+        slots[i] = NULL;
+
+    clist = &lists[0];
+    nlist = &lists[1];
+    ret = 0;
+    pike_next_gen(p);
+    err = pike_closure(p, clist, p->bc_buf, 0, slots, cptr);
+    if (err < 0) {
+        ret = err;
+        goto done;
+    }
+    while (clist->count != 0) {
+        cptr1 = cptr;
+        c = 0;
+        if (cptr < s->cbuf_end)
+            GET_CHAR(c, cptr1, s->cbuf_end, s->cbuf_type);
+        pike_next_gen(p);
+        nlist->count = 0;
+        for(i = 0; i < clist->count; i++) {
+            pc = clist->threads[i].pc;
+            if (*pc == REOP_match) {
+                /* the lower priority threads are discarded */
+                memcpy(capture, clist->slots + i * p->slot_count,
+                       sizeof(capture[0]) * p->reg_start);
+                ret = 1;
+                break;
+            }
+            if (cptr < s->cbuf_end &&
+                re_first_op_accepts(pc, c)) {
+                /* the slots of the current list can be modified */
+                err = pike_closure(p, nlist, pc + re_get_op_len(pc),
+                                   clist->threads[i].pos_mask,
+                                   clist->slots + i * p->slot_count, cptr1);
+                if (err < 0) {
+                    ret = err;
+                    goto done;
                 }
-                if (v1 ^ v2 ^ is_boundary)
-                    goto no_match;
             }
+            if (lre_poll_timeout(s)) {
+                ret = LRE_RET_TIMEOUT;
+                goto done;
+            }
+        }
+        if (cptr >= s->cbuf_end)
             break;
-        case REOP_back_reference:
-        case REOP_back_reference_i:
-        case REOP_backward_back_reference:
-        case REOP_backward_back_reference_i:
-            {
-                const uint8_t *cptr1, *cptr1_end, *cptr1_start;
-                const uint8_t *pc1;
-                uint32_t c1, c2;
-                int i, n;
+        tmp = clist;
+        clist = nlist;
+        nlist = tmp;
+        cptr = cptr1;
+    }
+ done:
+    for(i = 0; i < 2; i++) {
+        lre_realloc(s->opaque, lists[i].threads, 0);
+        lre_realloc(s->opaque, lists[i].slots, 0);
+    }
+    lre_realloc(s->opaque, p->keys, 0);
+    lre_realloc(s->opaque, p->hash_gen, 0);
+    lre_realloc(s->opaque, p->hash_index, 0);
+    lre_realloc(s->opaque, p->stack, 0);
+    lre_realloc(s->opaque, p->stack_slots, 0);
+    lre_realloc(s->opaque, p->cur_slots, 0);
+    return ret;
+}
 
-                n = *pc++;
-                pc1 = pc;
-                pc += n;
+/* return the one-pass table stored after the bytecode, the prefix
+   and the required literal */
+static const uint8_t *lre_get_onepass_table(const uint8_t *bc_buf)
+{
+    const uint8_t *tab;
+    int required_len;
+
+    required_len = bc_buf[RE_HEADER_REQUIRED_LEN];
+    tab = bc_buf + RE_HEADER_LEN + get_u32(bc_buf + RE_HEADER_BYTECODE_LEN) +
+        (bc_buf[RE_HEADER_PREFIX_LEN] + required_len) * 2;
+    if (required_len >= 2)
+        tab += 256;
+    return tab;
+}
 
-                for(i = 0; i < n; i++) {
-                    val = pc1[i];
-                    if (val >= s->capture_count)
-                        goto no_match;
-                    cptr1_start = capture[2 * val];
-                    cptr1_end = capture[2 * val + 1];
-                    /* test the first not empty capture */
-                    if (cptr1_start && cptr1_end) {
-                        if (opcode == REOP_back_reference ||
-                            opcode == REOP_back_reference_i) {
-                            cptr1 = cptr1_start;
-                            while (cptr1 < cptr1_end) {
-                                if (cptr >= cbuf_end)
-                                    goto no_match;
-                                GET_CHAR(c1, cptr1, cptr1_end, cbuf_type);
-                                GET_CHAR(c2, cptr, cbuf_end, cbuf_type);
-                                if (opcode == REOP_back_reference_i) {
-                                    c1 = lre_canonicalize(c1, s->is_unicode);
-                                    c2 = lre_canonicalize(c2, s->is_unicode);
-                                }
-                                if (c1 != c2)
-                                    goto no_match;
-                            }
-                        } else {
-                            cptr1 = cptr1_end;
-                            while (cptr1 > cptr1_start) {
-                                if (cptr == s->cbuf)
-                                    goto no_match;
-                                GET_PREV_CHAR(c1, cptr1, cptr1_start, cbuf_type);
-                                GET_PREV_CHAR(c2, cptr, s->cbuf, cbuf_type);
-                                if (opcode == REOP_backward_back_reference_i) {
-                                    c1 = lre_canonicalize(c1, s->is_unicode);
-                                    c2 = lre_canonicalize(c2, s->is_unicode);
-                                }
-                                if (c1 != c2)
-                                    goto no_match;
-                            }
-                        }
-                        break;
-                    }
+/* return the Glushkov automaton stored after the one-pass table */
+static const uint8_t *lre_get_glushkov(const uint8_t *bc_buf)
+{
+    const uint8_t *tab;
+
+    tab = lre_get_onepass_table(bc_buf);
+    if (bc_buf[RE_HEADER_ONEPASS_LEN] != 0)
+        tab += (bc_buf[RE_HEADER_ONEPASS_LEN] - 1) * RE_ONEPASS_ENTRY_LEN;
+    return tab;
+}
+
+#define ONEPASS_RET_UNKNOWN (-3)
+
+/* return the one-pass entry of the split at position 'pos' or NULL */
+static const uint8_t *lre_find_onepass_entry(const uint8_t *bc_buf, int pos)
+{
+    const uint8_t *tab, *entry;
+    int lo, hi, mid, entry_pos;
+
+    tab = lre_get_onepass_table(bc_buf);
+    lo = 0;
+    hi = bc_buf[RE_HEADER_ONEPASS_LEN] - 1;
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        entry = tab + mid * RE_ONEPASS_ENTRY_LEN;
+        entry_pos = get_u16(entry);
+        if (entry_pos == pos)
+            return entry;
+        if (entry_pos < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/* Run a one-pass regexp from 'pc' without backtracking. When a
+   branch is taken, the empty match of the other branch is kept to be
+   returned if the taken branch fails. If 'empty_only' is TRUE, only
+   the path which does not consume chars is followed. Return 1 if
+   match, 0 if not match, ONEPASS_RET_UNKNOWN if the interpreter must
+   be used or < 0 if error. */
+static int lre_exec_onepass(REExecContext *s, uint8_t **capture,
+                            const uint8_t *bc_buf, const uint8_t *pc,
+                            const uint8_t *cptr, BOOL empty_only)
+{
+    uint8_t *cand[CAPTURE_COUNT_MAX * 2];
+    uint8_t *tmp[CAPTURE_COUNT_MAX * 2 + REGISTER_COUNT_MAX];
+    const uint8_t *bc_start, *pc_a, *pc_b, *entry;
+    int opcode, ret, flags, alloc_count, reg_start, steps, steps_max;
+    uint32_t c, val, val2, limit, idx;
+    BOOL has_cand, in_a, in_b;
+
+    bc_start = bc_buf + RE_HEADER_LEN;
+    reg_start = 2 * s->capture_count;
+    alloc_count = lre_get_alloc_count(bc_buf);
+    /* guard against the loops which do not consume chars */
+    steps_max = get_u32(bc_buf + RE_HEADER_BYTECODE_LEN);
+    steps = 0;
+    has_cand = FALSE;
+    for(;;) {
+        opcode = *pc;
+        switch(opcode) {
+        case REOP_match:
+            return 1;
+        case REOP_char:
+        case REOP_char_i:
+        case REOP_char32:
+        case REOP_char32_i:
+        case REOP_dot:
+        case REOP_any:
+        case REOP_space:
+        case REOP_not_space:
+        case REOP_range:
+        case REOP_range32:
+            if (empty_only || cptr >= s->cbuf_end)
+                goto fail;
+            GET_CHAR(c, cptr, s->cbuf_end, s->cbuf_type);
+            if (!re_first_op_accepts(pc, c))
+                goto fail;
+            pc += re_get_op_len(pc);
+            steps = 0;
+            break;
+        case REOP_save_start:
+        case REOP_save_end:
+            capture[2 * pc[1] + opcode - REOP_save_start] = (uint8_t *)cptr;
+            pc += 2;
+            break;
+        case REOP_save_reset:
+            for(idx = 2 * pc[1]; idx <= 2 * pc[2] + 1; idx++)
+                capture[idx] = NULL;
+            pc += 3;
+            break;
+        case REOP_set_i32:
+            capture[reg_start + pc[1]] = (uint8_t *)(uintptr_t)get_u32(pc + 2);
+            pc += 6;
+            break;
+        case REOP_set_char_pos:
+            capture[reg_start + pc[1]] = (uint8_t *)cptr;
+            pc += 2;
+            break;
+        case REOP_check_advance:
+            if (capture[reg_start + pc[1]] == cptr)
+                goto fail;
+            pc += 2;
+            break;
+        case REOP_line_start:
+        case REOP_line_start_m:
+        case REOP_line_end:
+        case REOP_line_end_m:
+        case REOP_word_boundary:
+        case REOP_word_boundary_i:
+        case REOP_not_word_boundary:
+        case REOP_not_word_boundary_i:
+            if (!lre_check_assertion(s, opcode, cptr))
+                goto fail;
+            pc++;
+            break;
+        case REOP_goto:
+        case REOP_string:
+        case REOP_string_i:
+        case REOP_switch:
+        case REOP_possessive_loop:
+        case REOP_greedy_loop:
+        case REOP_lazy_loop:
+            pc += 5 + (int)get_u32(pc + 1);
+            goto epsilon;
+        case REOP_loop:
+            idx = reg_start + pc[1];
+            val = get_u32(pc + 2);
+            pc += 6;
+            val2 = (uintptr_t)capture[idx] - 1;
+            capture[idx] = (uint8_t *)(uintptr_t)val2;
+            if (val2 != 0)
+                pc += (int)val;
+            goto epsilon;
+        case REOP_split_goto_first:
+        case REOP_split_next_first:
+            pc_a = pc + 5;
+            pc_b = pc_a + (int)get_u32(pc + 1);
+            goto split;
+        case REOP_loop_split_goto_first:
+        case REOP_loop_split_next_first:
+        case REOP_loop_check_adv_split_goto_first:
+        case REOP_loop_check_adv_split_next_first:
+            idx = reg_start + pc[1];
+            limit = get_u32(pc + 2);
+            val = get_u32(pc + 6);
+            val2 = (uintptr_t)capture[idx] - 1;
+            capture[idx] = (uint8_t *)(uintptr_t)val2;
+            if (val2 > limit) {
+                pc += 10 + (int)val;
+                goto epsilon;
+            }
+            if ((opcode == REOP_loop_check_adv_split_goto_first ||
+                 opcode == REOP_loop_check_adv_split_next_first) &&
+                capture[idx + 1] == cptr && val2 != limit)
+                goto fail;
+            if (val2 == 0) {
+                pc += 10;
+                goto epsilon;
+            }
+            pc_a = pc + 10;
+            pc_b = pc_a + (int)val;
+        split:
+            if (opcode == REOP_split_goto_first ||
+                opcode == REOP_loop_split_goto_first ||
+                opcode == REOP_loop_check_adv_split_goto_first) {
+                const uint8_t *pc1 = pc_a;
+                pc_a = pc_b;
+                pc_b = pc1;
+            }
+            entry = lre_find_onepass_entry(bc_buf, pc - bc_start);
+            if (!entry)
+                return ONEPASS_RET_UNKNOWN;
+            flags = entry[2];
+            if (empty_only) {
+                /* at most one branch can match without consuming */
+                if (flags & RE_ONEPASS_NULL_A)
+                    pc = pc_a;
+                else if (flags & RE_ONEPASS_NULL_B)
+                    pc = pc_b;
+                else
+                    goto fail;
+                goto epsilon;
+            }
+            in_a = in_b = FALSE;
+            if (cptr < s->cbuf_end) {
+                PEEK_CHAR(c, cptr, s->cbuf_end, s->cbuf_type);
+                if (c < 256) {
+                    in_a = (entry[3 + (c >> 3)] >> (c & 7)) & 1;
+                    in_b = (entry[35 + (c >> 3)] >> (c & 7)) & 1;
+                } else {
+                    in_a = (flags & RE_ONEPASS_WIDE_A) != 0;
+                    in_b = (flags & RE_ONEPASS_WIDE_B) != 0;
+                    if (in_a && in_b)
+                        return ONEPASS_RET_UNKNOWN;
                 }
             }
-            break;
-        case REOP_range:
-        case REOP_range_i:
-            {
-                int n;
-                uint32_t low, high, idx_min, idx_max, idx;
-
-                n = get_u16(pc); /* n must be >= 1 */
-                pc += 2;
-                if (cptr >= cbuf_end)
-                    goto no_match;
-                GET_CHAR(c, cptr, cbuf_end, cbuf_type);
-                if (opcode == REOP_range_i) {
-                    c = lre_canonicalize(c, s->is_unicode);
+            if (in_a) {
+                if (flags & RE_ONEPASS_NULL_B) {
+                    /* the backtracking would try it if 'a' fails */
+                    memcpy(tmp, capture, sizeof(tmp[0]) * alloc_count);
+                    ret = lre_exec_onepass(s, tmp, bc_buf, pc_b, cptr, TRUE);
+                    if (ret < 0)
+                        return ret;
+                    if (ret == 1) {
+                        memcpy(cand, tmp, sizeof(cand[0]) * reg_start);
+                        has_cand = TRUE;
+                    }
                 }
-                idx_min = 0;
-                low = get_u16(pc + 0 * 4);
-                if (c < low)
-                    goto no_match;
-                idx_max = n - 1;
-                high = get_u16(pc + idx_max * 4 + 2);
-                /* 0xffff in for last value means +infinity */
-                if (unlikely(c >= 0xffff) && high == 0xffff)
-                    goto range_match;
-                if (c > high)
-                    goto no_match;
-                while (idx_min <= idx_max) {
-                    idx = (idx_min + idx_max) / 2;
-                    low = get_u16(pc + idx * 4);
-                    high = get_u16(pc + idx * 4 + 2);
-                    if (c < low)
-                        idx_max = idx - 1;
-                    else if (c > high)
-                        idx_min = idx + 1;
-                    else
-                        goto range_match;
+                pc = pc_a;
+            } else {
+                if (flags & RE_ONEPASS_NULL_A) {
+                    memcpy(tmp, capture, sizeof(tmp[0]) * alloc_count);
+                    ret = lre_exec_onepass(s, tmp, bc_buf, pc_a, cptr, TRUE);
+                    if (ret < 0)
+                        return ret;
+                    if (ret == 1) {
+                        memcpy(capture, tmp, sizeof(tmp[0]) * reg_start);
+                        return 1;
+                    }
                 }
-                goto no_match;
-            range_match:
-                pc += 4 * n;
+                if (!in_b && !(flags & RE_ONEPASS_NULL_B))
+                    goto fail;
+                pc = pc_b;
             }
+        epsilon:
+            if (++steps > steps_max)
+                return ONEPASS_RET_UNKNOWN;
+            if (lre_poll_timeout(s))
+                return LRE_RET_TIMEOUT;
             break;
-        case REOP_range32:
-        case REOP_range32_i:
-            {
-                int n;
-                uint32_t low, high, idx_min, idx_max, idx;
+        default:
+            return ONEPASS_RET_UNKNOWN;
+        }
+    }
+ fail:
+    if (has_cand) {
+        memcpy(capture, cand, sizeof(cand[0]) * reg_start);
+        return 1;
+    }
+    return 0;
+}
 
-                n = get_u16(pc); /* n must be >= 1 */
-                pc += 2;
-                if (cptr >= cbuf_end)
-                    goto no_match;
-                GET_CHAR(c, cptr, cbuf_end, cbuf_type);
-                if (opcode == REOP_range32_i) {
-                    c = lre_canonicalize(c, s->is_unicode);
-                }
-                idx_min = 0;
-                low = get_u32(pc + 0 * 8);
-                if (c < low)
-                    goto no_match;
-                idx_max = n - 1;
-                high = get_u32(pc + idx_max * 8 + 4);
-                if (c > high)
-                    goto no_match;
-                while (idx_min <= idx_max) {
-                    idx = (idx_min + idx_max) / 2;
-                    low = get_u32(pc + idx * 8);
-                    high = get_u32(pc + idx * 8 + 4);
-                    if (c < low)
-                        idx_max = idx - 1;
-                    else if (c > high)
-                        idx_min = idx + 1;
-                    else
-                        goto range32_match;
-                }
-                goto no_match;
-            range32_match:
-                pc += 8 * n;
+/* above this length, the lazy DFA is faster */
+#define GLUSHKOV_INPUT_LEN_MAX 512
+
+typedef struct {
+    const uint8_t *bc_buf;
+    const uint8_t *bc_start; /* bytecode */
+    int npos;
+    int match_flags;
+    uint64_t first_any;
+    uint64_t first_bol;
+    uint64_t last_any;
+    uint64_t last_end;
+    const uint8_t *pos_pc;
+    const uint8_t *class_map;
+    const uint8_t *class_masks;
+    const uint8_t *follow_tab;
+    /* same as 'follow_tab' for the predecessors */
+    uint64_t pred_tab[RE_GLUSHKOV_POS_MAX / 4][16];
+} GlushkovContext;
+
+static void glushkov_init(GlushkovContext *g, const uint8_t *bc_buf,
+                          BOOL with_pred)
+{
+    const uint8_t *tab;
+    uint64_t pred[RE_GLUSHKOV_POS_MAX], m;
+    int i, npos;
+
+    tab = lre_get_glushkov(bc_buf);
+    npos = bc_buf[RE_HEADER_GLUSHKOV_LEN] - 1;
+    g->bc_buf = bc_buf;
+    g->bc_start = bc_buf + RE_HEADER_LEN;
+    g->npos = npos;
+    g->match_flags = tab[RE_GLUSHKOV_FLAGS];
+    g->first_any = get_u64(tab + RE_GLUSHKOV_FIRST_ANY);
+    g->first_bol = get_u64(tab + RE_GLUSHKOV_FIRST_BOL);
+    g->last_any = get_u64(tab + RE_GLUSHKOV_LAST_ANY);
+    g->last_end = get_u64(tab + RE_GLUSHKOV_LAST_END);
+    g->follow_tab = tab + RE_GLUSHKOV_FOLLOW;
+    g->pos_pc = g->follow_tab + (npos + 3) / 4 * 16 * 8;
+    g->class_map = g->pos_pc + npos * 2;
+    g->class_masks = g->class_map + 256;
+    if (with_pred) {
+        memset(pred, 0, sizeof(pred[0]) * npos);
+        for(i = 0; i < npos; i++) {
+            /* follow mask of the position i */
+            m = get_u64(g->follow_tab + ((i >> 2) * 16 + (1 << (i & 3))) * 8);
+            for(; m != 0; m &= m - 1)
+                pred[ctz64(m)] |= (uint64_t)1 << i;
+        }
+        glushkov_build_tab(g->pred_tab, pred, npos);
+    }
+}
+
+/* return the union of the masks of 'tab' for the positions of 'd' */
+static inline uint64_t glushkov_next(const uint8_t *tab, uint64_t d)
+{
+    uint64_t r;
+
+    r = 0;
+    for(; d != 0; tab += 16 * 8, d >>= 4)
+        r |= get_u64(tab + (d & 15) * 8);
+    return r;
+}
+
+/* return the mask of the positions accepting the char 'c' */
+static inline uint64_t glushkov_char_mask(REExecContext *s,
+                                          GlushkovContext *g, uint32_t c)
+{
+    uint64_t mask;
+    int i;
+
+    if (c < 256)
+        return get_u64(g->class_masks + g->class_map[c] * 8);
+    mask = 0;
+    for(i = 0; i < g->npos; i++) {
+        if (re_first_op_accepts(g->bc_start + get_u16(g->pos_pc + i * 2), c))
+            mask |= (uint64_t)1 << i;
+    }
+    return mask;
+}
+
+/* return TRUE if the regexp matches the empty string at 'cptr' */
+static BOOL glushkov_empty_match(REExecContext *s, GlushkovContext *g,
+                                 const uint8_t *cptr)
+{
+    int flags = g->match_flags;
+    if (cptr != s->cbuf)
+        flags &= ~(RE_GLUSHKOV_EMPTY_BOL | RE_GLUSHKOV_EMPTY_BOL_EOL);
+    if (cptr != s->cbuf_end)
+        flags &= ~(RE_GLUSHKOV_EMPTY_EOL | RE_GLUSHKOV_EMPTY_BOL_EOL);
+    return flags != 0;
+}
+
+/* Tell if a match starts at or after 'cptr' ('sticky' = FALSE) or at
+   'cptr' by advancing the set of the positions reached by the
+   matches for each char. If 'pend' is not NULL, the matches in
+   progress are advanced after the first match end without starting
+   new ones and '*pend' is set to the last match end, so that all the
+   matches starting before the first match end end before it. Return
+   1 if match, 0 if not match or < 0 if error. */
+static int lre_exec_glushkov(REExecContext *s, GlushkovContext *g,
+                             const uint8_t *cptr, BOOL sticky,
+                             const uint8_t **pend)
+{
+    const uint8_t *cptr_start = cptr, *end;
+    uint64_t d, start_mask;
+    uint32_t c;
+    int search_mode;
+    BOOL can_start;
+
+    search_mode = g->bc_buf[RE_HEADER_SEARCH_MODE];
+    /* the matches can only start at the beginning of the input */
+    if (search_mode == RE_SEARCH_ANCHORED ||
+        (g->first_any == 0 &&
+         !(g->match_flags & (RE_GLUSHKOV_EMPTY_ANY | RE_GLUSHKOV_EMPTY_EOL))))
+        sticky = TRUE;
+    d = 0;
+    end = NULL;
+    for(;;) {
+        if (d == 0 && !sticky && !end && search_mode != RE_SEARCH_LOOP) {
+            /* no match in progress: skip to the next possible start */
+            if (search_mode == RE_SEARCH_PREFIX) {
+                cptr = lre_find_prefix(s, g->bc_start +
+                                       get_u32(g->bc_buf + RE_HEADER_BYTECODE_LEN),
+                                       g->bc_buf[RE_HEADER_PREFIX_LEN], cptr);
+            } else if (search_mode == RE_SEARCH_LINE_START) {
+                cptr = lre_find_line_start(s, cptr);
+            } else {
+                cptr = lre_find_first_char(s, g->bc_buf, cptr);
             }
+            if (!cptr)
+                return 0;
+        }
+        can_start = (!end && (!sticky || cptr == cptr_start));
+        if (can_start && glushkov_empty_match(s, g, cptr)) {
+            if (!pend)
+                return 1;
+            end = cptr;
+            can_start = FALSE;
+        }
+        if (cptr >= s->cbuf_end || (!can_start && d == 0))
             break;
-        case REOP_prev:
-            /* go to the previous char */
+        start_mask = 0;
+        if (can_start) {
+            start_mask = g->first_any;
             if (cptr == s->cbuf)
-                goto no_match;
-            PREV_CHAR(cptr, s->cbuf, cbuf_type);
-            break;
-        default:
-#ifdef DUMP_EXEC
-            printf("unknown opcode pc=%ld\n", pc - 1 - pc_start);
-#endif            
-            abort();
+                start_mask |= g->first_bol;
+        }
+        GET_CHAR(c, cptr, s->cbuf_end, s->cbuf_type);
+        d = (glushkov_next(g->follow_tab, d) | start_mask) &
+            glushkov_char_mask(s, g, c);
+        if ((d & g->last_any) != 0 ||
+            ((d & g->last_end) != 0 && cptr == s->cbuf_end)) {
+            if (!pend)
+                return 1;
+            end = cptr;
         }
+        if (lre_poll_timeout(s))
+            return LRE_RET_TIMEOUT;
     }
+    if (!end)
+        return 0;
+    *pend = end;
+    return 1;
 }
 
-/* Return 1 if match, 0 if not match or < 0 if error (see LRE_RET_x). cindex is the
-   starting position of the match and must be such as 0 <= cindex <=
-   clen. */
-int lre_exec(uint8_t **capture,
-             const uint8_t *bc_buf, const uint8_t *cbuf, int cindex, int clen,
-             int cbuf_type, void *opaque)
+/* Same as lre_exec_glushkov() but the start of the leftmost match is
+   returned in '*pstart'. The positions which can reach the end of a
+   match are computed backward from the last end of the matches which
+   start before the first match end. */
+static int lre_exec_glushkov_start(REExecContext *s, GlushkovContext *g,
+                                   const uint8_t **pstart,
+                                   const uint8_t *cptr, BOOL sticky)
 {
-    REExecContext s_s, *s = &s_s;
-    int re_flags, i, ret;
+    const uint8_t *ptr, *ptr_next, *end;
+    uint64_t r, end_mask;
+    uint32_t c;
+    int ret;
+
+    *pstart = cptr;
+    if (sticky)
+        return lre_exec_glushkov(s, g, cptr, sticky, NULL);
+    ret = lre_exec_glushkov(s, g, cptr, sticky, &end);
+    if (ret != 1)
+        return ret;
+    ptr = end;
+    r = 0;
+    for(;;) {
+        if (glushkov_empty_match(s, g, ptr) ||
+            (r & (g->first_any | (ptr == s->cbuf ? g->first_bol : 0))) != 0)
+            *pstart = ptr;
+        if (ptr <= cptr)
+            break;
+        ptr_next = ptr;
+        GET_PREV_CHAR(c, ptr, s->cbuf, s->cbuf_type);
+        end_mask = g->last_any;
+        if (ptr_next == s->cbuf_end)
+            end_mask |= g->last_end;
+        r = (glushkov_next((const uint8_t *)g->pred_tab, r) | end_mask) &
+            glushkov_char_mask(s, g, c);
+        if (lre_poll_timeout(s))
+            return LRE_RET_TIMEOUT;
+    }
+    return 1;
+}
+
+/* initialize 's' and return the start position. The stack kept in
+   'stack' is used if not NULL. */
+static const uint8_t *lre_exec_init(REExecContext *s, LREStack *stack,
+                                    const uint8_t *bc_buf,
+                                    const uint8_t *cbuf, int cindex, int clen,
+                                    int cbuf_type, void *opaque)
+{
+    int re_flags;
     const uint8_t *cptr;
 
     re_flags = lre_get_flags(bc_buf);
     s->is_unicode = (re_flags & (LRE_FLAG_UNICODE | LRE_FLAG_UNICODE_SETS)) != 0;
     s->capture_count = bc_buf[RE_HEADER_CAPTURE_COUNT];
     s->cbuf = cbuf;
-    s->cbuf_end = cbuf + (clen << cbuf_type);
+    s->cbuf_end = cbuf + (clen << CBUF_SHIFT(cbuf_type));
     s->cbuf_type = cbuf_type;
     if (s->cbuf_type == 1 && s->is_unicode)
         s->cbuf_type = 2;
     s->interrupt_counter = INTERRUPT_COUNTER_INIT;
     s->opaque = opaque;
+    s->save_captures = TRUE;
+    s->jit = NULL;
+    s->next_lf = NULL;
+    s->memo = NULL;
+    s->memo_index = NULL;
+    s->memo_steps = 0;
+
+    s->stack = stack;
+    if (stack && stack->buf) {
+        s->stack_buf = stack->buf;
+        s->stack_size = stack->size;
+    } else {
+        s->stack_buf = s->static_stack_buf;
+        s->stack_size = countof(s->static_stack_buf);
+    }
 
-    s->stack_buf = s->static_stack_buf;
-    s->stack_size = countof(s->static_stack_buf);
-
-    for(i = 0; i < s->capture_count * 2; i++)
-        capture[i] = NULL;
-
-    cptr = cbuf + (cindex << cbuf_type);
+    cptr = cbuf + (cindex << CBUF_SHIFT(cbuf_type));
     if (0 < cindex && cindex < clen && s->cbuf_type == 2) {
         const uint16_t *p = (const uint16_t *)cptr;
         if (is_lo_surrogate(*p) && is_hi_surrogate(p[-1])) {
             cptr = (const uint8_t *)(p - 1);
         }
+    } else if (0 < cindex && cindex < clen && s->cbuf_type == 3) {
+        /* go to the start of the UTF-8 sequence */
+        while ((*cptr & 0xc0) == 0x80)
+            cptr--;
+    }
+    return cptr;
+}
+
+/* Return 1 if match, 0 if not match or < 0 if error (see LRE_RET_x). cindex is the
+   starting position of the match and must be such as 0 <= cindex <=
+   clen. 'cbuf_type' is 0 for 8 bit chars, 1 for 16 bit chars and 3
+   for a valid UTF-8 string whose length and positions are in bytes.
+   Without the unicode flags, the UTF-8 string must only contain BMP
+   chars so that the chars are the UTF-16 code units. */
+int lre_exec(uint8_t **capture,
+             const uint8_t *bc_buf, const uint8_t *cbuf, int cindex, int clen,
+             int cbuf_type, void *opaque)
+{
+    return lre_exec_jit(NULL, NULL, capture, bc_buf, cbuf, cindex, clen,
+                        cbuf_type, opaque);
+}
+
+/* Common part of lre_exec_jit(), lre_exec_test() and
+   lre_exec_index(). If 'save_captures' is FALSE, only capture[0] and
+   capture[1] are set, unless the captures are needed by back
+   references. */
+static int lre_exec_internal(const LREJit *jit, LREStack *stack,
+                             uint8_t **capture, const uint8_t *bc_buf,
+                             const uint8_t *cbuf, int cindex, int clen,
+                             int cbuf_type, BOOL save_captures, void *opaque)
+{
+    REExecContext s_s, *s = &s_s;
+    int i, ret;
+    const uint8_t *cptr;
+
+    cptr = lre_exec_init(s, stack, bc_buf, cbuf, cindex, clen, cbuf_type,
+                         opaque);
+    s->save_captures = save_captures || bc_buf[RE_HEADER_BACK_REFS] != 0;
+#ifdef CONFIG_JIT
+    if (jit && jit->bc_buf == bc_buf)
+        s->jit = jit;
+#endif
+    for(i = 0; i < s->capture_count * 2; i++)
+        capture[i] = NULL;
+
+    ret = ONEPASS_RET_UNKNOWN;
+    if (bc_buf[RE_HEADER_REQUIRED_LEN] != 0 &&
+        !lre_has_required(s, bc_buf, cptr)) {
+        ret = 0;
+    } else if (bc_buf[RE_HEADER_ONEPASS_LEN] != 0) {
+        if (lre_get_flags(bc_buf) & LRE_FLAG_STICKY) {
+            ret = lre_exec_onepass(s, capture, bc_buf,
+                                   bc_buf + RE_HEADER_LEN, cptr, FALSE);
+        } else if (cptr == s->cbuf) {
+            ret = lre_exec_onepass(s, capture, bc_buf, bc_buf +
+                                   RE_HEADER_LEN + RE_SEARCH_LOOP_LEN,
+                                   cptr, FALSE);
+        } else {
+            /* anchored at the start of the input */
+            ret = 0;
+        }
+    }
+
+    if (ret == ONEPASS_RET_UNKNOWN) {
+        for(i = 0; i < s->capture_count * 2; i++)
+            capture[i] = NULL;
+        if (lre_get_flags(bc_buf) & LRE_FLAG_LINEAR) {
+            ret = lre_exec_pike(s, capture, bc_buf, cptr);
+        } else {
+            if (bc_buf[RE_HEADER_MEMO] != 0)
+                lre_memo_init(s, bc_buf, cptr);
+            if (bc_buf[RE_HEADER_SEARCH_MODE] != RE_SEARCH_LOOP)
+                ret = lre_exec_search(s, capture, bc_buf, cptr);
+            else
+                ret = lre_exec_backtrack(s, capture, bc_buf + RE_HEADER_LEN,
+                                         cptr);
+        }
+    }
+
+    if (s->stack_buf != s->static_stack_buf) {
+        if (s->stack &&
+            s->stack_size * sizeof(StackElem) <= s->stack->size_max) {
+            s->stack->buf = s->stack_buf;
+            s->stack->size = s->stack_size;
+        } else {
+            lre_realloc(s->opaque, s->stack_buf, 0);
+            if (s->stack)
+                s->stack->buf = NULL;
+        }
+    }
+    lre_memo_free(s);
+    return ret;
+}
+
+/* Same as lre_exec() but the backtracking uses the native code 'jit'
+   returned by lre_jit_compile() for 'bc_buf' if not NULL. If 'stack'
+   is not NULL, the backtracking stack is allocated from it and kept
+   in it for the next calls. */
+int lre_exec_jit(const LREJit *jit, LREStack *stack, uint8_t **capture,
+                 const uint8_t *bc_buf, const uint8_t *cbuf, int cindex,
+                 int clen, int cbuf_type, void *opaque)
+{
+    return lre_exec_internal(jit, stack, capture, bc_buf, cbuf, cindex, clen,
+                             cbuf_type, TRUE, opaque);
+}
+
+/* Same as lre_exec() but the captures are not returned. The Glushkov
+   automaton or the lazy DFA are used if possible so that the
+   execution time is linear. They read every char, so they are not
+   used when the interpreter only runs at the positions of a literal
+   prefix or of a line start. With counted loops (RE_DFA_APPROX), the
+   DFA accepts more strings than the regexp: it only rejects the
+   inputs quickly, and an input it accepts is read again by the
+   Glushkov automaton or the interpreter. */
+int lre_exec_test(LREStack *stack, const uint8_t *bc_buf, const uint8_t *cbuf,
+                  int cindex, int clen, int cbuf_type, void *opaque)
+{
+    REExecContext s_s, *s = &s_s;
+    uint8_t *capture[CAPTURE_COUNT_MAX * 2 + REGISTER_COUNT_MAX];
+    GlushkovContext g_s;
+    const uint8_t *cptr;
+    int ret, search_mode;
+
+    search_mode = bc_buf[RE_HEADER_SEARCH_MODE];
+    if (bc_buf[RE_HEADER_DFA_MODE] != RE_DFA_NONE &&
+        (search_mode == RE_SEARCH_LOOP ||
+         search_mode == RE_SEARCH_FIRST_CHARS) &&
+        (clen - cindex >= DFA_INPUT_LEN_MIN ||
+         bc_buf[RE_HEADER_GLUSHKOV_LEN] != 0)) {
+        cptr = lre_exec_init(s, NULL, bc_buf, cbuf, cindex, clen, cbuf_type,
+                             opaque);
+        if (bc_buf[RE_HEADER_REQUIRED_LEN] != 0 &&
+            !lre_has_required(s, bc_buf, cptr))
+            return 0;
+        /* no match can start before the first possible first char */
+        if (search_mode == RE_SEARCH_FIRST_CHARS) {
+            cptr = lre_find_first_char(s, bc_buf, cptr);
+            if (!cptr)
+                return 0;
+        }
+        if (clen - cindex >= DFA_INPUT_LEN_MIN &&
+            !(bc_buf[RE_HEADER_GLUSHKOV_LEN] != 0 &&
+              clen - cindex < GLUSHKOV_INPUT_LEN_MAX)) {
+            ret = lre_exec_dfa(s, stack, bc_buf, cptr);
+            /* an approximate DFA can only tell that there is no match */
+            if (ret != DFA_RET_UNKNOWN &&
+                !(ret == 1 && bc_buf[RE_HEADER_DFA_MODE] == RE_DFA_APPROX))
+                return ret;
+        }
+        if (bc_buf[RE_HEADER_GLUSHKOV_LEN] != 0) {
+            glushkov_init(&g_s, bc_buf, FALSE);
+            return lre_exec_glushkov(s, &g_s, cptr,
+                                     (lre_get_flags(bc_buf) & LRE_FLAG_STICKY) != 0,
+                                     NULL);
+        }
     }
+    return lre_exec_internal(NULL, stack, capture, bc_buf, cbuf, cindex, clen,
+                             cbuf_type, FALSE, opaque);
+}
 
-    ret = lre_exec_backtrack(s, capture, bc_buf + RE_HEADER_LEN, cptr);
+/* Same as lre_exec() but only the start of the match is returned in
+   '*pindex' and its end in '*pend' if 'pend' is not NULL. */
+int lre_exec_index(LREStack *stack, int *pindex, int *pend,
+                   const uint8_t *bc_buf, const uint8_t *cbuf, int cindex,
+                   int clen, int cbuf_type, void *opaque)
+{
+    REExecContext s_s, *s = &s_s;
+    uint8_t *capture[CAPTURE_COUNT_MAX * 2 + REGISTER_COUNT_MAX];
+    GlushkovContext g_s;
+    const uint8_t *cptr, *start;
+    int ret;
 
-    if (s->stack_buf != s->static_stack_buf)
-        lre_realloc(s->opaque, s->stack_buf, 0);
+    /* the Glushkov automaton only finds the start of the match */
+    if (bc_buf[RE_HEADER_GLUSHKOV_LEN] != 0 && !pend) {
+        cptr = lre_exec_init(s, NULL, bc_buf, cbuf, cindex, clen, cbuf_type,
+                             opaque);
+        if (bc_buf[RE_HEADER_REQUIRED_LEN] != 0 &&
+            !lre_has_required(s, bc_buf, cptr))
+            return 0;
+        glushkov_init(&g_s, bc_buf, TRUE);
+        ret = lre_exec_glushkov_start(s, &g_s, &start, cptr,
+                                      (lre_get_flags(bc_buf) & LRE_FLAG_STICKY) != 0);
+    } else {
+        ret = lre_exec_internal(NULL, stack, capture, bc_buf, cbuf, cindex,
+                                clen, cbuf_type, FALSE, opaque);
+        start = capture[0];
+        if (ret == 1 && pend)
+            *pend = (capture[1] - cbuf) >> CBUF_SHIFT(cbuf_type);
+    }
+    if (ret == 1)
+        *pindex = (start - cbuf) >> CBUF_SHIFT(cbuf_type);
     return ret;
 }
 
+/* Return a backtracking stack which can be passed to the lre_exec
+   functions so that its allocation is reused between the calls. The
+   stacks larger than 'size_max' bytes are freed at the end of the
+   call. The kept stack is only passed to lre_check_stack_overflow()
+   when it grows, so it should not be used if the stack size is
+   limited. It also keeps the lazy DFA states of lre_exec_test() (up
+   to 'size_max' bytes) for the last bytecode it was used with, so it
+   must be freed with that bytecode. Return NULL if memory error. */
+LREStack *lre_stack_new(size_t size_max, void *opaque)
+{
+    LREStack *stack;
+
+    stack = lre_realloc(opaque, NULL, sizeof(*stack));
+    if (!stack)
+        return NULL;
+    stack->buf = NULL;
+    stack->size = 0;
+    stack->size_max = size_max;
+    stack->dfa = NULL;
+    return stack;
+}
+
+void lre_stack_free(LREStack *stack, void *opaque)
+{
+    if (!stack)
+        return;
+    if (stack->buf)
+        lre_realloc(opaque, stack->buf, 0);
+    if (stack->dfa)
+        dfa_free(stack->dfa, opaque);
+    lre_realloc(opaque, stack, 0);
+}
+
+/* length of the prefix, required literal, one-pass table and
+   Glushkov automaton stored after the bytecode */
+static int lre_get_trailer_len(const uint8_t *bc_buf)
+{
+    const uint8_t *tab;
+    int npos;
+
+    tab = lre_get_glushkov(bc_buf);
+    if (bc_buf[RE_HEADER_GLUSHKOV_LEN] != 0) {
+        npos = bc_buf[RE_HEADER_GLUSHKOV_LEN] - 1;
+        tab += RE_GLUSHKOV_FOLLOW + (npos + 3) / 4 * 16 * 8 + npos * 2 +
+            256 + get_u16(tab + RE_GLUSHKOV_CLASS_COUNT) * 8;
+    }
+    return tab - (bc_buf + RE_HEADER_LEN) -
+        get_u32(bc_buf + RE_HEADER_BYTECODE_LEN);
+}
+
 int lre_get_alloc_count(const uint8_t *bc_buf)
 {
     return bc_buf[RE_HEADER_CAPTURE_COUNT] * 2 +
@@ -3387,7 +8803,8 @@ const char *lre_get_groupnames(const uint8_t *bc_buf)
     if ((lre_get_flags(bc_buf) & LRE_FLAG_NAMED_GROUPS) == 0)
         return NULL;
     re_bytecode_len = get_u32(bc_buf + RE_HEADER_BYTECODE_LEN);
-    return (const char *)(bc_buf + RE_HEADER_LEN + re_bytecode_len);
+    return (const char *)(bc_buf + RE_HEADER_LEN + re_bytecode_len +
+                          lre_get_trailer_len(bc_buf));
 }
 
 #ifdef TEST
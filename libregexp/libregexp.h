@@ -36,10 +36,14 @@
 #define LRE_FLAG_INDICES    (1 << 6) /* Unused by libregexp, just recorded. */
 #define LRE_FLAG_NAMED_GROUPS (1 << 7) /* named groups are present in the regexp */
 #define LRE_FLAG_UNICODE_SETS (1 << 8)
+#define LRE_FLAG_LINEAR     (1 << 9) /* run in linear time with a Pike VM */
 
 #define LRE_RET_MEMORY_ERROR (-1)
 #define LRE_RET_TIMEOUT      (-2)
 
+typedef struct LREJit LREJit;
+typedef struct LREStack LREStack;
+
 /* trailer length after the group name including the trailing '\0' */
 #define LRE_GROUP_NAME_TRAILER_LEN 2 
 
@@ -53,10 +57,26 @@ const char *lre_get_groupnames(const uint8_t *bc_buf);
 int lre_exec(uint8_t **capture,
              const uint8_t *bc_buf, const uint8_t *cbuf, int cindex, int clen,
              int cbuf_type, void *opaque);
+int lre_exec_jit(const LREJit *jit, LREStack *stack, uint8_t **capture,
+                 const uint8_t *bc_buf, const uint8_t *cbuf, int cindex,
+                 int clen, int cbuf_type, void *opaque);
+int lre_exec_test(LREStack *stack, const uint8_t *bc_buf, const uint8_t *cbuf,
+                  int cindex, int clen, int cbuf_type, void *opaque);
+int lre_exec_index(LREStack *stack, int *pindex, int *pend,
+                   const uint8_t *bc_buf, const uint8_t *cbuf, int cindex,
+                   int clen, int cbuf_type, void *opaque);
+
+LREStack *lre_stack_new(size_t size_max, void *opaque);
+void lre_stack_free(LREStack *stack, void *opaque);
+
+LREJit *lre_jit_compile(const uint8_t *bc_buf, void *opaque);
+void lre_jit_free(LREJit *jit, void *opaque);
 
 int lre_parse_escape(const uint8_t **pp, int allow_utf16);
 
-/* must be provided by the user, return non zero if overflow */
+/* must be provided by the user, return non zero if overflow. During
+   the execution, it is also called with the new size in bytes of the
+   backtracking stack before it grows. */
 int lre_check_stack_overflow(void *opaque, size_t alloca_size);
 /* must be provided by the user, return non zero if time out */
 int lre_check_timeout(void *opaque);
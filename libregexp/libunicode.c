@@ -237,6 +237,14 @@ int lre_canonicalize(uint32_t c, BOOL is_unicode)
                 c = c - 'a' + 'A';
             }
         }
+#ifdef CONFIG_CASE_CANON_TABLE
+    } else if (c <= 0xffff) {
+        /* 32 entry blocks of 16 bit deltas, shared between the
+           unicode and legacy indexes */
+        uint32_t b;
+        b = case_canon_index[((is_unicode != 0) << 11) | (c >> 5)];
+        c = (c + case_canon_table[(b << 5) | (c & 0x1f)]) & 0xffff;
+#endif
     } else {
         uint32_t v, code, len;
         int idx, idx_min, idx_max;
@@ -741,6 +749,132 @@ int cr_regexp_canonicalize(CharRange *cr, BOOL is_unicode)
     return -1;
 }
 
+/* return TRUE if 'cr' contains a char in [c1, c2) */
+static BOOL cr_intersects(const CharRange *cr, uint32_t c1, uint32_t c2)
+{
+    int lo, hi, mid;
+    lo = 0;
+    hi = cr->len;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cr->points[mid] <= c1)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo & 1) || (lo < cr->len && cr->points[lo] < c2);
+}
+
+/* add the char 'c' which is larger than the chars already in 'cr' */
+static int cr_append_char(CharRange *cr, uint32_t c)
+{
+    if (cr->len != 0 && cr->points[cr->len - 1] == c) {
+        cr->points[cr->len - 1] = c + 1;
+        return 0;
+    }
+    return cr_add_interval(cr, c, c + 1);
+}
+
+/* return TRUE if the chars of the case conversion run 'idx' and their
+   case conversions are all outside 'cr' */
+static BOOL cr_case_run_outside(const CharRange *cr, uint32_t idx)
+{
+    uint32_t v, code, len, type, base;
+
+    v = case_conv_table1[idx];
+    code = v >> (32 - 17);
+    len = (v >> (32 - 17 - 7)) & 0x7f;
+    type = (v >> (32 - 17 - 7 - 4)) & 0xf;
+    if (cr_intersects(cr, code, code + len))
+        return FALSE;
+    if (type == RUN_TYPE_UL || type == RUN_TYPE_LSU)
+        return TRUE;
+    if (type <= RUN_TYPE_LF) {
+        base = case_conv_table1[((v & 0xf) << 8) | case_conv_table2[idx]] >> (32 - 17);
+        return !cr_intersects(cr, base, base + len);
+    }
+    return FALSE;
+}
+
+/* transform a canonicalized character set (see
+   cr_regexp_canonicalize()) into the set of the characters whose
+   canonical form is in it, so that it can be matched without
+   canonicalizing the input */
+int cr_regexp_case_closure(CharRange *cr, BOOL is_unicode)
+{
+    CharRange cr_add, cr_sub;
+    uint32_t v, code, len, idx, c, d;
+
+    cr_init(&cr_add, cr->mem_opaque, cr->realloc_func);
+    cr_init(&cr_sub, cr->mem_opaque, cr->realloc_func);
+    for(idx = 0; idx < countof(case_conv_table1); idx++) {
+        if (cr_case_run_outside(cr, idx))
+            continue;
+        v = case_conv_table1[idx];
+        code = v >> (32 - 17);
+        len = (v >> (32 - 17 - 7)) & 0x7f;
+        for(c = code; c < code + len; c++) {
+            d = lre_case_folding_entry(c, idx, v, is_unicode);
+            if (d == c)
+                continue;
+            if (cr_intersects(cr, d, d + 1)) {
+                if (cr_append_char(&cr_add, c))
+                    goto fail;
+            } else if (cr_intersects(cr, c, c + 1)) {
+                /* not canonical: cannot match */
+                if (cr_append_char(&cr_sub, c))
+                    goto fail;
+            }
+        }
+    }
+    if (cr_op1(cr, cr_add.points, cr_add.len, CR_OP_UNION))
+        goto fail;
+    if (cr_op1(cr, cr_sub.points, cr_sub.len, CR_OP_SUB))
+        goto fail;
+    cr_free(&cr_add);
+    cr_free(&cr_sub);
+    return 0;
+ fail:
+    cr_free(&cr_add);
+    cr_free(&cr_sub);
+    return -1;
+}
+
+/* For each char c < 256, store in tab[2 * c] and tab[2 * c + 1] the
+   chars different from c whose canonical form is c, or 0. This is
+   the same as cr_regexp_case_closure() for all the Latin-1 chars at
+   once. Return -1 if a char has more than two of them. */
+int lre_case_variants_latin1(uint32_t *tab, BOOL is_unicode)
+{
+    uint32_t latin1_points[2] = { 0, 256 };
+    CharRange cr_latin1;
+    uint32_t v, code, len, idx, c, d;
+
+    memset(&cr_latin1, 0, sizeof(cr_latin1));
+    cr_latin1.len = 2;
+    cr_latin1.points = latin1_points;
+    memset(tab, 0, sizeof(tab[0]) * 256 * 2);
+    for(idx = 0; idx < countof(case_conv_table1); idx++) {
+        if (cr_case_run_outside(&cr_latin1, idx))
+            continue;
+        v = case_conv_table1[idx];
+        code = v >> (32 - 17);
+        len = (v >> (32 - 17 - 7)) & 0x7f;
+        for(c = code; c < code + len; c++) {
+            d = lre_case_folding_entry(c, idx, v, is_unicode);
+            if (d == c || d >= 256)
+                continue;
+            if (tab[2 * d] == 0)
+                tab[2 * d] = c;
+            else if (tab[2 * d + 1] == 0)
+                tab[2 * d + 1] = c;
+            else
+                return -1;
+        }
+    }
+    return 0;
+}
+
 #ifdef CONFIG_ALL_UNICODE
 
 BOOL lre_is_id_start(uint32_t c)
@@ -34,6 +34,16 @@
 /* define it to include all the unicode tables (40KB larger) */
 #define CONFIG_ALL_UNICODE
 
+/* define it to canonicalize BMP code points with a two-level table
+   lookup (11.5KB larger) instead of a binary search in the case
+   conversion table. Case insensitive matching of non-ASCII text calls
+   lre_canonicalize() for every character it compares. The table is
+   generated by case_canon_gen.c, which is built with
+   LRE_NO_CASE_CANON_TABLE (see 'make case_canon_table'). */
+#ifndef LRE_NO_CASE_CANON_TABLE
+#define CONFIG_CASE_CANON_TABLE
+#endif
+
 #define LRE_CC_RES_LEN_MAX 3
 
 /* char ranges */
@@ -94,6 +104,8 @@ static inline int cr_union_interval(CharRange *cr, uint32_t c1, uint32_t c2)
 int cr_invert(CharRange *cr);
 
 int cr_regexp_canonicalize(CharRange *cr, int is_unicode);
+int cr_regexp_case_closure(CharRange *cr, int is_unicode);
+int lre_case_variants_latin1(uint32_t *tab, int is_unicode);
 
 typedef enum {
     UNICODE_NFC,
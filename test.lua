@@ -37,7 +37,7 @@ local function test_exec(str, regex, flags, want)
 	for _, match_wanted in ipairs(want) do
 		local match = r:exec(str)
 		if match and not match_wanted then
-			return fail(string.format("no match expected, got %s", match))
+			return fail(string.format("no match expected, got %s", tostring(match)))
 		end
 		if not match then
 			return fail(string.format("match expected, wanted %s", match_wanted))
@@ -48,6 +48,13 @@ local function test_exec(str, regex, flags, want)
 		if match_wanted[0] ~= match[0] then
 			return fail(string.format("global mismatch, wanted: %s, got: %s", match_wanted[0], match[0]))
 		end
+		if match.input ~= str then
+			return fail(string.format("input mismatch, wanted: %s, got: %s", str, match.input))
+		end
+		local tbl = match:totable()
+		if tbl[0] ~= match[0] or #tbl ~= #match or tbl.index ~= match.index then
+			return fail("totable mismatch")
+		end
 		for i, val in ipairs(match_wanted) do
 			if val ~= match[i] then
 				return fail(string.format("group %d mismatch, wanted: %s, got: %s", i, match_wanted[i], match[i]))
@@ -115,7 +122,7 @@ local function test_exec(str, regex, flags, want)
 	end
 	local match = r:exec(str)
 	if r.global and match then
-		return fail(string.format("surplus match: %s", match))
+		return fail(string.format("surplus match: %s", tostring(match)))
 	end
 	successes = successes + 1
 end
@@ -245,6 +252,33 @@ local function test_search(str, regex, flags, want)
 	successes = successes + 1
 end
 
+local function test_malformed(str)
+	local function fail(fmt, ...)
+		print(str)
+		print(string.format(fmt, ...))
+		fails = fails + 1
+	end
+	tests = tests + 1
+	local r = jsregexp.compile(".*")
+	-- a valid input is remembered by the regexp, the next ones are validated
+	r:exec("é")
+	-- the jsstring conversion and the lua strings matched in place, twice
+	local exec = function(s) return r:exec(s) end
+	for _, f in ipairs({ jsregexp.to_jsstring, exec, exec }) do
+		local ok, err = pcall(f, str)
+		if ok then
+			return fail("no error for malformed input")
+		end
+		if not string.find(err, "malformed unicode", 1, true) then
+			return fail("error mismatch, got %s", err)
+		end
+	end
+	if r:exec("é")[0] ~= "é" then
+		return fail("valid input not matched after malformed input")
+	end
+	successes = successes + 1
+end
+
 local function test_split(str, regex, flags, want)
 	local function fail(fmt, ...)
 		print(str, regex, flags, want)
@@ -306,8 +340,43 @@ local function test_replace_all(str, regex, flags, replacement, want)
 	successes = successes + 1
 end
 
+-- want is the expected error message, or nil if the execution should succeed
+-- the regexp is first run warmup times without limits, native code is used
+-- after JIT_EXEC_THRESHOLD runs
+local function test_limit(str, regex, flags, limits, want, warmup)
+	local function fail(fmt, ...)
+		print(str, regex, flags, want)
+		print(string.format(fmt, ...))
+		fails = fails + 1
+	end
+	tests = tests + 1
+	local r = jsregexp.compile_safe(regex, flags)
+	if not r then
+		return fail("compilation error")
+	end
+	for _ = 1, warmup or 0 do
+		r:exec(str)
+	end
+	for key, val in pairs(limits) do
+		r[key] = val
+	end
+	local ok, err = pcall(r.exec, r, str)
+	if want and ok then
+		return fail("no error, wanted %s", want)
+	end
+	if not want and not ok then
+		return fail("unexpected error %s", err)
+	end
+	if want and not string.find(err, want, 1, true) then
+		return fail("error mismatch, wanted %s, got %s", want, err)
+	end
+	successes = successes + 1
+end
+
 test_compile("dummy", "(.*", "", nil)
 test_compile("dummy", "[", "", nil)
+test_compile("dummy", "(a)\\1", "l", nil)
+test_compile("dummy", "a(?=b)", "l", nil)
 
 -- 0xfd (together with other weird chars) crashes lre_compile if not caught
 -- (luajit at least..)
@@ -321,6 +390,46 @@ test_exec(
 	"g",
 	{ { [0] = "The quick", "The", "quick" }, { [0] = "brown fox", "brown", "fox" } }
 )
+test_exec("log: ERROR: disk full", "ERROR: (\\w+)", "", { { [0] = "ERROR: disk", "disk" } })
+test_exec("ERROR ERROR:. ERROR: x", "ERROR: (\\w+)", "g", { { [0] = "ERROR: x", "x" } })
+test_exec("😀a😀b", "[ab]", "g", { { [0] = "a" }, { [0] = "b" } })
+test_exec("red 1", "(?<color>\\w+) (x)?(?<n>\\d)", "", { { [0] = "red 1", "red", "", "1", groups = { color = "red", n = "1" } } })
+test_exec("y", "(?<a>x)|(?<a>y)", "", { { [0] = "y", "", "y", groups = { a = "y" } } })
+test_exec("αβ ERROR: γ", "ERROR: (.)", "", { { [0] = "ERROR: γ", "γ" } })
+test_exec("the Quick brown", "[A-Z]\\w+", "", { { [0] = "Quick" } })
+test_exec("a BAR or a foo", "(foo|bar)", "gi", { { [0] = "BAR", "BAR" }, { [0] = "foo", "foo" } })
+test_exec("abc αβγ", "[α-ω]+", "", { { [0] = "αβγ" } })
+test_exec("bob@example.org, eve@example.com", "\\w+@example\\.com", "", { { [0] = "eve@example.com" } })
+test_exec("request timeout\nok", "^.*timeout.*$", "m", { { [0] = "request timeout" } })
+test_exec("12-34 5678", "\\d+-\\d+", "g", { { [0] = "12-34" } })
+test_exec("ok ok", "\\w+ fail", "g", {})
+test_exec("xyzxyzxyzq", "(?:xyz){2,5}q", "y", { { [0] = "xyzxyzxyzq" } })
+test_exec("key = value;", "^(\\w+)\\s*=\\s*(\\w*)", "", { { [0] = "key = value", "key", "value" } })
+test_exec("ac", "^(?:ab)?", "", { { [0] = "" } })
+test_exec("abab", "^ab", "g", { { [0] = "ab" } })
+test_exec("12ab", "(\\d)+", "y", { { [0] = "12", "2" } })
+test_exec("aaaa!", "(a+)+$", "l", {})
+test_exec("2024-01-15", "^(\\d+)-(\\d+)-(\\d+)$", "l", { { [0] = "2024-01-15", "2024", "01", "15" } })
+test_exec("aabab", "(a|ab)*b", "gl", { { [0] = "aab", "a" }, { [0] = "ab", "a" } })
+test_exec("x ba ab", "(?:(a)|b){2,3}", "l", { { [0] = "ba", "a" } })
+-- the memo of the nested loops covers the positions from the start of each call
+test_exec("ab " .. string.rep("a", 40) .. "c aab", "(?:a+)+b", "g", { { [0] = "ab" }, { [0] = "aab" } })
+-- the nodes of the switch trie which match the same suffixes are shared
+test_exec("xcbx ab dbxy", "[\\q{abx|cbx|dbx|ab}]", "gv", { { [0] = "cbx" }, { [0] = "ab" }, { [0] = "dbx" } })
+test_exec("1 👩🏽‍🚀 👨🏾‍⚕️ 🇫🇷", "\\p{RGI_Emoji}", "gv", { { [0] = "👩🏽‍🚀" }, { [0] = "👨🏾‍⚕️" }, { [0] = "🇫🇷" } })
+-- the later matches run on native code
+test_exec("a1 bb2 c3 dd4 e5 ff6 g7 hh8 i9 jj0", "(\\w+?)(\\d)", "g", {
+	{ [0] = "a1", "a", "1" },
+	{ [0] = "bb2", "bb", "2" },
+	{ [0] = "c3", "c", "3" },
+	{ [0] = "dd4", "dd", "4" },
+	{ [0] = "e5", "e", "5" },
+	{ [0] = "ff6", "ff", "6" },
+	{ [0] = "g7", "g", "7" },
+	{ [0] = "hh8", "hh", "8" },
+	{ [0] = "i9", "i", "9" },
+	{ [0] = "jj0", "jj", "0" },
+})
 test_exec("The quick brown fox", "(?<word1>\\w+) (\\w+)", "g", {
 	{ [0] = "The quick", "The", "quick", groups = { word1 = "The" } },
 	{ [0] = "brown fox", "brown", "fox", groups = { word1 = "brown" } },
@@ -362,6 +471,26 @@ test_test("a.c", jsregexp.escape("a.c"), "", { true })
 test_test("The quick brown", "\\w+", "", { true })
 test_test("The quick brown", "\\d+", "", { false })
 test_test("The quick brown", "\\w+", "g", { true, true, true })
+test_test("aa bb cd", "(\\w)\\1", "g", { true, true })
+test_test("😀a😀a", "(a)", "g", { true, true })
+test_test("abab", "(a)b", "y", { true, true })
+test_test(string.rep("x", 40), "(x+x+)+y", "", { false })
+test_test(string.rep("ab", 40) .. "c", "(a|ab)(c|bcd)", "", { true })
+test_test(string.rep("word ", 20) .. "end", "\\bend$", "", { true })
+test_test(string.rep("a=1 ", 20) .. "b=9", "[b-z]=9", "", { true })
+-- the DFA states are kept between the calls
+test_test("xx 2024-01-15 and 2023-12-31 but not 1999", "\\d{4}-\\d\\d-\\d\\dX", "", { false, false, false })
+test_test("xx 2024-01-15 and 2023-12-31 but 1999-01-01X", "\\d{4}-\\d\\d-\\d\\dX", "", { true, true, true })
+test_test(string.rep("a=1 ", 20) .. "b=9", "[b-z]=9\\b", "y", { false })
+test_test(string.rep("a=1 ", 20) .. "b=9 😄", "\\p{RGI_Emoji}", "v", { true })
+test_test("ab12", "^[a-z]+\\d+$", "", { true })
+test_test("ab12c", "^[a-z]+\\d+$", "", { false })
+test_test("µÿé", "^[μŸ\\w]+$", "i", { false })
+test_test("µÿé", "^[μŸé]+$", "i", { true })
+test_test("Kſ", "^ks$", "i", { false })
+test_test("Kſ", "^ks$", "iu", { true })
+test_test("Привет ПРИВЕТ", "^(\\S+) \\1$", "i", { true })
+test_test("ǅ ǆ Ǆ σ ς Σ", "^(\\S) \\1 \\1 (\\S) \\2 \\2$", "iu", { true })
 
 test_test("π", "\\p{Script_Extensions=Greek}", "u", { true })
 test_test("π", "[\\p{Script_Extensions=Greek}--π]", "v", { false })
@@ -374,7 +503,18 @@ test_test("👨🏾‍⚕️", "^\\p{Emoji}$", "u", { false })
 test_test("⚽", "^\\p{RGI_Emoji}$", "v", { true })
 test_test("👨🏾‍⚕️", "^\\p{RGI_Emoji}$", "v", { true })
 test_test("😄", "^\\p{RGI_Emoji}$", "v", { true })
+test_match("xabcdd xabd xad", "x[\\q{abcd|abc|ab|a}]d", "gv", { "xabcdd", "xabd", "xad" })
+test_match("xabc xabdc XABD", "x[\\q{abc|abd|ab}][cd]", "giv", { "xabc", "xabdc", "XABD" })
 
+test_match("12.5 7. 3.14", "(\\d+)\\.(\\d?)", "g", { "12.5", "7.", "3.1" })
+test_match("a,bb,c,x", "([^,]*),\\1?", "g", { "a,", "bb,", "c," })
+test_match("😀😀x 😀x", "(.*)\\1x", "gu", { "😀😀x", "x" })
+test_match("<a><bc>", "<(.+?)>", "g", { "<a>", "<bc>" })
+test_match(string.rep("a", 40) .. "c b", "(a+)+b", "", nil)
+test_match(string.rep("ab", 30) .. "!", "^(?:(\\w)+\\s?)*$", "", nil)
+test_match("ab\r\ncd\nef gh", "^\\w", "gm", { "a", "c", "e" })
+test_match("aaa", "^a", "g", { "a" })
+test_match("\n\n", "^$", "gm", { "", "", "" })
 test_match("The quick brown", "\\d+", "g", nil)
 test_match("The quick brown", "\\w+", "g", { "The", "quick", "brown" })
 
@@ -384,6 +524,37 @@ test_match_all_list("𝄞𝄞𐐷𝄞𝄞", "𝄞*", "g", { "𝄞𝄞", "", "
 
 test_search("The quick brown", "nothing", "g", -1)
 test_search("The quick brown", "quick", "g", 5)
+test_search("xaybz", "a.*z|b", "", 2)
+test_search("xabcdy", "abcd|bc|c", "", 2)
+test_search("ab12-34" .. string.rep("x", 100000), "[0-9]+-[0-9]+", "", 3)
+test_search(string.rep("x", 100000) .. "y", "x*y", "", 1)
+test_search("ab\nab", "^b|b$", "", 5)
+test_search("ab\rcd\nab\rb", "^b", "m", 10)
+test_search(string.rep("ab\r", 1000) .. "ab\nb\rx", "^b", "m", 3004)
+test_search("ab\r\nab\226\128\168b", "^b", "m", 10)
+test_search("ααβ", "β", "", 5)
+test_search("😀αβ", "β", "u", 7)
+test_search("😀αβ", "β", "", 7)
+test_search("abc", "x*", "", 1)
+test_search(jsregexp.to_jsstring("a\0é"), "é", "", 3)
+test_search(jsregexp.to_jsstring("é\0é"), "\\0é", "", 3)
+test_search(jsregexp.to_jsstring("é\0é"), ".$", "", 4)
+test_search("a\0é", "é", "", 3)
+test_search("é\0é", ".$", "", 4)
+test_test("é\0é", "^é\\0é$", "", { true })
+test_malformed("é\0\240")
+test_malformed("é\0\195")
+test_malformed("\248\136\128\128\128")
+
+test_limit(string.rep("a", 30) .. "b", "(a|aa)+\\1$", "", { max_steps = 1000 }, "step limit exceeded")
+test_limit(string.rep("a", 60) .. "b", "(a|aa)+\\1$", "", { timeout = 1000 }, "timeout")
+test_limit("b" .. string.rep("a", 800), "(?:a{1,50}){1,50}b", "l", { timeout = 1000 }, "timeout")
+test_limit("b" .. string.rep("a", 800), "(?:a{1,50}){1,50}b", "l", { max_steps = 1e5 }, "step limit exceeded")
+test_limit(string.rep("ab", 2000), "(?:(a)|b)*$", "", { max_stack = 1024 }, "stack limit exceeded")
+test_limit(string.rep("ab", 200), "(?:(a)|b)*$", "", { max_stack = 1024 }, "stack limit exceeded", 1)
+test_limit(string.rep("ab", 2000), "(?:(a)|b)*$", "", { max_steps = 1e6, timeout = 1e6, max_stack = 1e6 }, nil)
+test_limit(string.rep("a", 16) .. "b", "(a|aa)+$", "", { max_steps = 1000 }, "step limit exceeded", 10)
+test_limit(string.rep("ab", 2000), "(\\w+)\\s(\\w+)", "", { max_steps = 1e5 }, nil, 10)
 
 test_split("abc", "x", "g", { "abc" })
 test_split("", "a?", "g", {})